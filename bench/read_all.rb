@@ -0,0 +1,28 @@
+$:.unshift "."
+require File.dirname(__FILE__) + '/../ext/aio/aio'
+require "benchmark"
+require "tmpdir"
+require "fileutils"
+
+FILES = (ENV['FILES'] || 10_000).to_i
+DIR = File.join(Dir.tmpdir, "aio_read_all_#{$$}")
+
+begin
+  puts "* Writing #{FILES} small files to #{DIR} ..."
+  FileUtils.mkdir_p(DIR)
+  PATHS = (1..FILES).map do |f|
+    path = File.join(DIR, "#{f}.txt")
+    File.open(path, 'w'){|io| io << ("%08d" % f) * (1 + f % 64) }
+    path
+  end
+
+  puts "* Bench whole file reads ..."
+  Benchmark.bmbm do |results|
+    results.report("AIO.read_all") { AIO.read_all( PATHS ) }
+    results.report("AIO.read_all(:concurrency => 256)") { AIO.read_all( PATHS, :concurrency => 256 ) }
+    results.report("IO.read") { PATHS.map{|p| IO.read(p) } }
+    results.report("File.read") { PATHS.map{|p| File.read(p) } }
+  end
+ensure
+  FileUtils.rm_rf(DIR)
+end
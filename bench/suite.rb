@@ -0,0 +1,177 @@
+$:.unshift "."
+require File.dirname(__FILE__) + '/../ext/aio/aio'
+require "benchmark"
+require "tmpdir"
+require "fileutils"
+require "json"
+require "rbconfig"
+
+# Parametric I/O benchmark. Every parameter takes a comma separated list and the
+# suite runs each combination :
+#
+#   SIZE     data file size per thread, with k / m / g suffixes   (64m)
+#   BLOCK    request size                                         (4k)
+#   DEPTH    requests per AIO.lio_listio batch (queue depth)      (1,8,32)
+#   PATTERN  seq or rand offsets                                  (seq,rand)
+#   MIX      percentage of reads, the rest are writes             (100,70,0)
+#   DIRECT   open data files with O_DIRECT, 0 or 1                (0)
+#   THREADS  submitting threads, each on it's own data file       (1)
+#
+# OPS requests are issued per thread and combination (4096). Data files are
+# generated in DIR (a temporary directory) - tmpfs doesn't support O_DIRECT, so
+# point DIR at a disk backed file system for DIRECT=1. Results are written to
+# OUTPUT (bench_output.json) and, given a previous OUTPUT as BASELINE, compared
+# against it : combinations that lost more than TOLERANCE percent (10) of their
+# IOPS or grew their p99 latency by as much are flagged and fail the run.
+
+def sizes(value)
+  value.split(',').map do |v|
+    n = v.to_f
+    case v[/[kmg]\z/i].to_s.downcase
+      when 'k' then n *= 1024
+      when 'm' then n *= 1024 ** 2
+      when 'g' then n *= 1024 ** 3
+    end
+    n.to_i
+  end
+end
+
+def list(name, default)
+  (ENV[name] || default).split(',')
+end
+
+SIZES = sizes(ENV['SIZE'] || '64m')
+BLOCKS = sizes(ENV['BLOCK'] || '4k')
+DEPTHS = list('DEPTH', '1,8,32').map{|d| d.to_i }
+PATTERNS = list('PATTERN', 'seq,rand')
+MIXES = list('MIX', '100,70,0').map{|m| m.to_i }
+DIRECTS = list('DIRECT', '0').map{|d| d == '1' }
+THREADS = list('THREADS', '1').map{|t| t.to_i }
+OPS = (ENV['OPS'] || 4096).to_i
+DIR = ENV['DIR'] || File.join(Dir.tmpdir, "aio_bench_#{$$}")
+OUTPUT = ENV['OUTPUT'] || 'bench_output.json'
+TOLERANCE = (ENV['TOLERANCE'] || 10).to_f / 100
+
+def data_file(size, thread)
+  path = File.join(DIR, "#{size}.#{thread}.dat")
+  return path if File.exist?(path)
+  chunk = (0...1024 * 1024).map{ rand(256).chr }.join
+  File.open(path, 'wb') do |f|
+    (size / chunk.size).times{ f.write(chunk) }
+    f.write(chunk[0, size % chunk.size])
+    f.fsync
+  end
+  path
+end
+
+def cpu_time
+  t = Process.times
+  t.utime + t.stime
+end
+
+# One thread's share of a run : OPS requests in batches of depth, each batch
+# submitted with AIO.lio_listio and waited on as a whole.
+def worker(params, thread)
+  file = File.open(data_file(params[:size], thread), params[:mix] > 0 ? File::RDWR : File::WRONLY)
+  blocks = params[:size] / params[:block]
+  payload = 'w' * params[:block]
+  cbs = (1..params[:depth]).map do
+    cb = AIO::CB.new
+    cb.fildes = file.fileno
+    if params[:direct]
+      cb.direct = true
+    else
+      cb.into = "\0" * params[:block]
+    end
+    cb
+  end
+  cursor = 0
+  (OPS / params[:depth]).times do
+    cbs.each do |cb|
+      block = params[:pattern] == 'rand' ? rand(blocks) : (cursor += 1) % blocks
+      cb.offset = block * params[:block]
+      if rand(100) < params[:mix]
+        cb.lio_opcode = AIO::READ
+        cb.nbytes = params[:block]
+      else
+        cb.lio_opcode = AIO::WRITE
+        cb.buf = payload
+      end
+    end
+    AIO.lio_listio( *cbs )
+  end
+ensure
+  file.close if file
+end
+
+def run(params)
+  params[:threads].times{|t| data_file(params[:size], t) }
+  AIO.reset_stats
+  cpu = cpu_time
+  wall = Benchmark.realtime do
+    (1..params[:threads]).map{|t| Thread.new{ worker(params, t - 1) } }.each{|t| t.join }
+  end
+  cpu = cpu_time - cpu
+  stats = AIO.stats
+  ops = stats[:read][:completed] + stats[:write][:completed]
+  bytes = stats[:read][:bytes] + stats[:write][:bytes]
+  latency = %w(read write).select{|op| stats[op.to_sym][:completed] > 0 }.inject({}) do |h, op|
+    l = stats[op.to_sym][:latency]
+    h.update(op => {'p50' => l[:p50], 'p99' => l[:p99], 'p999' => l[:p999]})
+  end
+  { 'iops' => ops / wall, 'mib_s' => bytes / wall / 1024 ** 2, 'wall' => wall, 'cpu' => cpu,
+    'cpu_per_op' => ops > 0 ? cpu / ops : 0, 'errors' => stats[:read][:errors] + stats[:write][:errors],
+    'latency' => latency }
+rescue AIO::Error, SystemCallError, NotImplementedError, NameError => e
+  { 'error' => "#{e.class}: #{e.message}" }
+end
+
+def label(params)
+  "size=%s block=%d depth=%d %s mix=%d%% direct=%d threads=%d" % [params[:size], params[:block], params[:depth],
+    params[:pattern], params[:mix], params[:direct] ? 1 : 0, params[:threads]]
+end
+
+def p99(result)
+  result['latency'].values.map{|l| l['p99'] }.max.to_f
+end
+
+def compare(results)
+  baseline = JSON.parse(File.read(ENV['BASELINE']))['results']
+  previous = baseline.inject({}){|h, r| h.update(r['label'] => r) }
+  regressions = results.select do |r|
+    before = previous[r['label']]
+    next false unless before && !before['error'] && !r['error']
+    slower = r['iops'] < before['iops'] * (1 - TOLERANCE)
+    laggier = p99(r) > p99(before) * (1 + TOLERANCE)
+    puts "%-72s %+7.1f%% IOPS %+7.1f%% p99%s" % [r['label'], (r['iops'] / before['iops'] - 1) * 100,
+      p99(before) > 0 ? (p99(r) / p99(before) - 1) * 100 : 0, slower || laggier ? '  REGRESSION' : '']
+    slower || laggier
+  end
+  abort "* #{regressions.size} regression(s) against #{ENV['BASELINE']}" if regressions.any?
+end
+
+begin
+  FileUtils.mkdir_p(DIR)
+  puts "* Benchmarking against the #{AIO::BACKEND} backend, #{OPS} requests per thread ..."
+  results = []
+  SIZES.product(BLOCKS, DEPTHS, PATTERNS, MIXES, DIRECTS, THREADS).each do |size, block, depth, pattern, mix, direct, threads|
+    params = {:size => size, :block => block, :depth => depth, :pattern => pattern, :mix => mix, :direct => direct, :threads => threads}
+    result = run(params)
+    if result['error']
+      puts "%-72s %s" % [label(params), result['error']]
+    else
+      l = result['latency'].values.first || {}
+      puts "%-72s %9.0f IOPS %9.1f MiB/s cpu %6.2fs p50 %8.1fus p99 %8.1fus p999 %8.1fus" % [label(params),
+        result['iops'], result['mib_s'], result['cpu'], l['p50'].to_f * 1e6, l['p99'].to_f * 1e6, l['p999'].to_f * 1e6]
+    end
+    results << params.inject({'label' => label(params)}){|h, (k, v)| h.update(k.to_s => v) }.update(result)
+  end
+  File.open(OUTPUT, 'w') do |f|
+    f.write JSON.pretty_generate('backend' => AIO::BACKEND, 'ruby' => RUBY_DESCRIPTION, 'host' => RbConfig::CONFIG['host'],
+      'time' => Time.now.utc.to_s, 'ops' => OPS, 'results' => results)
+  end
+  puts "* Results written to #{OUTPUT}"
+  compare(results) if ENV['BASELINE']
+ensure
+  FileUtils.rm_rf(DIR) unless ENV['DIR']
+end
@@ -9,6 +9,26 @@
 #ifdef _POSIX_ASYNCHRONOUS_IO
 #include <aio.h>
 #endif
+#include <string.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+#ifdef AIO_FIBER_SCHEDULER
+#include <ruby/fiber/scheduler.h>
+#include <ruby/io/buffer.h>
+#endif
 
 #ifndef RSTRING_PTR
 #define RSTRING_PTR(obj) RSTRING(obj)->ptr
@@ -26,10 +46,22 @@
 #define RARRAY_LEN(obj) RARRAY(obj)->len
 #endif
 
+#ifndef HAVE_RB_TAINTED_STR_NEW
+#define rb_tainted_str_new rb_str_new
+#define rb_tainted_str_new2 rb_str_new2
+#endif
+
 #ifdef RUBY19
   #include "ruby/io.h" 
   #define TRAP_BEG
   #define TRAP_END
+  /* Runs func(data) without the GVL, ubf(data2) interrupting it */
+  #ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    #include "ruby/thread.h"
+    #define rb_aio_blocking_region(func, data, ubf, data2) rb_thread_call_without_gvl((void *(*)(void *))(void (*)(void))(func), (data), (ubf), (data2))
+  #else
+    #define rb_aio_blocking_region(func, data, ubf, data2) rb_thread_blocking_region((func), (data), (ubf), (data2))
+  #endif
 #else
   #include "rubysig.h"
   #include "rubyio.h"
@@ -42,25 +74,276 @@
   #define AIO_MAX_LIST 16
 #endif
 
+/* Default number of requests AIO.lio_listio keeps in flight */
+#define AIO_MAX_INFLIGHT 64
+
+/* Bounds of the in flight limit while it's tuned from completion latency */
+#define AIO_MIN_INFLIGHT 4
+#define AIO_MAX_INFLIGHT_CEILING 512
+
+/* Completion latency up to this multiple of the baseline counts as flat */
+#define AIO_LATENCY_TOLERANCE 1.5
+
+/* Resubmission of requests the kernel / library queue is too full for (EAGAIN) :
+   exponential backoff in microseconds, up to AIO_SUBMIT_RETRIES attempts */
+#define AIO_BACKOFF_MIN 50
+#define AIO_BACKOFF_MAX 10000
+#define AIO_SUBMIT_RETRIES 1000
+
+/* Request priority classes */
+#define AIO_INTERACTIVE 0
+#define AIO_NORMAL 1
+#define AIO_BACKGROUND 2
+#define AIO_CLASSES 3
+
+/* Share of the in flight limit background requests get while others are in flight */
+#define AIO_BACKGROUND_SHARE 0.25
+
+/* Kernel I/O priorities for io_uring requests, from linux/ioprio.h */
+#define AIO_IOPRIO_CLASS_BE 2
+#define AIO_IOPRIO_CLASS_SHIFT 13
+#define AIO_IOPRIO(class, level) (((class) << AIO_IOPRIO_CLASS_SHIFT) | (level))
+
+/* Cache hit fast path for blocking reads : largest read tried inline, and how a
+   read fared */
+#define AIO_FASTPATH_MAX (256 * 1024)
+#define AIO_FASTPATH_HIT 1
+#define AIO_FASTPATH_PARTIAL 2
+
+/* AIO.prefetch :track reads are split into requests of at most this size, all
+   reading into the same discard buffer */
+#define AIO_PREFETCH_CHUNK (1024 * 1024)
+
+/* Operations AIO.stats accounts for */
+#define AIO_OP_READ 0
+#define AIO_OP_WRITE 1
+#define AIO_OP_FSYNC 2
+#define AIO_OP_CANCEL 3
+#define AIO_OPS 4
+
+/* Latency histograms : log-linear buckets over nanoseconds, AIO_HISTOGRAM_SUB per
+   power of two (within 12.5%), saturating at 2^AIO_HISTOGRAM_RANGE ns (~18 minutes) */
+#define AIO_HISTOGRAM_SUB_BITS 3
+#define AIO_HISTOGRAM_SUB (1 << AIO_HISTOGRAM_SUB_BITS)
+#define AIO_HISTOGRAM_RANGE 40
+#define AIO_HISTOGRAM_BUCKETS ((AIO_HISTOGRAM_RANGE - AIO_HISTOGRAM_SUB_BITS + 1) * AIO_HISTOGRAM_SUB)
+
+/* USDT probes for bpftrace / SystemTap, where sys/sdt.h is available. Requests
+   are identified by their control block address.
+     aio:submit   (request, op, fd, offset, nbytes)
+     aio:retry    (request, op, attempt)
+     aio:complete (request, op, result, errno, latency in ns)
+     aio:cancel   (fd, request, result) */
+#ifdef HAVE_SYS_SDT_H
+  #define AIO_PROBE_SUBMIT(cbs) DTRACE_PROBE5(aio, submit, cbs, (cbs)->op, (cbs)->cb.aio_fildes, (long long)(cbs)->cb.aio_offset, (cbs)->cb.aio_nbytes)
+  #define AIO_PROBE_RETRY(cbs, attempt) DTRACE_PROBE3(aio, retry, cbs, (cbs)->op, attempt)
+  #define AIO_PROBE_COMPLETE(cbs, ret, err, ns) DTRACE_PROBE5(aio, complete, cbs, (cbs)->op, (long)(ret), err, ns)
+  #define AIO_PROBE_CANCEL(fd, cbs, ret) DTRACE_PROBE3(aio, cancel, fd, cbs, ret)
+#else
+  #define AIO_PROBE_SUBMIT(cbs)
+  #define AIO_PROBE_RETRY(cbs, attempt)
+  #define AIO_PROBE_COMPLETE(cbs, ret, err, ns) (void)(ns)
+  #define AIO_PROBE_CANCEL(fd, cbs, ret)
+#endif
+
+/* 64 bit file offsets and buffer lengths, for 1.8 */
+#ifndef NUM2OFFT
+  #define NUM2OFFT(x) ((off_t)NUM2LL(x))
+#endif
+#ifndef OFFT2NUM
+  #define OFFT2NUM(x) LL2NUM(x)
+#endif
+#ifndef NUM2SIZET
+  #define NUM2SIZET(x) ((size_t)NUM2ULONG(x))
+#endif
+#ifndef SIZET2NUM
+  #define SIZET2NUM(x) ULONG2NUM(x)
+#endif
+#ifndef SSIZET2NUM
+  #define SSIZET2NUM(x) LONG2NUM(x)
+#endif
+
+/* AIO.each_chunk defaults */
+#define AIO_STREAM_CHUNK (1024 * 1024)
+#define AIO_STREAM_DEPTH 4
+
+/* Longest the dispatcher sleeps on POSIX AIO before looking for newly registered
+   requests, in nanoseconds */
+#define AIO_DISPATCH_POLL 10000000L
+
+/* AIO.read_parallel default segment count, segments start on this boundary */
+#define AIO_PARALLEL_SEGMENTS 8
+#define AIO_PARALLEL_ALIGN 4096
+
+#ifndef O_CLOEXEC
+  #define O_CLOEXEC 0
+#endif
+
+/* Buffers per vectored request */
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
+#ifndef RB_GC_GUARD
+#define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+
+#ifndef RB_BLOCK_CALL_FUNC_ARGLIST
+#define RB_BLOCK_CALL_FUNC_ARGLIST(yielded_arg, callback_arg) VALUE yielded_arg, VALUE callback_arg
+#endif
+
 static VALUE mAio, eAio;
 
-VALUE rb_cCB;
+VALUE rb_cCB, rb_cJournal, rb_cAppendLog, rb_cMap, rb_cRequest, rb_cBatch, rb_mScheduler;
 
 typedef struct aiocb aiocb_t;
 
+/* A buffer leased from the arena */
+typedef struct{
+    void *ptr;
+    size_t size;
+    int huge;
+} rb_aio_lease_t;
+
+/* Request handle and deadline state, only allocated for control blocks submitted
+   without waiting on them or given a deadline */
 typedef struct{
+    int collected;
+    VALUE value;
+    double deadline;
+    double expires;
+#ifdef HAVE_IO_URING
+    struct{
+      int64_t tv_sec;
+      long long tv_nsec;
+    } timeout;
+#endif
+} rb_aio_request_t;
+
+typedef struct rb_aiocb_s{
     aiocb_t cb;
-    int bufsize;
+    rb_aio_lease_t lease;
     int err;
     VALUE io; 
     VALUE rcb;
+    VALUE into;
+    VALUE str;
+    VALUE bufs;
+    ssize_t res;
+    struct iovec iov;
+    struct iovec *iovs;
+    int iovcnt;
+    int fsync;
+    rb_aio_request_t *req;
+    int op;
+    double queued;
+    double submitted;
+    double completed;
+    int priority;
+    int direct;
+    size_t align_mem;
+    size_t align_io;
+    int fastpath;
+    ssize_t fast;
+    int linked;
+    struct rb_aiocb_s *next;
+    struct rb_aiocb_s *prev;
 } rb_aiocb_t;
 
-static struct sigevent rb_aio_sig_event;
+/*
+ *  A control block's request state, allocated on first use.
+ */
+static rb_aio_request_t *
+rb_aio_request(rb_aiocb_t *cbs)
+{
+    if (!cbs->req){
+      cbs->req = ALLOC(rb_aio_request_t);
+      MEMZERO(cbs->req, rb_aio_request_t, 1);
+      cbs->req->value = Qnil;
+    }
+    return cbs->req;
+}
+
+#define rb_aio_collected(cbs) ((cbs)->req && (cbs)->req->collected)
+#define rb_aio_deadline(cbs) ((cbs)->req ? (cbs)->req->deadline : 0)
+#define rb_aio_expires(cbs) ((cbs)->req ? (cbs)->req->expires : 0)
 
-static ID s_to_str, s_to_s, s_buf;
+/* Completion notification descriptors, an eventfd or the ends of a pipe */
+static int rb_aio_notify_rd = -1, rb_aio_notify_wr = -1;
+static VALUE rb_aio_completion_io = Qnil;
 
-static VALUE c_aio_sync, c_aio_queue, c_aio_inprogress, c_aio_alldone;
+static int rb_aio_max_inflight = AIO_MAX_INFLIGHT;
+
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+static int rb_aio_fastpath_enabled = 1;
+#else
+static int rb_aio_fastpath_enabled = 0;
+#endif
+
+/* In flight limit tuning : additive increase while completion latency (an EWMA,
+   in seconds) stays within AIO_LATENCY_TOLERANCE of the lowest seen, multiplicative
+   decrease when it climbs past that or submissions hit EAGAIN. Evaluated once per
+   window of max_inflight completions. */
+static struct{
+    int adaptive;
+    double latency;
+    double baseline;
+    int samples;
+    unsigned long backoffs;
+} rb_aio_tuner = {1, 0, 0, 0, 0};
+
+/* Requests submitted per priority class, linked through next / prev until seen
+   completed. Background submissions are held back while they'd take more than
+   their share of the in flight limit from the other classes. Only touched with
+   the GVL held. */
+static struct{
+    rb_aiocb_t *inflight[AIO_CLASSES];
+    int count[AIO_CLASSES];
+    double background_share;
+    unsigned long throttled;
+} rb_aio_classes = {{NULL, NULL, NULL}, {0, 0, 0}, AIO_BACKGROUND_SHARE, 0};
+
+typedef struct{
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long long buckets[AIO_HISTOGRAM_BUCKETS];
+} rb_aio_histogram_t;
+
+typedef struct{
+    unsigned long long submitted;
+    unsigned long long completed;
+    unsigned long long errors;
+    unsigned long long cancelled;
+    unsigned long long retries;
+    unsigned long long bytes;
+    rb_aio_histogram_t latency;
+    rb_aio_histogram_t queued;
+} rb_aio_op_stats_t;
+
+/* Instrumentation behind AIO.stats, per operation. depth sums the requests in
+   flight as each was submitted. Only touched with the GVL held. */
+static struct{
+    rb_aio_op_stats_t ops[AIO_OPS];
+    struct{
+      unsigned long long hits;
+      unsigned long long partial;
+      unsigned long long misses;
+      unsigned long long bytes;
+    } fastpath;
+    unsigned long long depth;
+    int inflight_max;
+    double since;
+} rb_aio_stats;
+
+/* Control blocks with callbacks awaiting completion, and the thread running them */
+static VALUE rb_aio_dispatch_pending = Qnil;
+static VALUE rb_aio_dispatcher = Qnil;
+
+static ID s_to_str, s_to_s, s_buf, s_into, s_direct, s_map, s_track, s_chunk_size, s_depth, s_segments, s_concurrency, s_alive_p, s_buffer_size, s_preallocate, s_iv_cb, s_iv_requests;
+
+static VALUE c_aio_sync, c_aio_dsync, c_aio_queue, c_aio_inprogress, c_aio_alldone;
 static VALUE c_aio_canceled, c_aio_notcanceled, c_aio_wait, c_aio_nowait;
 static VALUE c_aio_nop, c_aio_read, c_aio_write;
 
@@ -71,22 +354,59 @@ inspect_aiocb(const char* func,aiocb_t *cb)
            func, cb->aio_fildes, cb->aio_buf, sizeof(cb->aio_buf), cb->aio_nbytes, cb->aio_offset, cb->aio_reqprio, cb->aio_lio_opcode);
 }
 
-void 
-rb_aio_completion_handler(int signo, siginfo_t *info, void *context) 
+/*
+ *  Flags a completion on the notification descriptor. Invoked by glibc on a
+ *  notification thread (SIGEV_THREAD) for POSIX AIO requests submitted with
+ *  AIO::NOWAIT - on io_uring a write to the eventfd is linked behind each.
+ */
+static void
+rb_aio_completion_notify(union sigval value)
 {
+#ifdef HAVE_SYS_EVENTFD_H
+    eventfd_write(rb_aio_notify_wr, 1);
+#else
+    char c = 1;
+    if (write(rb_aio_notify_wr, &c, 1) == -1 && errno != EAGAIN) return;
+#endif
 }
 
-void
-setup_rb_aio_signals() {
-    struct sigaction sig_act;
-    memset(&sig_act, 0, sizeof(sig_act));
-    sigemptyset(&sig_act.sa_mask);
-    sig_act.sa_sigaction = rb_aio_completion_handler;
-    sig_act.sa_flags = SA_SIGINFO;
-    sigaction(SIGIO, &sig_act, NULL);
+/*
+ *  Configures how a request reports completion. Requests that are waited on
+ *  don't notify at all, AIO::NOWAIT submissions flag the completion descriptor.
+ */
+static void
+rb_aio_sigevent(aiocb_t *cb, int mode)
+{
+    memset(&cb->aio_sigevent, 0, sizeof(struct sigevent));
+    if (mode == LIO_NOWAIT){
+      cb->aio_sigevent.sigev_notify = SIGEV_THREAD;
+      cb->aio_sigevent.sigev_notify_function = rb_aio_completion_notify;
+      cb->aio_sigevent.sigev_value.sival_ptr = cb;
+    }else{
+      cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+    }
+}
 
-    rb_aio_sig_event.sigev_notify = SIGEV_SIGNAL;
-    rb_aio_sig_event.sigev_signo = SIGIO;
+/*
+ *  Sets up the completion notification descriptor : an eventfd on Linux, a non
+ *  blocking pipe elsewhere.
+ */
+static void
+setup_rb_aio_notification(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    rb_aio_notify_rd = rb_aio_notify_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rb_aio_notify_rd == -1) rb_sys_fail("eventfd");
+#else
+    int fds[2];
+    if (pipe(fds) == -1) rb_sys_fail("pipe");
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    rb_aio_notify_rd = fds[0];
+    rb_aio_notify_wr = fds[1];
+#endif
 }
 
 static void 
@@ -95,739 +415,5700 @@ rb_aio_error(const char * msg)
     rb_raise( eAio, msg );
 }
 
+/*
+ *  Buffer arena. Control block buffers are leased from per size class free lists
+ *  of page aligned chunks (4KB through 64MB in powers of two) and returned on
+ *  close, reset or GC, so steady state I/O doesn't touch the heap. Requests beyond
+ *  the largest class are served by dedicated allocations. Chunks of 2MB and up
+ *  are backed by hugepages when enabled and available. Memory held by the arena
+ *  is reported to the Ruby GC where supported.
+ */
+#define AIO_ARENA_MIN_SHIFT 12
+#define AIO_ARENA_CLASSES 15
+#define AIO_ARENA_HUGEPAGE (2 * 1024 * 1024)
+#define AIO_ARENA_MAX_IDLE (64 * 1024 * 1024)
+
+typedef struct rb_aio_chunk{
+    struct rb_aio_chunk *next;
+    int huge;
+} rb_aio_chunk_t;
+
+static struct{
+    rb_aio_chunk_t *free[AIO_ARENA_CLASSES];
+    size_t allocated;
+    size_t leased;
+    size_t idle;
+    size_t max_idle;
+    unsigned long hits;
+    unsigned long misses;
+    int hugepages;
+} rb_aio_arena = { {NULL}, 0, 0, 0, AIO_ARENA_MAX_IDLE, 0, 0, 0 };
+
 static void
-setup_aio_buffer(rb_aiocb_t *cbs)
+rb_aio_arena_account(ssize_t bytes)
 {
-    if (!cbs->cb.aio_buf){ 
-      cbs->cb.aio_buf = malloc(cbs->bufsize);
-    }else{ 
-      if (cbs->bufsize != cbs->cb.aio_nbytes){
-        cbs->bufsize = cbs->cb.aio_nbytes + 1;
-        cbs->cb.aio_buf = realloc((void*)cbs->cb.aio_buf,cbs->bufsize);
-      }
-    }
-    if (!cbs->cb.aio_buf) rb_aio_error("Not able to allocate / resize the AIO buffer");
+    rb_aio_arena.allocated += bytes;
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    rb_gc_adjust_memory_usage(bytes);
+#endif
 }
 
-#define GetCBStruct(obj)	(Check_Type(obj, T_DATA), (rb_aiocb_t*)DATA_PTR(obj))
-
-static void 
-mark_control_block(rb_aiocb_t *cb)
+static int
+rb_aio_arena_class(size_t size)
 {
-    rb_gc_mark(cb->io);
-    rb_gc_mark(cb->rcb);
+    int cls = 0;
+    size_t chunk = (size_t)1 << AIO_ARENA_MIN_SHIFT;
+    while (chunk < size && cls < AIO_ARENA_CLASSES) {
+      chunk <<= 1;
+      cls++;
+    }
+    return cls;
 }
 
-static void 
-free_control_block(rb_aiocb_t* cb)
+static void *
+rb_aio_arena_map(size_t size, int *huge)
 {
-    xfree(cb);
+    void *ptr = NULL;
+    *huge = 0;
+#if defined(MAP_HUGETLB) && defined(MAP_ANONYMOUS)
+    if (rb_aio_arena.hugepages && size >= AIO_ARENA_HUGEPAGE && size % AIO_ARENA_HUGEPAGE == 0){
+      ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      if (ptr != MAP_FAILED){
+        *huge = 1;
+        return ptr;
+      }
+    }
+#endif
+    if (posix_memalign(&ptr, getpagesize(), size) != 0) return NULL;
+    return ptr;
 }
 
-static VALUE
-control_block_nbytes_set(VALUE cb, VALUE bytes)
+static void
+rb_aio_arena_unmap(void *ptr, size_t size, int huge)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    Check_Type(bytes, T_FIXNUM);
-    cbs->cb.aio_nbytes = FIX2INT(bytes);
-    setup_aio_buffer(cbs);
-    return bytes;
+    if (huge){
+      munmap(ptr, size);
+    }else{
+      free(ptr);
+    }
+    rb_aio_arena_account(-(ssize_t)size);
 }
 
-static VALUE
-control_block_open(int argc, VALUE *argv, VALUE cb)
+/*
+ *  Leases a page aligned buffer of at least size bytes. GVL held.
+ */
+static int
+rb_aio_arena_lease(rb_aio_lease_t *lease, size_t size)
 {
-    const char *fmode;
-#ifdef RUBY19
-    rb_io_t *fptr;
-#else	
-    OpenFile *fptr;
-#endif
-    VALUE file, mode;
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    rb_scan_args(argc, argv, "02", &file, &mode);
-    fmode = NIL_P(mode) ? "r" : RSTRING_PTR(mode);
-    struct stat stats;
-   
-    Check_Type(file, T_STRING);
-
-    cbs->io = rb_file_open(RSTRING_PTR(file), fmode);
-    GetOpenFile(cbs->io, fptr);
-    rb_io_check_readable(fptr);
-
-    if ( cbs->cb.aio_fildes == 0 && cbs->cb.aio_nbytes == 0){
-#ifdef RUBY19
-      cbs->cb.aio_fildes = fptr->fd;
-#else	
-      cbs->cb.aio_fildes = fileno(fptr->f);
-#endif
-      fstat(cbs->cb.aio_fildes, &stats);
-      control_block_nbytes_set(cb, INT2FIX(stats.st_size));
+    rb_aio_chunk_t *chunk;
+    int cls = rb_aio_arena_class(size);
+    if (cls < AIO_ARENA_CLASSES){
+      size = (size_t)1 << (AIO_ARENA_MIN_SHIFT + cls);
+      if ((chunk = rb_aio_arena.free[cls])){
+        rb_aio_arena.free[cls] = chunk->next;
+        rb_aio_arena.idle -= size;
+        rb_aio_arena.leased += size;
+        rb_aio_arena.hits++;
+        lease->ptr = chunk;
+        lease->size = size;
+        lease->huge = chunk->huge;
+        return 0;
+      }
+    }else{
+      size = (size + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
     }
-    return cb;    
+    rb_aio_arena.misses++;
+    if (!(lease->ptr = rb_aio_arena_map(size, &lease->huge))){
+      rb_gc();
+      if (!(lease->ptr = rb_aio_arena_map(size, &lease->huge))) return -1;
+    }
+    rb_aio_arena_account(size);
+    rb_aio_arena.leased += size;
+    lease->size = size;
+    return 0;
 }
 
+/*
+ *  Returns a leased buffer to its size class, or to the system if oversized or
+ *  the arena already holds AIO.arena_max_idle bytes of idle buffers. GVL held.
+ */
 static void
-control_block_reset0(rb_aiocb_t *cbs)
-{    
-    bzero((char *)cbs, sizeof(rb_aiocb_t));
-    bzero((char *)&cbs->cb, sizeof(aiocb_t));
-    /* cleanup with rb_io_close(cb->io) */
-    cbs->io = Qnil;
-    cbs->rcb = Qnil;
-    cbs->bufsize = 1;
-    cbs->err = 0;
-    cbs->cb.aio_fildes = 0; 
-    cbs->cb.aio_buf = NULL; 
-    cbs->cb.aio_nbytes = 0;
-    cbs->cb.aio_offset = 0;
-    cbs->cb.aio_reqprio = 0;
-    cbs->cb.aio_lio_opcode = LIO_READ;
-    cbs->cb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-    cbs->cb.aio_sigevent.sigev_signo = SIGIO;
-    cbs->cb.aio_sigevent.sigev_value.sival_int = 12;
-    setup_aio_buffer(cbs);
+rb_aio_arena_release(rb_aio_lease_t *lease)
+{
+    rb_aio_chunk_t *chunk;
+    int cls;
+    if (!lease->ptr) return;
+    rb_aio_arena.leased -= lease->size;
+    cls = rb_aio_arena_class(lease->size);
+    if (cls < AIO_ARENA_CLASSES && lease->size == ((size_t)1 << (AIO_ARENA_MIN_SHIFT + cls)) &&
+        rb_aio_arena.idle + lease->size <= rb_aio_arena.max_idle){
+      chunk = (rb_aio_chunk_t *)lease->ptr;
+      chunk->huge = lease->huge;
+      chunk->next = rb_aio_arena.free[cls];
+      rb_aio_arena.free[cls] = chunk;
+      rb_aio_arena.idle += lease->size;
+    }else{
+      rb_aio_arena_unmap(lease->ptr, lease->size, lease->huge);
+    }
+    lease->ptr = NULL;
+    lease->size = 0;
+    lease->huge = 0;
 }
 
-static VALUE
-control_block_reset(VALUE cb)
+/*
+ *  Frees idle buffers until at most max bytes are held.
+ */
+static void
+rb_aio_arena_trim(size_t max)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    control_block_reset0(cbs);
-    return cb;
+    rb_aio_chunk_t *chunk;
+    int cls;
+    for (cls=AIO_ARENA_CLASSES - 1; cls >= 0 && rb_aio_arena.idle > max; cls--) {
+      while ((chunk = rb_aio_arena.free[cls]) && rb_aio_arena.idle > max) {
+        rb_aio_arena.free[cls] = chunk->next;
+        rb_aio_arena.idle -= (size_t)1 << (AIO_ARENA_MIN_SHIFT + cls);
+        rb_aio_arena_unmap(chunk, (size_t)1 << (AIO_ARENA_MIN_SHIFT + cls), chunk->huge);
+      }
+    }
 }
 
-static VALUE control_block_alloc _((VALUE));
-static VALUE
-control_block_alloc(VALUE klass)
+/*
+ *  Returns a control block's buffer to the arena.
+ */
+static void
+release_aio_buffer(rb_aiocb_t *cbs)
 {
-    VALUE obj;
-    rb_aiocb_t *cbs;
-    obj = Data_Make_Struct(klass, rb_aiocb_t, mark_control_block, free_control_block, cbs);
-    control_block_reset0(cbs);
-    return obj;
+    if (cbs->lease.ptr){
+      if (cbs->cb.aio_buf == cbs->lease.ptr) cbs->cb.aio_buf = NULL;
+      rb_aio_arena_release(&cbs->lease);
+    }
 }
 
-static VALUE
-control_block_initialize(int argc, VALUE *argv, VALUE cb)
+/*
+ *  Ensures the control block holds a leased buffer of at least aio_nbytes, moving
+ *  existing contents over when a larger size class is required.
+ */
+static void
+setup_aio_buffer(rb_aiocb_t *cbs)
 {
-    VALUE file, mode;
-    VALUE args[2];
-    rb_scan_args(argc, argv, "02", &file, &mode);
-    if (RTEST(file)){ 
-      args[0] = file;
-      args[1] = mode;
-      control_block_open(1, (VALUE *)args, cb);
+    rb_aio_lease_t lease;
+    if (cbs->cb.aio_nbytes == 0) return;
+    if (cbs->lease.ptr && cbs->cb.aio_buf == cbs->lease.ptr && cbs->lease.size >= cbs->cb.aio_nbytes) return;
+    if (rb_aio_arena_lease(&lease, cbs->cb.aio_nbytes) != 0) rb_aio_error("Not able to allocate / resize the AIO buffer");
+    if (cbs->lease.ptr){
+      if (cbs->cb.aio_buf == cbs->lease.ptr) memcpy(lease.ptr, cbs->lease.ptr, cbs->lease.size);
+      rb_aio_arena_release(&cbs->lease);
     }
-    if (rb_block_given_p()) rb_obj_instance_eval( 0, 0, cb );
-    return cb;
+    cbs->lease = lease;
+    cbs->cb.aio_buf = lease.ptr;
 }
 
-static VALUE 
-control_block_path(VALUE cb)
-{ 
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-#ifdef RUBY19
-    rb_io_t *fptr;
-#else	
-    OpenFile *fptr;
+/*
+ *  Monotonic time in seconds, for completion latency.
+ */
+static double
+rb_aio_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ *  io_uring submission / completion engine. Requests are described by the same
+ *  aiocb_t the POSIX backend uses and translated into SQEs, with a pointer to the
+ *  owning rb_aiocb_t as user data. Completions are reaped in batches by whichever
+ *  thread is waiting and recorded in the control block (err / res).
+ */
+#ifdef HAVE_IO_URING
+
+#ifndef AIO_URING_ENTRIES
+  #define AIO_URING_ENTRIES 256
 #endif
-    if NIL_P(cbs->io) return rb_tainted_str_new2("");
-    GetOpenFile(cbs->io, fptr);
-    rb_io_check_readable(fptr);
-#ifdef RUBY19
-    return rb_file_s_expand_path( 1, &fptr->pathv );
-#else
-    VALUE path = rb_tainted_str_new2(fptr->path);
-    return rb_file_s_expand_path( 1, &path );
+
+/* AIO.read_all chains : fixed file table size, how much of a file the first chain
+   reads before its size is known and the largest read of a chain */
+#if defined(HAVE_STATX) && defined(HAVE_STRUCT_IO_URING_SQE_FILE_INDEX)
+  #define AIO_CHAINS 1
+  #define AIO_CHAIN_FILES 64
+  #define AIO_CHAIN_READ (16 * 1024)
+  #define AIO_CHAIN_MAX (1 << 30)
 #endif
-}
 
-static VALUE
-control_block_callback_get(VALUE cb)
+typedef struct{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+    unsigned sqe_tail;
+    unsigned pending;
+    unsigned inflight;
+    int reaping;
+    int notify;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#ifdef AIO_CHAINS
+    int chains;
+    char files[AIO_CHAIN_FILES];
+#endif
+} rb_aio_uring_t;
+
+static rb_aio_uring_t *rb_aio_ring = NULL;
+
+static int
+rb_aio_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return cbs->rcb;
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
 }
 
-static VALUE
-control_block_callback_set(VALUE cb, VALUE rcb)
+static void
+rb_aio_uring_teardown(rb_aio_uring_t *ring)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (RBASIC(rcb)->klass != rb_cProc) rb_aio_error("Block required for callback!");
-    cbs->rcb = rcb;
-    return cbs->rcb;
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_sz);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_sz);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
 }
 
-static VALUE
-control_block_fildes_get(VALUE cb)
+#ifdef HAVE_SYS_EVENTFD_H
+static int rb_aio_uring_notify_probe(rb_aio_uring_t *ring);
+#endif
+
+/*
+ *  Sets up and maps a ring. Returns NULL if the kernel doesn't support io_uring
+ *  (or it's disabled) in which case the POSIX AIO backend is used instead.
+ */
+static rb_aio_uring_t *
+rb_aio_uring_setup(unsigned entries)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return INT2FIX(cbs->cb.aio_fildes);
+    struct io_uring_params p;
+    rb_aio_uring_t *ring;
+    char *sq, *cq;
+    memset(&p, 0, sizeof(p));
+    ring = calloc(1, sizeof(rb_aio_uring_t));
+    if (!ring) return NULL;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) goto fail;
+    ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+      if (ring->cq_ring_sz > ring->sq_ring_sz) ring->sq_ring_sz = ring->cq_ring_sz;
+      ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED){ ring->sq_ring = NULL; goto fail; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+      ring->cq_ring = ring->sq_ring;
+    }else{
+      ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED){ ring->cq_ring = NULL; goto fail; }
+    }
+    ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){ ring->sqes = NULL; goto fail; }
+    sq = (char *)ring->sq_ring;
+    cq = (char *)ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+#ifdef HAVE_SYS_EVENTFD_H
+    /* Without IORING_OP_WRITE the eventfd can only be registered, which flags
+       every completion on the ring rather than just AIO::NOWAIT ones */
+    ring->notify = rb_aio_uring_notify_probe(ring);
+    if (!ring->notify && rb_aio_notify_wr != -1) syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &rb_aio_notify_wr, 1);
+#endif
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    return ring;
+fail:
+    rb_aio_uring_teardown(ring);
+    return NULL;
 }
 
-static VALUE
-control_block_fildes_set(VALUE cb, VALUE fd)
+/*
+ *  The child doesn't own the parent's ring - map a fresh one.
+ */
+static void
+rb_aio_uring_atfork_child(void)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    Check_Type(fd, T_FIXNUM);
-    cbs->cb.aio_fildes = FIX2INT(fd);
-    return fd;
+    if (!rb_aio_ring) return;
+    rb_aio_uring_teardown(rb_aio_ring);
+    rb_aio_ring = rb_aio_uring_setup(AIO_URING_ENTRIES);
 }
 
-static VALUE
-control_block_buf_get(VALUE cb)
-{
+/*
+ *  Hands all queued SQEs to the kernel. Entries the kernel can't take right now
+ *  (EAGAIN / EBUSY) stay queued and go out with the next enter. Lock held.
+ */
+static int
+rb_aio_uring_flush(rb_aio_uring_t *ring, unsigned min_complete)
+{
+    int ret;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (!ring->pending && !min_complete) return 0;
+    ret = rb_aio_uring_enter(ring->fd, ring->pending, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (ret > 0) ring->pending -= (unsigned)ret > ring->pending ? ring->pending : (unsigned)ret;
+    return ret;
+}
+
+/*
+ *  Lock held.
+ */
+static struct io_uring_sqe *
+rb_aio_uring_get_sqe(rb_aio_uring_t *ring)
+{
+    unsigned head, idx;
+    struct io_uring_sqe *sqe;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= *ring->sq_entries){
+      rb_aio_uring_flush(ring, 0);
+      head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->sqe_tail - head >= *ring->sq_entries) return NULL;
+    }
+    idx = ring->sqe_tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    ring->pending++;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+#ifdef HAVE_SYS_EVENTFD_H
+/*
+ *  Preps a write flagging the completion descriptor, for hard linking behind an
+ *  AIO::NOWAIT request so it runs however that request ends. Its completion
+ *  carries no user data and is ignored.
+ */
+static void
+rb_aio_uring_notify(struct io_uring_sqe *sqe, const uint64_t *value)
+{
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = rb_aio_notify_wr;
+    sqe->addr = (uintptr_t)value;
+    sqe->len = sizeof(uint64_t);
+    sqe->user_data = 0;
+}
+
+/*
+ *  Whether the kernel runs IORING_OP_WRITE (5.6+), tried with a write of 0 to
+ *  the eventfd which doesn't flag it.
+ */
+static int
+rb_aio_uring_notify_probe(rb_aio_uring_t *ring)
+{
+    static const uint64_t zero = 0;
+    unsigned head;
+    int res;
+    rb_aio_uring_notify(rb_aio_uring_get_sqe(ring), &zero);
+    if (rb_aio_uring_flush(ring, 1) != 1) return 0;
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    res = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res == sizeof(zero);
+}
+#endif
+
+/*
+ *  Records every available completion in its control block. Lock held.
+ */
+static void
+rb_aio_uring_reap(rb_aio_uring_t *ring)
+{
+    struct io_uring_cqe *cqe;
+    rb_aiocb_t *cbs;
+    double now = 0;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return;
+    while (head != tail) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      cbs = (rb_aiocb_t *)(uintptr_t)cqe->user_data;
+      if (cbs){
+        cbs->res = cqe->res;
+        cbs->err = cqe->res < 0 ? -cqe->res : 0;
+        if (!now) now = rb_aio_clock();
+        cbs->completed = now;
+        ring->inflight--;
+      }
+      head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ring->cond);
+}
+
+static void
+rb_aio_uring_prep(struct io_uring_sqe *sqe, int opcode, rb_aiocb_t *cbs)
+{
+    cbs->iov.iov_base = (void *)cbs->cb.aio_buf;
+    cbs->iov.iov_len = cbs->cb.aio_nbytes;
+    sqe->opcode = opcode;
+    sqe->fd = cbs->cb.aio_fildes;
+    if (NIL_P(cbs->bufs)){
+      sqe->addr = (uintptr_t)&cbs->iov;
+      sqe->len = 1;
+    }else{
+      sqe->addr = (uintptr_t)cbs->iovs;
+      sqe->len = cbs->iovcnt;
+    }
+    sqe->off = cbs->cb.aio_offset;
+    sqe->user_data = (uintptr_t)cbs;
+    if (cbs->priority == AIO_INTERACTIVE) sqe->ioprio = AIO_IOPRIO(AIO_IOPRIO_CLASS_BE, 0);
+    if (cbs->priority == AIO_BACKGROUND) sqe->ioprio = AIO_IOPRIO(AIO_IOPRIO_CLASS_BE, 7);
+    cbs->res = 0;
+    cbs->err = EINPROGRESS;
+}
+
+/*
+ *  Links a timeout to the request just queued, cancelling it (ECANCELED) if it's
+ *  still in flight at its deadline. The timeout's own completion carries no user
+ *  data and is ignored. Lock held.
+ */
+static void
+rb_aio_uring_deadline(struct io_uring_sqe *sqe, struct io_uring_sqe *tsqe, rb_aiocb_t *cbs, double now)
+{
+    double left = cbs->req->expires - now;
+    if (left < 0) left = 0;
+    cbs->req->timeout.tv_sec = (int64_t)left;
+    cbs->req->timeout.tv_nsec = (long long)((left - (int64_t)left) * 1e9);
+    sqe->flags |= IOSQE_IO_LINK;
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->fd = -1;
+    tsqe->addr = (uintptr_t)&cbs->req->timeout;
+    tsqe->len = 1;
+    tsqe->user_data = 0;
+}
+
+/*
+ *  SQEs a request takes : itself, its linked timeout if it has a deadline, and
+ *  the completion descriptor write of an AIO::NOWAIT request.
+ */
+static unsigned
+rb_aio_uring_sqes(rb_aio_uring_t *ring, rb_aiocb_t *cbs)
+{
+    unsigned n = rb_aio_expires(cbs) ? 2 : 1;
+    if (ring->notify && cbs->cb.aio_sigevent.sigev_notify == SIGEV_THREAD) n++;
+    return n;
+}
+
+/*
+ *  Takes back the SQEs of the first ops of list, queued from tail on, that the
+ *  kernel hasn't consumed after a submission failed outright - left in the ring
+ *  they'd go out with the next flush, long after the caller gave up on them.
+ *  Those requests fail with the submission's errno. Returns how many of list are
+ *  in flight regardless, or -1 with errno set if none are. Lock held.
+ */
+static int
+rb_aio_uring_withdraw(rb_aio_uring_t *ring, rb_aiocb_t **list, int ops, unsigned tail)
+{
+    int op, done, err = errno;
+    unsigned need, head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (done=0; done < ops; done++) {
+      if (list[done]->cb.aio_lio_opcode == LIO_NOP) continue;
+      need = rb_aio_uring_sqes(ring, list[done]);
+      if ((int)(head - tail) < (int)need) break;
+      tail += need;
+    }
+    /* A request's linked SQEs are never split from it by a flush */
+    if (done < ops && (int)(head - tail) > 0){
+      tail += rb_aio_uring_sqes(ring, list[done]);
+      done++;
+    }
+    ring->pending -= ring->sqe_tail - tail;
+    ring->sqe_tail = tail;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    for (op=done; op < ops; op++) {
+      if (list[op]->cb.aio_lio_opcode == LIO_NOP) continue;
+      list[op]->res = -1;
+      list[op]->err = err;
+      ring->inflight--;
+    }
+    errno = err;
+    return done ? done : -1;
+}
+
+/*
+ *  Queues a batch of read / write requests. LIO_NOP entries complete immediately.
+ *  With defer set the SQEs are only handed to the kernel by the next wait, which
+ *  does so without the GVL - cached reads may otherwise complete inline with the
+ *  submit and hold the interpreter lock for the duration of the copy. Returns how
+ *  many of list were queued before the submission queue filled up, or -1 with
+ *  errno set.
+ */
+static int
+rb_aio_uring_submit(rb_aio_uring_t *ring, rb_aiocb_t **list, int ops, int defer)
+{
+    int op, ret;
+    unsigned head, tail, need;
+    struct io_uring_sqe *sqe, *last;
+    double now = 0;
+    pthread_mutex_lock(&ring->lock);
+    rb_aio_uring_reap(ring);
+    tail = ring->sqe_tail;
+    for (op=0; op < ops; op++) {
+      if (list[op]->cb.aio_lio_opcode == LIO_NOP){
+        list[op]->res = 0;
+        list[op]->err = 0;
+        continue;
+      }
+      need = rb_aio_uring_sqes(ring, list[op]);
+      if (need > 1){
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head + need > *ring->sq_entries){
+          rb_aio_uring_flush(ring, 0);
+          head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+          if (ring->sqe_tail - head + need > *ring->sq_entries) break;
+        }
+      }
+      if (!(sqe = last = rb_aio_uring_get_sqe(ring))) break;
+      rb_aio_uring_prep(sqe, list[op]->cb.aio_lio_opcode == LIO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV, list[op]);
+      if (rb_aio_expires(list[op])){
+        if (!now) now = rb_aio_clock();
+        rb_aio_uring_deadline(sqe, last = rb_aio_uring_get_sqe(ring), list[op], now);
+      }
+#ifdef HAVE_SYS_EVENTFD_H
+      if (ring->notify && list[op]->cb.aio_sigevent.sigev_notify == SIGEV_THREAD){
+        static const uint64_t one = 1;
+        sqe->flags |= IOSQE_IO_HARDLINK;
+        last->flags |= IOSQE_IO_HARDLINK;
+        rb_aio_uring_notify(rb_aio_uring_get_sqe(ring), &one);
+      }
+#endif
+      ring->inflight++;
+    }
+    ret = (defer && op == ops) ? 0 : rb_aio_uring_flush(ring, 0);
+    if (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) op = rb_aio_uring_withdraw(ring, list, op, tail);
+    pthread_mutex_unlock(&ring->lock);
+    return op;
+}
+
+/*
+ *  Queues a fsync / fdatasync for the control block's file descriptor.
+ */
+static int
+rb_aio_uring_fsync(rb_aio_uring_t *ring, int op, rb_aiocb_t *cbs)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+    pthread_mutex_lock(&ring->lock);
+    if (!(sqe = rb_aio_uring_get_sqe(ring))){
+      pthread_mutex_unlock(&ring->lock);
+      errno = EAGAIN;
+      return -1;
+    }
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = cbs->cb.aio_fildes;
+#ifdef O_DSYNC
+    if (op == O_DSYNC) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+#endif
+    sqe->user_data = (uintptr_t)cbs;
+    cbs->res = 0;
+    cbs->err = EINPROGRESS;
+    ring->inflight++;
+    ret = rb_aio_uring_flush(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+    return (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) ? -1 : 0;
+}
+
+/*
+ *  Queues an madvise, which the kernel runs from its worker threads. Nobody
+ *  waits for the completion, it carries no user data. Returns -1 if the
+ *  submission queue is full.
+ */
+static int
+rb_aio_uring_madvise(rb_aio_uring_t *ring, void *addr, size_t len, int advice)
+{
+    struct io_uring_sqe *sqe;
+    pthread_mutex_lock(&ring->lock);
+    if (!(sqe = rb_aio_uring_get_sqe(ring))){
+      pthread_mutex_unlock(&ring->lock);
+      return -1;
+    }
+    sqe->opcode = IORING_OP_MADVISE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->fadvise_advice = advice;
+    sqe->user_data = 0;
+    rb_aio_uring_flush(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+/*
+ *  Queues an fallocate the same way : fire and forget, -1 if the submission
+ *  queue is full.
+ */
+static int
+rb_aio_uring_fallocate(rb_aio_uring_t *ring, int fd, int mode, off_t offset, off_t len)
+{
+    struct io_uring_sqe *sqe;
+    pthread_mutex_lock(&ring->lock);
+    if (!(sqe = rb_aio_uring_get_sqe(ring))){
+      pthread_mutex_unlock(&ring->lock);
+      return -1;
+    }
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = len;
+    sqe->len = mode;
+    sqe->user_data = 0;
+    rb_aio_uring_flush(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+#ifdef POSIX_FADV_WILLNEED
+/*
+ *  Queues readahead of a range of fd, hard linked to a close of fd : the advice
+ *  runs on the kernel's worker threads, which may only look fd up by then, so it
+ *  can't be closed as soon as it's submitted. Neither completion carries user
+ *  data. A length of 0 (or one beyond the 32 bit length field) reads ahead to the
+ *  end of the file. Returns -1, with fd still open, if the submission queue has
+ *  no room for both.
+ */
+static int
+rb_aio_uring_fadvise(rb_aio_uring_t *ring, int fd, off_t offset, off_t len)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head;
+    pthread_mutex_lock(&ring->lock);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head + 2 > *ring->sq_entries){
+      rb_aio_uring_flush(ring, 0);
+      head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->sqe_tail - head + 2 > *ring->sq_entries){
+        pthread_mutex_unlock(&ring->lock);
+        return -1;
+      }
+    }
+    sqe = rb_aio_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = (unsigned long long)len > 0xffffffffULL ? 0 : (unsigned)len;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    sqe->user_data = 0;
+    sqe = rb_aio_uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = 0;
+    rb_aio_uring_flush(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+#endif
+
+#ifdef AIO_CHAINS
+/* One file of AIO.read_all : a linked open / statx / read / close through fixed
+   file slot file, each step completing into its own control block. busy while a
+   chain is in flight, offset and size track how much of the file was read. */
+typedef struct{
+    rb_aiocb_t open;
+    rb_aiocb_t stat;
+    rb_aiocb_t read;
+    rb_aiocb_t close;
+    struct statx stx;
+    int file;
+    int busy;
+    off_t offset;
+    off_t size;
+} rb_aio_chain_t;
+
+static struct io_uring_sqe *
+rb_aio_uring_chain_step(rb_aio_uring_t *ring, int opcode, rb_aiocb_t *cbs)
+{
+    struct io_uring_sqe *sqe = rb_aio_uring_get_sqe(ring);
+    sqe->opcode = opcode;
+    sqe->user_data = (uintptr_t)cbs;
+    cbs->res = 0;
+    cbs->err = EINPROGRESS;
+    cbs->completed = 0;
+    ring->inflight++;
+    return sqe;
+}
+
+/*
+ *  Queues a chain reading len bytes of path from the chain's offset into buf :
+ *  an open into the chain's fixed file slot, a statx for the size on the first
+ *  chain of a file, the read and a close of the slot, each step starting once the
+ *  previous completed. A failed open cancels the rest, steps after it are hard
+ *  linked so the file's closed whatever happens to the read. Goes out with the
+ *  next flush. Returns -1 if the submission queue has no room for the whole
+ *  chain. Lock held.
+ */
+static int
+rb_aio_uring_chain(rb_aio_uring_t *ring, rb_aio_chain_t *c, const char *path, char *buf, size_t len)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head + 4 > *ring->sq_entries) return -1;
+    sqe = rb_aio_uring_chain_step(ring, IORING_OP_OPENAT, &c->open);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->file_index = c->file + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    if (c->size < 0){
+      sqe = rb_aio_uring_chain_step(ring, IORING_OP_STATX, &c->stat);
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)path;
+      sqe->len = STATX_SIZE;
+      sqe->off = (uintptr_t)&c->stx;
+      sqe->flags = IOSQE_IO_HARDLINK;
+    }else{
+      c->stat.err = 0;
+    }
+    sqe = rb_aio_uring_chain_step(ring, IORING_OP_READ, &c->read);
+    sqe->fd = c->file;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = c->offset;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe = rb_aio_uring_chain_step(ring, IORING_OP_CLOSE, &c->close);
+    sqe->file_index = c->file + 1;
+    return 0;
+}
+#endif
+#endif
+
+/*
+ *  Points the control block's iovecs at the Strings given with CB#bufs=. io_uring
+ *  moves the data with READV / WRITEV directly. POSIX AIO has no vectored aiocb,
+ *  so writes are gathered into a leased buffer and reads scattered back out of it
+ *  on completion.
+ */
+static void
+setup_aio_vector(rb_aiocb_t *cbs)
+{
+    long i, cnt = RARRAY_LEN(cbs->bufs);
+    size_t nbytes = 0;
+    char *ptr;
+    VALUE str;
+    REALLOC_N(cbs->iovs, struct iovec, cnt ? cnt : 1);
+    for (i=0; i < cnt; i++) {
+      str = RARRAY_PTR(cbs->bufs)[i];
+      if (cbs->cb.aio_lio_opcode == LIO_READ) rb_str_modify(str);
+      cbs->iovs[i].iov_base = RSTRING_PTR(str);
+      cbs->iovs[i].iov_len = RSTRING_LEN(str);
+      nbytes += RSTRING_LEN(str);
+    }
+    cbs->iovcnt = (int)cnt;
+    cbs->cb.aio_nbytes = nbytes;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring){
+      release_aio_buffer(cbs);
+      cbs->cb.aio_buf = NULL;
+      return;
+    }
+#endif
+    setup_aio_buffer(cbs);
+    if (cbs->cb.aio_lio_opcode != LIO_WRITE) return;
+    for (i=0, ptr = (char *)cbs->cb.aio_buf; i < cnt; i++) {
+      memcpy(ptr, cbs->iovs[i].iov_base, cbs->iovs[i].iov_len);
+      ptr += cbs->iovs[i].iov_len;
+    }
+}
+
+/*
+ *  Trims the CB#bufs Strings of a completed vectored read to the bytes that
+ *  landed in each, copying them out of the bounce buffer on POSIX AIO.
+ */
+static VALUE
+rb_aio_vector_result(rb_aiocb_t *cbs, ssize_t ret)
+{
+    long i, cnt = RARRAY_LEN(cbs->bufs);
+    size_t len, left = ret > 0 ? ret : 0;
+    char *ptr = (char *)cbs->cb.aio_buf;
+    VALUE str;
+    for (i=0; i < cnt && i < cbs->iovcnt; i++) {
+      str = RARRAY_PTR(cbs->bufs)[i];
+      len = left < cbs->iovs[i].iov_len ? left : cbs->iovs[i].iov_len;
+      if (ptr){
+        memcpy(RSTRING_PTR(str), ptr, len);
+        ptr += cbs->iovs[i].iov_len;
+      }
+      rb_str_resize(str, len);
+      left -= len;
+    }
+    return rb_ary_dup(cbs->bufs);
+}
+
+/*
+ *  Raises unless a request on an O_DIRECT control block meets the alignment of its
+ *  file : offset, length and buffer address, or those of every buffer given with
+ *  CB#bufs on io_uring. Leased buffers are page aligned, CB#into Strings rarely
+ *  are.
+ */
+static void
+rb_aio_direct_check(rb_aiocb_t *cbs)
+{
+    int i;
+    if (!cbs->direct) return;
+    if (cbs->cb.aio_offset % cbs->align_io) rb_raise(eAio, "File offset %ld is not a multiple of the %lu byte O_DIRECT block size", (long)cbs->cb.aio_offset, (unsigned long)cbs->align_io);
+    if (cbs->cb.aio_nbytes % cbs->align_io) rb_raise(eAio, "Buffer length %lu is not a multiple of the %lu byte O_DIRECT block size", (unsigned long)cbs->cb.aio_nbytes, (unsigned long)cbs->align_io);
+    if (cbs->cb.aio_buf){
+      if ((unsigned long)cbs->cb.aio_buf % cbs->align_mem) rb_raise(eAio, "Buffer is not aligned to %lu bytes for O_DIRECT", (unsigned long)cbs->align_mem);
+      return;
+    }
+    for (i=0; i < cbs->iovcnt && !NIL_P(cbs->bufs); i++) {
+      if ((unsigned long)cbs->iovs[i].iov_base % cbs->align_mem || cbs->iovs[i].iov_len % cbs->align_io){
+        rb_raise(eAio, "Buffer %d is not aligned to %lu bytes or sized in multiples of %lu for O_DIRECT", i, (unsigned long)cbs->align_mem, (unsigned long)cbs->align_io);
+      }
+    }
+}
+
+/*
+ *  Points a read straight at the storage of the String given with CB#into= (or a
+ *  fresh one for into = true), sized to aio_nbytes. The String is marked by the
+ *  control block while the request is in flight. Everything else reads into /
+ *  writes from a leased buffer.
+ */
+static void
+setup_aio_target(rb_aiocb_t *cbs)
+{
+    VALUE str;
+    if (!NIL_P(cbs->bufs)){
+      setup_aio_vector(cbs);
+    }else if (NIL_P(cbs->into) || cbs->cb.aio_lio_opcode != LIO_READ){
+      setup_aio_buffer(cbs);
+    }else{
+      str = cbs->into == Qtrue ? rb_str_new(0, cbs->cb.aio_nbytes) : cbs->into;
+      rb_str_modify(str);
+      if ((size_t)RSTRING_LEN(str) != cbs->cb.aio_nbytes) rb_str_resize(str, cbs->cb.aio_nbytes);
+      release_aio_buffer(cbs);
+      cbs->str = str;
+      cbs->cb.aio_buf = RSTRING_PTR(str);
+    }
+    rb_aio_direct_check(cbs);
+}
+
+/*
+ *  The result of a completed read : the CB#bufs Array for vectored reads, the
+ *  target String trimmed to the bytes read for CB#into reads, otherwise a copy of
+ *  the buffer.
+ */
+static VALUE
+rb_aio_read_result(rb_aiocb_t *cbs, ssize_t ret)
+{
+    VALUE str = cbs->str;
+    if (!NIL_P(cbs->bufs)) return rb_aio_vector_result(cbs, ret);
+    if (NIL_P(str) && !cbs->lease.ptr) return SSIZET2NUM(ret);
+    if (NIL_P(str)) return rb_tainted_str_new( (char *)cbs->cb.aio_buf, ret >= 0 && (size_t)ret < cbs->cb.aio_nbytes ? (size_t)ret : cbs->cb.aio_nbytes );
+    cbs->str = Qnil;
+    cbs->cb.aio_buf = NULL;
+    rb_str_resize(str, ret > 0 ? ret : 0);
+    return str;
+}
+
+/*
+ *  State for waiting on a list of requests outside of the interpreter lock.
+ *  Entries of list (and pending, the matching POSIX aiocbs) are cleared as they
+ *  complete.
+ */
+typedef struct{
+    rb_aiocb_t **list;
+    aiocb_t **pending;
+    int ops;
+    int any;
+    int err;
+    int interrupted;
+    struct timespec *deadline;
+    int timedout;
+} rb_aio_suspend_t;
+
+static void
+rb_aio_tuner_decrease(void)
+{
+    rb_aio_max_inflight = rb_aio_max_inflight * 3 / 4;
+    if (rb_aio_max_inflight < AIO_MIN_INFLIGHT) rb_aio_max_inflight = AIO_MIN_INFLIGHT;
+}
+
+/*
+ *  Feeds the latency of a completed request to the tuner. Requests nobody waited
+ *  on have no completion time and are skipped, their latency would include
+ *  however long they sat around uncollected. The baseline creeps up every window
+ *  so a stale minimum doesn't pin the limit down forever.
+ */
+static void
+rb_aio_tune(rb_aiocb_t *cbs)
+{
+    double latency = cbs->completed - cbs->submitted;
+    int submitted = cbs->submitted > 0, completed = cbs->completed > 0;
+    cbs->submitted = cbs->completed = 0;
+    if (!rb_aio_tuner.adaptive || !submitted || !completed) return;
+    rb_aio_tuner.latency = rb_aio_tuner.latency ? rb_aio_tuner.latency * 0.875 + latency * 0.125 : latency;
+    if (++rb_aio_tuner.samples < rb_aio_max_inflight) return;
+    rb_aio_tuner.samples = 0;
+    if (!rb_aio_tuner.baseline || rb_aio_tuner.latency < rb_aio_tuner.baseline) rb_aio_tuner.baseline = rb_aio_tuner.latency;
+    if (rb_aio_tuner.latency <= rb_aio_tuner.baseline * AIO_LATENCY_TOLERANCE){
+      if (rb_aio_max_inflight < AIO_MAX_INFLIGHT_CEILING) rb_aio_max_inflight++;
+    }else{
+      rb_aio_tuner_decrease();
+    }
+    rb_aio_tuner.baseline *= 1.02;
+}
+
+static int
+rb_aio_histogram_bucket(unsigned long long ns)
+{
+    int msb = 0;
+    if (ns < AIO_HISTOGRAM_SUB) return (int)ns;
+    if (ns >> AIO_HISTOGRAM_RANGE) ns = ((unsigned long long)1 << AIO_HISTOGRAM_RANGE) - 1;
+    while (ns >> (msb + 1)) msb++;
+    msb -= AIO_HISTOGRAM_SUB_BITS;
+    return (msb + 1) * AIO_HISTOGRAM_SUB + (int)((ns >> msb) & (AIO_HISTOGRAM_SUB - 1));
+}
+
+/*
+ *  Highest value a histogram bucket counts.
+ */
+static unsigned long long
+rb_aio_histogram_value(int bucket)
+{
+    int shift = bucket / AIO_HISTOGRAM_SUB - 1;
+    if (bucket < AIO_HISTOGRAM_SUB) return bucket;
+    return ((unsigned long long)(AIO_HISTOGRAM_SUB + bucket % AIO_HISTOGRAM_SUB + 1) << shift) - 1;
+}
+
+static unsigned long long
+rb_aio_histogram_record(rb_aio_histogram_t *h, double seconds)
+{
+    unsigned long long ns = seconds > 0 ? (unsigned long long)(seconds * 1e9) : 0;
+    if (!h->count || ns < h->min) h->min = ns;
+    if (ns > h->max) h->max = ns;
+    h->count++;
+    h->sum += ns;
+    h->buckets[rb_aio_histogram_bucket(ns)]++;
+    return ns;
+}
+
+/*
+ *  Value at or below which fraction p of the recorded values fall, within the
+ *  precision of a bucket.
+ */
+static unsigned long long
+rb_aio_histogram_percentile(rb_aio_histogram_t *h, double p)
+{
+    unsigned long long seen = 0, rank = (unsigned long long)(h->count * p);
+    int b;
+    if (rank < h->count * p) rank++;
+    if (rank < 1) rank = 1;
+    for (b=0; b < AIO_HISTOGRAM_BUCKETS; b++) {
+      seen += h->buckets[b];
+      if (seen >= rank) return rb_aio_histogram_value(b) < h->max ? rb_aio_histogram_value(b) : h->max;
+    }
+    return h->max;
+}
+
+static int
+rb_aio_inflight(void)
+{
+    return rb_aio_classes.count[AIO_INTERACTIVE] + rb_aio_classes.count[AIO_NORMAL] + rb_aio_classes.count[AIO_BACKGROUND];
+}
+
+/*
+ *  Accounts a request accepted by the kernel / library queue.
+ */
+static void
+rb_aio_stats_submit(rb_aiocb_t *cbs)
+{
+    int inflight = rb_aio_inflight();
+    rb_aio_stats.ops[cbs->op].submitted++;
+    rb_aio_stats.depth += inflight;
+    if (inflight > rb_aio_stats.inflight_max) rb_aio_stats.inflight_max = inflight;
+    AIO_PROBE_SUBMIT(cbs);
+}
+
+/*
+ *  Accounts a collected request. io_uring stamps completion times as requests are
+ *  reaped, POSIX AIO only as a wait sees them - requests collected otherwise
+ *  (callbacks, AIO.return) count as completed when collected there.
+ */
+static void
+rb_aio_stats_complete(rb_aiocb_t *cbs, ssize_t ret, int err)
+{
+    rb_aio_op_stats_t *s = &rb_aio_stats.ops[cbs->op];
+    double completed = cbs->completed ? cbs->completed : rb_aio_clock();
+    unsigned long long ns;
+    s->completed++;
+    if (ret < 0){
+      s->errors++;
+      if (err == ECANCELED) s->cancelled++;
+    }else if (cbs->op != AIO_OP_FSYNC){
+      s->bytes += ret;
+    }
+    ns = rb_aio_histogram_record(&s->latency, completed - cbs->queued);
+    rb_aio_histogram_record(&s->queued, cbs->submitted - cbs->queued);
+    AIO_PROBE_COMPLETE(cbs, ret, err, ns);
+    cbs->queued = 0;
+}
+
+/*
+ *  Time left until an absolute CLOCK_REALTIME deadline, 0 once it passed.
+ */
+static int
+rb_aio_time_left(struct timespec *deadline, struct timespec *left)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0){
+      left->tv_sec--;
+      left->tv_nsec += 1000000000L;
+    }
+    return left->tv_sec > 0 || (left->tv_sec == 0 && left->tv_nsec > 0);
+}
+
+/*
+ *  Clears completed entries from the wait list and returns how many are still
+ *  in progress. Sets done if any entry completed.
+ */
+static int
+rb_aio_suspend_sweep(rb_aio_suspend_t *s, int *done)
+{
+    int op, inprogress = 0;
+    for (op=0; op < s->ops; op++) {
+      if (!s->list[op]) continue;
+#ifdef HAVE_IO_URING
+      if (rb_aio_ring ? s->list[op]->err == EINPROGRESS : aio_error(s->pending[op]) == EINPROGRESS){
+#else
+      if (aio_error(s->pending[op]) == EINPROGRESS){
+#endif
+        inprogress++;
+      }else{
+        if (!s->list[op]->completed) s->list[op]->completed = rb_aio_clock();
+        s->list[op] = NULL;
+        s->pending[op] = NULL;
+        *done = 1;
+      }
+    }
+    return inprogress;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ *  Waits on the ring. One waiter at a time blocks in io_uring_enter and reaps
+ *  completions on behalf of all others, which sleep on the ring's condition
+ *  variable until woken by a reap.
+ */
+static VALUE
+rb_aio_uring_suspend0(rb_aio_suspend_t *s)
+{
+    rb_aio_uring_t *ring = rb_aio_ring;
+    struct io_uring_sqe *sqe;
+    struct timespec left;
+    struct { int64_t tv_sec; long long tv_nsec; } ts;
+    int ret, done = 0;
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+      rb_aio_uring_reap(ring);
+      if (!rb_aio_suspend_sweep(s, &done) || (s->any && done)) break;
+      if (s->interrupted){
+        s->err = EINTR;
+        break;
+      }
+      if (s->deadline && !rb_aio_time_left(s->deadline, &left)){
+        s->timedout = 1;
+        break;
+      }
+      if (ring->reaping){
+        if (ring->pending) rb_aio_uring_flush(ring, 0);
+        if (s->deadline) pthread_cond_timedwait(&ring->cond, &ring->lock, s->deadline);
+        else pthread_cond_wait(&ring->cond, &ring->lock);
+        continue;
+      }
+      /* A timeout request wakes the reaper at the deadline, its completion is ignored */
+      if (s->deadline && (sqe = rb_aio_uring_get_sqe(ring))){
+        ts.tv_sec = left.tv_sec;
+        ts.tv_nsec = left.tv_nsec;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uintptr_t)&ts;
+        sqe->len = 1;
+      }
+      ring->reaping = 1;
+      __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+      ret = ring->pending;
+      ring->pending = 0;
+      pthread_mutex_unlock(&ring->lock);
+      ret = rb_aio_uring_enter(ring->fd, ret, 1, IORING_ENTER_GETEVENTS);
+      pthread_mutex_lock(&ring->lock);
+      ring->reaping = 0;
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+        s->err = errno;
+        pthread_cond_broadcast(&ring->cond);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return Qnil;
+}
+
+/*
+ *  Unblocks a waiter: sleepers are woken through the condition variable and the
+ *  reaping thread by a NOP completion.
+ */
+static void
+rb_aio_uring_ubf(void *ptr)
+{
+    rb_aio_suspend_t *s = (rb_aio_suspend_t *)ptr;
+    rb_aio_uring_t *ring = rb_aio_ring;
+    struct io_uring_sqe *sqe;
+    pthread_mutex_lock(&ring->lock);
+    s->interrupted = 1;
+    pthread_cond_broadcast(&ring->cond);
+    if (ring->reaping && (sqe = rb_aio_uring_get_sqe(ring))){
+      sqe->opcode = IORING_OP_NOP;
+      rb_aio_uring_flush(ring, 0);
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+#endif
+
+/*
+ *  Blocks until every request in the list completed, or just the first one with
+ *  any set. With POSIX AIO completed entries must be cleared as aio_suspend returns
+ *  immediately on any request that is already done. Touches no Ruby objects and
+ *  is thus safe to run without the GVL.
+ */
+static VALUE
+rb_aio_suspend0(void *ptr)
+{
+    rb_aio_suspend_t *s = (rb_aio_suspend_t *)ptr;
+    struct timespec left;
+    int done = 0;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring) return rb_aio_uring_suspend0(s);
+#endif
+    for (;;) {
+      if (!rb_aio_suspend_sweep(s, &done) || (s->any && done)) break;
+      if (s->deadline && !rb_aio_time_left(s->deadline, &left)){
+        s->timedout = 1;
+        break;
+      }
+      if (aio_suspend((const aiocb_t * const *)s->pending, s->ops, s->deadline ? &left : NULL) != 0 && errno != EAGAIN){
+        s->err = errno;
+        if (s->err == EINTR) break;
+      }
+    }
+    return Qnil;
+}
+
+/*
+ *  Waits on a list of requests, clearing entries as they complete. Returns once
+ *  all completed, or at least one with any set, or the deadline if given passed.
+ *  The GVL is released for the duration of the wait so other threads keep
+ *  running. Pending interrupts are serviced between waits when interruptible,
+ *  otherwise signals only restart the wait.
+ */
+static int
+rb_aio_wait0(rb_aiocb_t **list, int ops, int any, int interruptible, struct timespec *deadline)
+{
+    rb_aio_suspend_t s;
+    volatile VALUE scratch = Qnil;
+    int op;
+    s.list = list;
+    if (ops > AIO_MAX_LIST){
+      scratch = rb_str_new(0, ops * sizeof(aiocb_t *));
+      s.pending = (aiocb_t **)RSTRING_PTR(scratch);
+    }else{
+      s.pending = ALLOCA_N(aiocb_t *, ops);
+    }
+    for (op=0; op < ops; op++) {
+      s.pending[op] = list[op] ? &list[op]->cb : NULL;
+    }
+    s.ops = ops;
+    s.any = any;
+    s.deadline = deadline;
+    s.timedout = 0;
+    do {
+      s.err = 0;
+      s.interrupted = 0;
+#ifdef RUBY19
+  #ifdef HAVE_IO_URING
+      if (rb_aio_ring){
+        rb_aio_blocking_region(rb_aio_suspend0, &s, rb_aio_uring_ubf, &s);
+      }else
+  #endif
+      rb_aio_blocking_region(rb_aio_suspend0, &s, RUBY_UBF_IO, 0);
+      if (s.err == EINTR && interruptible) rb_thread_check_ints();
+#else
+      TRAP_BEG;
+      rb_aio_suspend0(&s);
+      TRAP_END;
+      if (s.err == EINTR && interruptible) CHECK_INTS;
+#endif
+    } while (s.err == EINTR);
+    return !s.timedout;
+}
+
+static void
+rb_aio_wait(rb_aiocb_t **list, int ops, int any, int interruptible)
+{
+    rb_aio_wait0(list, ops, any, interruptible, NULL);
+}
+
+/*
+ *  rb_aio_wait bounded by timeout seconds, nil waits indefinitely. Returns 0 if
+ *  the deadline passed first.
+ */
+static int
+rb_aio_timedwait(rb_aiocb_t **list, int ops, int any, VALUE timeout)
+{
+    struct timespec deadline;
+    double secs;
+    if (NIL_P(timeout)) return rb_aio_wait0(list, ops, any, 1, NULL);
+    secs = NUM2DBL(timeout);
+    if (secs < 0) secs = 0;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L){
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    return rb_aio_wait0(list, ops, any, 1, &deadline);
+}
+
+/*
+ *  Waits for a list of requests to complete, leaving the list as is.
+ */
+static void
+rb_aio_suspend(rb_aiocb_t **list, int ops, int interruptible)
+{
+    rb_aiocb_t **wait = ALLOCA_N(rb_aiocb_t *, ops);
+    MEMCPY(wait, list, rb_aiocb_t *, ops);
+    rb_aio_wait(wait, ops, 0, interruptible);
+}
+
+/*
+ *  Queues a single request with POSIX AIO.
+ */
+static int
+rb_aio_posix_submit1(rb_aiocb_t *cbs)
+{
+    switch(cbs->cb.aio_lio_opcode){
+      case LIO_READ:
+           return aio_read(&cbs->cb);
+      case LIO_WRITE:
+           return aio_write(&cbs->cb);
+    }
+    return 0;
+}
+
+/*
+ *  Queues a batch with POSIX AIO : a single request through aio_read / aio_write,
+ *  runs of fresh requests through lio_listio in chunks of at most AIO_MAX_LIST.
+ *  lio_listio may queue only part of a chunk on EAGAIN - what it queued is flagged
+ *  (err = EINPROGRESS) and skipped on the next attempt, what it didn't (err =
+ *  EAGAIN) is resubmitted one by one. Returns how many leading requests of list
+ *  are queued, or -1 with errno set.
+ */
+static int
+rb_aio_posix_submit(rb_aiocb_t **list, int ops)
+{
+    aiocb_t *cbs[AIO_MAX_LIST];
+    int op, chunk, done = 0;
+    while (done < ops) {
+      if (list[done]->err == EINPROGRESS){
+        done++;
+        continue;
+      }
+      if (list[done]->err == EAGAIN || ops - done == 1){
+        if (rb_aio_posix_submit1(list[done]) != 0){
+          if (errno != EAGAIN) return -1;
+          list[done]->err = EAGAIN;
+          return done;
+        }
+        list[done]->err = EINPROGRESS;
+        done++;
+        continue;
+      }
+      for (chunk = 0; chunk < AIO_MAX_LIST && done + chunk < ops && list[done + chunk]->err == 0; chunk++) {
+        cbs[chunk] = &list[done + chunk]->cb;
+      }
+      if (lio_listio(LIO_NOWAIT, cbs, chunk, NULL) != 0){
+        if (errno != EAGAIN) return -1;
+        for (op=0; op < chunk; op++) {
+          list[done + op]->err = aio_error(cbs[op]) == EAGAIN ? EAGAIN : EINPROGRESS;
+        }
+        while (done < ops && list[done]->err == EINPROGRESS) done++;
+        return done;
+      }
+      for (op=0; op < chunk; op++) {
+        list[done + op]->err = EINPROGRESS;
+      }
+      done += chunk;
+    }
+    return done;
+}
+
+/*
+ *  Backs off for a while after a submission hit EAGAIN, letting requests in flight
+ *  drain. Sleeps without the GVL, or through the fiber scheduler.
+ */
+static void
+rb_aio_sleep(int attempt)
+{
+    struct timeval tv;
+    long usec = AIO_BACKOFF_MIN << (attempt > 8 ? 8 : attempt);
+    if (usec > AIO_BACKOFF_MAX) usec = AIO_BACKOFF_MAX;
+    tv.tv_sec = 0;
+    tv.tv_usec = usec;
+    rb_thread_wait_for(tv);
+}
+
+static void
+rb_aio_backoff(int attempt)
+{
+    rb_aio_tuner.backoffs++;
+    if (rb_aio_tuner.adaptive) rb_aio_tuner_decrease();
+    rb_aio_sleep(attempt);
+}
+
+static void
+rb_aio_class_link(rb_aiocb_t *cbs)
+{
+    int c = cbs->priority;
+    cbs->prev = NULL;
+    cbs->next = rb_aio_classes.inflight[c];
+    if (cbs->next) cbs->next->prev = cbs;
+    rb_aio_classes.inflight[c] = cbs;
+    rb_aio_classes.count[c]++;
+    cbs->linked = c + 1;
+}
+
+static void
+rb_aio_class_unlink(rb_aiocb_t *cbs)
+{
+    int c = cbs->linked - 1;
+    if (!cbs->linked) return;
+    if (cbs->prev){
+      cbs->prev->next = cbs->next;
+    }else{
+      rb_aio_classes.inflight[c] = cbs->next;
+    }
+    if (cbs->next) cbs->next->prev = cbs->prev;
+    cbs->next = cbs->prev = NULL;
+    cbs->linked = 0;
+    rb_aio_classes.count[c]--;
+}
+
+/*
+ *  Drops requests seen completed from the per class in flight lists.
+ */
+static void
+rb_aio_classes_sweep(void)
+{
+    rb_aiocb_t *cbs, *next;
+    int c, done;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring){
+      pthread_mutex_lock(&rb_aio_ring->lock);
+      rb_aio_uring_reap(rb_aio_ring);
+      if (rb_aio_ring->pending) rb_aio_uring_flush(rb_aio_ring, 0);
+      pthread_mutex_unlock(&rb_aio_ring->lock);
+    }
+#endif
+    for (c=0; c < AIO_CLASSES; c++) {
+      for (cbs = rb_aio_classes.inflight[c]; cbs; cbs = next) {
+        next = cbs->next;
+#ifdef HAVE_IO_URING
+        done = rb_aio_ring ? cbs->err != EINPROGRESS : aio_error(&cbs->cb) != EINPROGRESS;
+#else
+        done = aio_error(&cbs->cb) != EINPROGRESS;
+#endif
+        if (done) rb_aio_class_unlink(cbs);
+      }
+    }
+}
+
+/*
+ *  How many leading requests of a batch may go out now. While interactive or
+ *  normal requests are in flight, batches with background requests are let out in
+ *  slices that keep background requests in flight within AIO.background_share of
+ *  the in flight limit, waiting for earlier ones to complete in between. A batch
+ *  with any interactive request, or one due within about two completion latencies
+ *  of its deadline, goes straight through. Background work has the device to
+ *  itself otherwise.
+ */
+static int
+rb_aio_admit(rb_aiocb_t **list, int ops)
+{
+    int op, budget, background = 0, attempt = 0;
+    for (op=0; op < ops; op++) {
+      if (list[op]->priority == AIO_INTERACTIVE) return ops;
+      if (rb_aio_deadline(list[op]) && rb_aio_deadline(list[op]) <= 2 * rb_aio_tuner.latency) return ops;
+      if (list[op]->priority == AIO_BACKGROUND) background++;
+    }
+    if (!background) return ops;
+    for (;;) {
+      rb_aio_classes_sweep();
+      if (!rb_aio_classes.count[AIO_INTERACTIVE] && !rb_aio_classes.count[AIO_NORMAL]) return ops;
+      budget = (int)(rb_aio_max_inflight * rb_aio_classes.background_share);
+      if (budget < 1) budget = 1;
+      if (rb_aio_classes.count[AIO_BACKGROUND] < budget){
+        budget -= rb_aio_classes.count[AIO_BACKGROUND];
+        return budget < ops ? budget : ops;
+      }
+      rb_aio_classes.throttled++;
+      rb_aio_sleep(attempt++);
+    }
+}
+
+/*
+ *  Submits a batch to the active backend. Whatever the kernel or library queue has
+ *  no room for (EAGAIN) is held back and resubmitted as requests in flight
+ *  complete, so callers under burst load wait instead of failing. Only gives up
+ *  with EAGAIN after AIO_SUBMIT_RETRIES attempts. Returns 0 or -1 with errno set.
+ */
+static int
+rb_aio_submit0(rb_aiocb_t **list, int ops, int defer)
+{
+    int op, done, attempt = 0;
+    double now = rb_aio_clock();
+    for (op=0; op < ops; op++) {
+      list[op]->submitted = 0;
+      list[op]->completed = 0;
+      if (list[op]->req) list[op]->req->expires = list[op]->req->deadline ? now + list[op]->req->deadline : 0;
+      list[op]->err = 0;
+    }
+    while (ops > 0) {
+#ifdef HAVE_IO_URING
+      done = rb_aio_ring ? rb_aio_uring_submit(rb_aio_ring, list, ops, defer) : rb_aio_posix_submit(list, ops);
+#else
+      done = rb_aio_posix_submit(list, ops);
+#endif
+      if (done < 0) return -1;
+      for (op=0; op < done; op++) {
+        list[op]->submitted = now;
+        rb_aio_class_unlink(list[op]);
+        if (list[op]->cb.aio_lio_opcode == LIO_NOP) continue;
+        rb_aio_class_link(list[op]);
+        rb_aio_stats_submit(list[op]);
+      }
+      list += done;
+      ops -= done;
+      if (ops == 0) break;
+      if (++attempt > AIO_SUBMIT_RETRIES){
+        errno = EAGAIN;
+        return -1;
+      }
+      for (op=0; op < ops; op++) {
+        if (list[op]->queued) rb_aio_stats.ops[list[op]->op].retries++;
+      }
+      AIO_PROBE_RETRY(list[0], attempt);
+      rb_aio_backoff(attempt);
+      now = rb_aio_clock();
+    }
+    return 0;
+}
+
+/*
+ *  Submits a batch of requests, in slices as rb_aio_admit lets them out. Callers
+ *  that wait on the batch straight away set defer, see rb_aio_uring_submit.
+ *  Returns 0 or -1 with errno set.
+ */
+static int
+rb_aio_submit(rb_aiocb_t **list, int ops, int defer)
+{
+    int op, admitted;
+    double now = rb_aio_clock();
+    for (op=0; op < ops; op++) {
+      list[op]->op = list[op]->cb.aio_lio_opcode == LIO_WRITE ? AIO_OP_WRITE : AIO_OP_READ;
+      list[op]->queued = list[op]->cb.aio_lio_opcode == LIO_NOP ? 0 : now;
+    }
+    while (ops > 0) {
+      admitted = rb_aio_admit(list, ops);
+      if (rb_aio_submit0(list, admitted, admitted == ops ? defer : 0) != 0) return -1;
+      list += admitted;
+      ops -= admitted;
+    }
+    return 0;
+}
+
+/*
+ *  Current status of a request: EINPROGRESS, 0 on success or an errno value.
+ */
+static int
+rb_aio_status(rb_aiocb_t *cbs)
+{
+    int ret;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring){
+      pthread_mutex_lock(&rb_aio_ring->lock);
+      rb_aio_uring_reap(rb_aio_ring);
+      if (rb_aio_ring->pending) rb_aio_uring_flush(rb_aio_ring, 0);
+      ret = cbs->err;
+      pthread_mutex_unlock(&rb_aio_ring->lock);
+      return ret;
+    }
+#endif
+    ret = aio_error(&cbs->cb);
+    return ret;
+}
+
+/*
+ *  Final return status of a completed request, with aio_return semantics : bytes
+ *  transferred or -1 with errno set.
+ */
+static ssize_t
+rb_aio_result(rb_aiocb_t *cbs)
+{
+    ssize_t ret;
+    int err = 0;
+    rb_aio_class_unlink(cbs);
+    if (cbs->fastpath == AIO_FASTPATH_HIT){
+      ret = cbs->fast;
+    }else
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring){
+      ret = cbs->err == 0 ? cbs->res : -1;
+      err = cbs->err;
+    }else
+#endif
+    {
+      err = aio_error(&cbs->cb);
+      ret = aio_return(&cbs->cb);
+    }
+    if (cbs->fastpath == AIO_FASTPATH_PARTIAL){
+      cbs->cb.aio_offset -= cbs->fast;
+      cbs->cb.aio_buf = (char *)cbs->cb.aio_buf - cbs->fast;
+      cbs->cb.aio_nbytes += cbs->fast;
+      if (ret >= 0) ret += cbs->fast;
+    }
+    if (cbs->queued && cbs->submitted) rb_aio_stats_complete(cbs, ret, err);
+    if (cbs->fastpath == AIO_FASTPATH_HIT){
+      cbs->submitted = cbs->completed = 0;
+    }else if (cbs->submitted){
+      rb_aio_tune(cbs);
+    }
+    cbs->fastpath = 0;
+    if (ret < 0 && err > 0) errno = err;
+    return ret;
+}
+
+/*
+ *  Cache hit fast path for blocking reads : a non-blocking preadv2 (RWF_NOWAIT)
+ *  first copies whatever is already in the page cache, without a round trip
+ *  through the kernel queue or helper threads. Returns AIO_FASTPATH_HIT if that
+ *  served the whole read, which then isn't submitted at all. A partial hit shrinks
+ *  the request to the part that missed, rb_aio_result adds back what was read
+ *  inline. Vectored, O_DIRECT and reads over AIO_FASTPATH_MAX (which would hold
+ *  the GVL for the copy) always go asynchronous.
+ */
+static int
+rb_aio_fastpath(rb_aiocb_t *cbs)
+{
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+    struct iovec iov;
+    ssize_t n;
+    double now;
+    cbs->fastpath = 0;
+    if (!rb_aio_fastpath_enabled || cbs->cb.aio_lio_opcode != LIO_READ || !NIL_P(cbs->bufs) || cbs->direct) return 0;
+    if (!cbs->cb.aio_buf || !cbs->cb.aio_nbytes || cbs->cb.aio_nbytes > AIO_FASTPATH_MAX) return 0;
+    now = rb_aio_clock();
+    iov.iov_base = (void *)cbs->cb.aio_buf;
+    iov.iov_len = cbs->cb.aio_nbytes;
+    if ((n = preadv2(cbs->cb.aio_fildes, &iov, 1, cbs->cb.aio_offset, RWF_NOWAIT)) < 0){
+      rb_aio_stats.fastpath.misses++;
+      return 0;
+    }
+    rb_aio_stats.fastpath.bytes += n;
+    cbs->fast = n;
+    if (n == 0 || (size_t)n == cbs->cb.aio_nbytes){
+      rb_aio_stats.fastpath.hits++;
+      cbs->fastpath = AIO_FASTPATH_HIT;
+      cbs->op = AIO_OP_READ;
+      cbs->queued = cbs->submitted = now;
+      cbs->completed = rb_aio_clock();
+      cbs->res = n;
+      cbs->err = 0;
+      rb_aio_stats_submit(cbs);
+      return AIO_FASTPATH_HIT;
+    }
+    rb_aio_stats.fastpath.partial++;
+    cbs->fastpath = AIO_FASTPATH_PARTIAL;
+    cbs->cb.aio_offset += n;
+    cbs->cb.aio_buf = (char *)cbs->cb.aio_buf + n;
+    cbs->cb.aio_nbytes -= n;
+    return AIO_FASTPATH_PARTIAL;
+#else
+    return 0;
+#endif
+}
+
+/*
+ *  Cancels a request (or all requests against fd with a NULL control block) and
+ *  returns one of AIO_CANCELED, AIO_NOTCANCELED or AIO_ALLDONE, or -1 with errno
+ *  set.
+ */
+static int
+rb_aio_cancel1(int fd, rb_aiocb_t *cbs)
+{
+#ifdef HAVE_IO_URING
+    rb_aio_uring_t *ring = rb_aio_ring;
+    rb_aiocb_t cancel;
+    rb_aiocb_t *list[1];
+    struct io_uring_sqe *sqe;
+    if (ring){
+      if (fcntl(fd, F_GETFL) == -1) return -1;
+      pthread_mutex_lock(&ring->lock);
+      rb_aio_uring_reap(ring);
+      if (cbs ? cbs->err != EINPROGRESS : !ring->inflight){
+        pthread_mutex_unlock(&ring->lock);
+        return AIO_ALLDONE;
+      }
+  #if !defined(IORING_ASYNC_CANCEL_FD) || !defined(IORING_ASYNC_CANCEL_ALL)
+      /* Kernel headers without fd wide cancellation : nothing can be cancelled */
+      if (!cbs){
+        pthread_mutex_unlock(&ring->lock);
+        return AIO_NOTCANCELED;
+      }
+  #endif
+      memset(&cancel, 0, sizeof(rb_aiocb_t));
+      if (!(sqe = rb_aio_uring_get_sqe(ring))){
+        pthread_mutex_unlock(&ring->lock);
+        return AIO_NOTCANCELED;
+      }
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->user_data = (uintptr_t)&cancel;
+      if (cbs){
+        sqe->addr = (uintptr_t)cbs;
+      }else{
+  #if defined(IORING_ASYNC_CANCEL_FD) && defined(IORING_ASYNC_CANCEL_ALL)
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  #endif
+      }
+      cancel.err = EINPROGRESS;
+      ring->inflight++;
+      rb_aio_uring_flush(ring, 0);
+      pthread_mutex_unlock(&ring->lock);
+      list[0] = &cancel;
+      rb_aio_suspend(list, 1, 0);
+      if (!cbs && cancel.res > 0) return AIO_CANCELED;
+      switch(cancel.res){
+        case 0:
+             return cbs ? AIO_CANCELED : AIO_ALLDONE;
+        case -EALREADY:
+             return AIO_NOTCANCELED;
+        case -ENOENT:
+             return AIO_ALLDONE;
+      }
+      errno = -cancel.res;
+      return -1;
+    }
+#endif
+    return aio_cancel(fd, cbs ? &cbs->cb : NULL);
+}
+
+/*
+ *  Cancels, accounting for how long the cancellation took and whether it
+ *  succeeded (AIO_CANCELED).
+ */
+static int
+rb_aio_cancel0(int fd, rb_aiocb_t *cbs)
+{
+    rb_aio_op_stats_t *s = &rb_aio_stats.ops[AIO_OP_CANCEL];
+    double started = rb_aio_clock();
+    int ret = rb_aio_cancel1(fd, cbs);
+    s->submitted++;
+    s->completed++;
+    if (ret < 0) s->errors++;
+    if (ret == AIO_CANCELED) s->cancelled++;
+    rb_aio_histogram_record(&s->latency, rb_aio_clock() - started);
+    AIO_PROBE_CANCEL(fd, cbs, ret);
+    return ret;
+}
+
+/*
+ *  Queues a fsync (AIO::SYNC) or fdatasync (AIO::DSYNC) for the control block.
+ */
+static int
+rb_aio_fsync0(int op, rb_aiocb_t *cbs)
+{
+    int ret;
+    cbs->op = AIO_OP_FSYNC;
+    cbs->queued = cbs->submitted = rb_aio_clock();
+    cbs->completed = 0;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring){
+      ret = rb_aio_uring_fsync(rb_aio_ring, op, cbs);
+    }else
+#endif
+    ret = aio_fsync(op, &cbs->cb);
+    if (ret == 0){
+      rb_aio_stats_submit(cbs);
+    }else{
+      cbs->queued = 0;
+    }
+    return ret;
+}
+
+/*
+ *  Picks the io_uring engine when built with support for it and the kernel allows
+ *  it, unless AIO_BACKEND=posix is set in the environment.
+ */
+static void
+setup_rb_aio_backend(void)
+{
+#ifdef HAVE_IO_URING
+    const char *backend = getenv("AIO_BACKEND");
+    if (backend && strcmp(backend, "posix") == 0) return;
+    rb_aio_ring = rb_aio_uring_setup(AIO_URING_ENTRIES);
+    if (rb_aio_ring) pthread_atfork(NULL, NULL, rb_aio_uring_atfork_child);
+#endif
+}
+
+#define GetCBStruct(obj)	(Check_Type(obj, T_DATA), (rb_aiocb_t*)DATA_PTR(obj))
+
+static void 
+mark_control_block(rb_aiocb_t *cb)
+{
+    rb_gc_mark(cb->io);
+    rb_gc_mark(cb->rcb);
+    rb_gc_mark(cb->into);
+    rb_gc_mark(cb->str);
+    rb_gc_mark(cb->bufs);
+    if (cb->req) rb_gc_mark(cb->req->value);
+}
+
+/*
+ *  Waits out a request still in flight against a control block that's being
+ *  collected. Runs during GC and thus never releases the GVL.
+ */
+static void
+rb_aio_suspend_quiet(rb_aiocb_t *cbs)
+{
+    rb_aio_suspend_t s;
+    rb_aiocb_t *list[1];
+    aiocb_t *pending[1];
+    list[0] = cbs;
+    pending[0] = &cbs->cb;
+    s.list = list;
+    s.pending = pending;
+    s.ops = 1;
+    s.any = 0;
+    s.interrupted = 0;
+    s.deadline = NULL;
+    s.timedout = 0;
+    do {
+      s.err = 0;
+      rb_aio_suspend0(&s);
+    } while (s.err == EINTR);
+}
+
+static void 
+free_control_block(rb_aiocb_t* cb)
+{
+    if (rb_aio_status(cb) == EINPROGRESS) rb_aio_suspend_quiet(cb);
+    release_aio_buffer(cb);
+    rb_aio_class_unlink(cb);
+    if (cb->iovs) xfree(cb->iovs);
+    if (cb->req) xfree(cb->req);
+    xfree(cb);
+}
+
+static VALUE
+control_block_nbytes_set(VALUE cb, VALUE bytes)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (NUM2OFFT(bytes) < 0) rb_aio_error("Invalid buffer length");
+    cbs->cb.aio_nbytes = NUM2SIZET(bytes);
+    setup_aio_buffer(cbs);
+    return bytes;
+}
+
+/*
+ *  O_DIRECT alignment for the control block's file : memory and offset / length
+ *  alignment as reported by statx (Linux 6.1+), the file system block size for
+ *  both otherwise.
+ */
+static void
+rb_aio_direct_alignment(rb_aiocb_t *cbs)
+{
+    struct stat st;
+#if defined(HAVE_STATX) && defined(STATX_DIOALIGN)
+    struct statx stx;
+    if (statx(cbs->cb.aio_fildes, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align){
+      cbs->align_mem = stx.stx_dio_mem_align;
+      cbs->align_io = stx.stx_dio_offset_align;
+      return;
+    }
+#endif
+    cbs->align_io = fstat(cbs->cb.aio_fildes, &st) == 0 && st.st_blksize > 0 ? (size_t)st.st_blksize : 512;
+    cbs->align_mem = cbs->align_io;
+}
+
+/*
+ *  Turns O_DIRECT on or off for the control block's file descriptor.
+ */
+static void
+rb_aio_direct(rb_aiocb_t *cbs, int on)
+{
+#ifdef O_DIRECT
+    int flags = fcntl(cbs->cb.aio_fildes, F_GETFL);
+    if (flags == -1) rb_aio_error("Invalid file descriptor");
+    flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+    if (fcntl(cbs->cb.aio_fildes, F_SETFL, flags) == -1) rb_raise(eAio, "O_DIRECT not supported for this file : %s", strerror(errno));
+    cbs->direct = on;
+    if (on) rb_aio_direct_alignment(cbs);
+#else
+    if (on) rb_aio_error("O_DIRECT not supported on this platform");
+#endif
+}
+
+/*
+ *  call-seq:
+ *     cb.open('file.txt', 'r', :direct => true) -> cb
+ *  
+ *  Opens a file for the control block, reading all of it by default. With
+ *  :direct the file is opened for O_DIRECT, see CB#direct=.
+ */
+static VALUE
+control_block_open(int argc, VALUE *argv, VALUE cb)
+{
+    const char *fmode;
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    VALUE file, mode, opts;
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    int direct = 0;
+    rb_scan_args(argc, argv, "03", &file, &mode, &opts);
+    fmode = NIL_P(mode) ? "r" : RSTRING_PTR(mode);
+    struct stat stats;
+   
+    Check_Type(file, T_STRING);
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      direct = RTEST(rb_hash_aref(opts, ID2SYM(s_direct)));
+    }
+
+    cbs->io = rb_file_open(RSTRING_PTR(file), fmode);
+    GetOpenFile(cbs->io, fptr);
+    rb_io_check_readable(fptr);
+
+    if ( cbs->cb.aio_fildes == 0 && cbs->cb.aio_nbytes == 0){
+#ifdef RUBY19
+      cbs->cb.aio_fildes = fptr->fd;
+#else	
+      cbs->cb.aio_fildes = fileno(fptr->f);
+#endif
+      if (direct) rb_aio_direct(cbs, 1);
+      fstat(cbs->cb.aio_fildes, &stats);
+      if (direct) stats.st_size = (stats.st_size + cbs->align_io - 1) / cbs->align_io * cbs->align_io;
+      control_block_nbytes_set(cb, OFFT2NUM(stats.st_size));
+    }else if (direct){
+      rb_aio_direct(cbs, 1);
+    }
+    return cb;    
+}
+
+static VALUE
+control_block_direct_p(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return cbs->direct ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     cb.direct = true -> boolean
+ *  
+ *  Bypasses the page cache : sets O_DIRECT on the control block's file descriptor
+ *  (shared with any other users of it) and checks requests against the file's
+ *  direct I/O alignment before they're submitted. Offsets and lengths must be
+ *  multiples of the logical block size and buffers aligned in memory - leased
+ *  buffers are, so CB#buf= and plain reads work as is.
+ */
+static VALUE
+control_block_direct_set(VALUE cb, VALUE direct)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    rb_aio_direct(cbs, RTEST(direct));
+    return direct;
+}
+
+/*
+ *  call-seq:
+ *     cb.alignment -> integer or nil
+ *  
+ *  Offset and length alignment O_DIRECT requests must meet, nil unless direct.
+ */
+static VALUE
+control_block_alignment(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return cbs->direct ? SIZET2NUM(cbs->align_io) : Qnil;
+}
+
+static void
+control_block_reset0(rb_aiocb_t *cbs)
+{    
+    release_aio_buffer(cbs);
+    rb_aio_class_unlink(cbs);
+    if (cbs->iovs) xfree(cbs->iovs);
+    if (cbs->req) xfree(cbs->req);
+    bzero((char *)cbs, sizeof(rb_aiocb_t));
+    bzero((char *)&cbs->cb, sizeof(aiocb_t));
+    /* cleanup with rb_io_close(cb->io) */
+    cbs->io = Qnil;
+    cbs->rcb = Qnil;
+    cbs->into = Qnil;
+    cbs->str = Qnil;
+    cbs->bufs = Qnil;
+    cbs->err = 0;
+    cbs->cb.aio_fildes = 0; 
+    cbs->cb.aio_buf = NULL; 
+    cbs->cb.aio_nbytes = 0;
+    cbs->cb.aio_offset = 0;
+    cbs->cb.aio_reqprio = 0;
+    cbs->cb.aio_lio_opcode = LIO_READ;
+    cbs->priority = AIO_NORMAL;
+    rb_aio_sigevent(&cbs->cb, LIO_WAIT);
+}
+
+/*
+ *  Cancels and waits out a request still in flight, before its buffer or file
+ *  descriptor goes away.
+ */
+static void
+control_block_quiesce(rb_aiocb_t *cbs)
+{
+    rb_aiocb_t *list[1];
+    if (rb_aio_status(cbs) != EINPROGRESS) return;
+    list[0] = cbs;
+    rb_aio_cancel0(cbs->cb.aio_fildes, cbs);
+    rb_aio_suspend(list, 1, 0);
+}
+
+static VALUE
+control_block_reset(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    control_block_quiesce(cbs);
+    control_block_reset0(cbs);
+    return cb;
+}
+
+static VALUE control_block_alloc _((VALUE));
+static VALUE
+control_block_alloc(VALUE klass)
+{
+    VALUE obj;
+    rb_aiocb_t *cbs;
+    obj = Data_Make_Struct(klass, rb_aiocb_t, mark_control_block, free_control_block, cbs);
+    control_block_reset0(cbs);
+    return obj;
+}
+
+static VALUE
+control_block_initialize(int argc, VALUE *argv, VALUE cb)
+{
+    VALUE file, mode, opts;
+    VALUE args[3];
+    rb_scan_args(argc, argv, "03", &file, &mode, &opts);
+    if (RTEST(file)){ 
+      args[0] = file;
+      args[1] = mode;
+      args[2] = opts;
+      control_block_open(3, (VALUE *)args, cb);
+    }
+    if (rb_block_given_p()) rb_obj_instance_eval( 0, 0, cb );
+    return cb;
+}
+
+static VALUE 
+control_block_path(VALUE cb)
+{ 
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    if (NIL_P(cbs->io)) return rb_tainted_str_new2("");
+    GetOpenFile(cbs->io, fptr);
+    rb_io_check_readable(fptr);
+#ifdef RUBY19
+    return rb_file_s_expand_path( 1, &fptr->pathv );
+#else
+    VALUE path = rb_tainted_str_new2(fptr->path);
+    return rb_file_s_expand_path( 1, &path );
+#endif
+}
+
+static VALUE
+control_block_callback_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return cbs->rcb;
+}
+
+static VALUE
+control_block_callback_set(VALUE cb, VALUE rcb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (!NIL_P(rcb) && !rb_obj_is_proc(rcb)) rb_aio_error("Block required for callback!");
+    cbs->rcb = rcb;
+    return cbs->rcb;
+}
+
+static VALUE
+control_block_fildes_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return INT2FIX(cbs->cb.aio_fildes);
+}
+
+static VALUE
+control_block_fildes_set(VALUE cb, VALUE fd)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    Check_Type(fd, T_FIXNUM);
+    cbs->cb.aio_fildes = FIX2INT(fd);
+    return fd;
+}
+
+static VALUE
+control_block_buf_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return cbs->cb.aio_buf == NULL ? rb_tainted_str_new2("") : rb_tainted_str_new((char *)cbs->cb.aio_buf, cbs->cb.aio_nbytes);
+}
+
+static VALUE
+control_block_buf_set(VALUE cb, VALUE buf)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    Check_Type(buf, T_STRING);
+    cbs->bufs = Qnil;
+    cbs->cb.aio_nbytes = RSTRING_LEN(buf);
+    setup_aio_buffer(cbs);
+    if (cbs->cb.aio_nbytes) memcpy((void *)cbs->cb.aio_buf, RSTRING_PTR(buf), cbs->cb.aio_nbytes);
+    return buf;
+}
+
+static VALUE
+control_block_bufs_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return cbs->bufs;
+}
+
+/*
+ *  Scatter / gather : a write sends the given Strings back to back and a read
+ *  fills each up to its current length, in one request and without joining them.
+ *  nbytes becomes their combined length. nil reverts to the single buffer.
+ */
+static VALUE
+control_block_bufs_set(VALUE cb, VALUE bufs)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    long i;
+    if (NIL_P(bufs)){
+      cbs->bufs = Qnil;
+      return bufs;
+    }
+    Check_Type(bufs, T_ARRAY);
+    if (RARRAY_LEN(bufs) > IOV_MAX) rb_raise(rb_eArgError, "at most %d buffers per request", IOV_MAX);
+    for (i=0; i < RARRAY_LEN(bufs); i++) Check_Type(RARRAY_PTR(bufs)[i], T_STRING);
+    cbs->bufs = rb_ary_dup(bufs);
+    cbs->cb.aio_nbytes = 0;
+    for (i=0; i < RARRAY_LEN(bufs); i++) cbs->cb.aio_nbytes += RSTRING_LEN(RARRAY_PTR(bufs)[i]);
+    return bufs;
+}
+
+static VALUE
+control_block_into_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return cbs->into;
+}
+
+/*
+ *  Reads into the given String's own storage instead of a leased buffer, or into
+ *  a String allocated per read with true. The String must not be modified while a
+ *  request is in flight. nil restores reads through the buffer arena.
+ */
+static VALUE
+control_block_into_set(VALUE cb, VALUE into)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (!NIL_P(into) && into != Qtrue) Check_Type(into, T_STRING);
+    cbs->into = into;
+    return into;
+}
+
+static VALUE
+control_block_nbytes_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return SIZET2NUM(cbs->cb.aio_nbytes);
+}
+
+static VALUE
+control_block_offset_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return OFFT2NUM(cbs->cb.aio_offset);
+}
+
+static VALUE
+control_block_offset_set(VALUE cb, VALUE offset)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    cbs->cb.aio_offset = NUM2OFFT(offset);
+    return offset;
+}
+
+static VALUE
+control_block_reqprio_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return INT2FIX(cbs->cb.aio_reqprio);
+}
+
+static VALUE
+control_block_reqprio_set(VALUE cb, VALUE reqprio)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    Check_Type(reqprio, T_FIXNUM);
+    cbs->cb.aio_reqprio = FIX2INT(reqprio);
+    return reqprio;
+}
+
+static VALUE
+control_block_priority_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return INT2FIX(cbs->priority);
+}
+
+/*
+ *  call-seq:
+ *     cb.priority = AIO::INTERACTIVE -> fixnum
+ *  
+ *  Priority class : AIO::INTERACTIVE requests go out ahead of queued work,
+ *  AIO::BACKGROUND ones get a bounded share of the in flight limit while other
+ *  requests are in flight. AIO::NORMAL by default.
+ */
+static VALUE
+control_block_priority_set(VALUE cb, VALUE priority)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    Check_Type(priority, T_FIXNUM);
+    if (FIX2INT(priority) < AIO_INTERACTIVE || FIX2INT(priority) > AIO_BACKGROUND) rb_aio_error("Invalid priority class");
+    cbs->priority = FIX2INT(priority);
+    return priority;
+}
+
+static VALUE
+control_block_deadline_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return rb_aio_deadline(cbs) ? rb_float_new(rb_aio_deadline(cbs)) : Qnil;
+}
+
+/*
+ *  call-seq:
+ *     cb.deadline = 0.05 -> float or nil
+ *  
+ *  Seconds from submission the request is worth serving in. Requests are ordered
+ *  earliest deadline first within their class and pass any background throttling
+ *  once due. On io_uring a request still in flight at its deadline is cancelled
+ *  and fails with AIO::Error.
+ */
+static VALUE
+control_block_deadline_set(VALUE cb, VALUE deadline)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (NIL_P(deadline)){
+      if (cbs->req) cbs->req->deadline = 0;
+      return deadline;
+    }
+    if (NUM2DBL(deadline) <= 0) rb_aio_error("Deadline must be positive");
+    rb_aio_request(cbs)->deadline = NUM2DBL(deadline);
+    return deadline;
+}
+
+static VALUE
+control_block_lio_opcode_get(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return INT2FIX(cbs->cb.aio_lio_opcode);
+}
+
+static VALUE
+control_block_lio_opcode_set(VALUE cb, VALUE opcode)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    Check_Type(opcode, T_FIXNUM);
+    if (opcode != c_aio_read && opcode != c_aio_write) rb_aio_error("Only AIO::READ and AIO::WRITE modes supported");
+    cbs->cb.aio_lio_opcode = NUM2INT(opcode);
+    return opcode;
+}
+
+static VALUE
+control_block_validate(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (cbs->cb.aio_fildes <= 0) rb_aio_error("Invalid file descriptor");    
+    if (cbs->cb.aio_nbytes <= 0) rb_aio_error("Invalid buffer length");    
+    if (cbs->cb.aio_offset < 0) rb_aio_error("Invalid file offset");    
+    if (cbs->cb.aio_reqprio < 0) rb_aio_error("Invalid request priority");
+    if (cbs->cb.aio_lio_opcode != LIO_READ && cbs->cb.aio_lio_opcode != LIO_WRITE) rb_aio_error("Only AIO::READ and AIO::WRITE modes supported");
+    if (!cbs->cb.aio_buf) rb_aio_error("No AIO buffer allocated");	
+    rb_aio_direct_check(cbs);
+    return cb;    
+}
+
+static VALUE
+control_block_open_p(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return NIL_P(cbs->io) ? Qfalse : Qtrue;
+}
+
+static VALUE
+control_block_closed_p(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    return NIL_P(cbs->io) ? Qtrue : Qfalse;
+}
+
+static VALUE
+control_block_close(VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (NIL_P(cbs->io)) return Qfalse;
+    control_block_quiesce(cbs);
+    rb_aio_result(cbs);
+    release_aio_buffer(cbs);
+    if (!NIL_P(cbs->str)) cbs->cb.aio_buf = NULL;
+    rb_io_close(cbs->io);
+    cbs->io = Qnil; 
+    cbs->rcb = Qnil;
+    cbs->str = Qnil;
+    return Qtrue;
+}
+
+/*
+ *  Error handling for aio_write
+ */
+static void 
+rb_aio_write_error()
+{
+    switch(errno){
+       case EAGAIN: 
+            rb_aio_error("[EAGAIN] The request cannot be queued due to exceeding resource (queue) limitations.");
+       case EBADF: 
+            rb_aio_error("[EBADF] File descriptor is not valid for writing.");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] aio_read not supported by this implementation.");
+       case EINVAL: 
+            rb_aio_error("[EINVAL] Read offset is invalid");
+       case EOVERFLOW: 
+            rb_aio_error("[EOVERFLOW] Control block offset exceeded.");
+       case ECANCELED:
+            rb_aio_error("[ECANCELED] The requested I/O was canceled by an explicit aio_cancel() request.");
+       case EFBIG:
+            rb_aio_error("[EFBIG] Wrong offset.");
+    }
+}
+
+/*
+ *  Error handling for aio_read
+ */
+static void 
+rb_aio_read_error()
+{
+    switch(errno){
+       case EAGAIN: 
+            rb_aio_error("[EAGAIN] The request cannot be queued due to exceeding resource (queue) limitations.");
+       case EBADF: 
+            rb_aio_error("[EBADF] File descriptor is not valid for reading.");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] aio_read not supported by this implementation.");
+       case EINVAL: 
+            rb_aio_error("[EINVAL] Read offset is invalid");
+       case EOVERFLOW: 
+            rb_aio_error("[EOVERFLOW] Control block offset exceeded.");
+    }
+}
+
+/*
+ *  The value a completed request's callback is called with : the data read, the
+ *  bytes written, 0 for a sync or an AIO::Error if the request failed.
+ */
+static VALUE
+rb_aio_callback_result(rb_aiocb_t *cbs)
+{
+    ssize_t ret = rb_aio_result(cbs);
+    int fsync = cbs->fsync;
+    cbs->fsync = 0;
+    if (ret < 0){
+      cbs->err = errno;
+      return rb_exc_new2(eAio, strerror(errno));
+    }
+    if (fsync) return INT2FIX(0);
+    if (cbs->cb.aio_lio_opcode == LIO_READ) return rb_aio_read_result(cbs, ret);
+    return SSIZET2NUM(ret);
+}
+
+/*
+ *  Collects a completed request's result once, for both its callback and any
+ *  AIO::Request handle on it.
+ */
+static VALUE
+rb_aio_collect(rb_aiocb_t *cbs)
+{
+    rb_aio_request_t *req = rb_aio_request(cbs);
+    if (!req->collected){
+      req->value = rb_aio_callback_result(cbs);
+      req->collected = 1;
+    }
+    return req->value;
+}
+
+static VALUE
+rb_aio_callback0(VALUE args)
+{
+    return rb_funcall(RARRAY_PTR(args)[0], rb_intern("call"), 1, RARRAY_PTR(args)[1]);
+}
+
+static VALUE
+rb_aio_callback_raised(VALUE args, VALUE exc)
+{
+    rb_warn("AIO callback raised %s", RSTRING_PTR(rb_inspect(exc)));
+    return Qnil;
+}
+
+/*
+ *  Runs a control block's callback with result. Exceptions are reported as
+ *  warnings, so one failing callback doesn't take the others down with it.
+ */
+static void
+rb_aio_callback(rb_aiocb_t *cbs, VALUE result)
+{
+    if (NIL_P(cbs->rcb)) return;
+    rb_rescue2(rb_aio_callback0, rb_assoc_new(cbs->rcb, result), rb_aio_callback_raised, Qnil, rb_eStandardError, (VALUE)0);
+}
+
+/*
+ *  Calls back on the submitting thread once a blocking call completes, exceptions
+ *  propagate to the caller. Returns result.
+ */
+static VALUE
+rb_aio_yield(rb_aiocb_t *cbs, VALUE result)
+{
+    if (!NIL_P(cbs->rcb)) rb_funcall(cbs->rcb, rb_intern("call"), 1, result);
+    return result;
+}
+
+/*
+ *  Runs the callbacks of pending requests that have completed, returns how many
+ *  are still in flight.
+ */
+static long
+rb_aio_dispatch_sweep(void)
+{
+    long i = 0;
+    VALUE cb;
+    rb_aiocb_t *cbs;
+    while (i < RARRAY_LEN(rb_aio_dispatch_pending)) {
+      cb = RARRAY_PTR(rb_aio_dispatch_pending)[i];
+      cbs = GetCBStruct(cb);
+      if (rb_aio_status(cbs) == EINPROGRESS){
+        i++;
+        continue;
+      }
+      rb_ary_delete_at(rb_aio_dispatch_pending, i);
+      rb_aio_callback(cbs, rb_aio_collect(cbs));
+      RB_GC_GUARD(cb);
+    }
+    return RARRAY_LEN(rb_aio_dispatch_pending);
+}
+
+/*
+ *  Blocks the dispatcher without the GVL until one of the pending requests
+ *  completes or rb_aio_dispatch wakes it for a new one. A wakeup can't reach
+ *  aio_suspend before it's entered, so on POSIX AIO the wait is also cut short
+ *  after AIO_DISPATCH_POLL. The completion descriptor is left to
+ *  AIO.completion_io consumers.
+ */
+static void
+rb_aio_dispatch_wait(void)
+{
+    volatile VALUE pending = rb_ary_dup(rb_aio_dispatch_pending);
+    long op, ops = RARRAY_LEN(pending);
+    volatile VALUE scratch = rb_str_new(0, ops * (sizeof(rb_aiocb_t *) + sizeof(aiocb_t *)));
+    struct timespec deadline;
+    rb_aio_suspend_t s;
+    MEMZERO(&s, rb_aio_suspend_t, 1);
+    s.list = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    s.pending = (aiocb_t **)(s.list + ops);
+    for (op=0; op < ops; op++) {
+      s.list[op] = GetCBStruct(RARRAY_PTR(pending)[op]);
+      s.pending[op] = &s.list[op]->cb;
+    }
+    s.ops = (int)ops;
+    s.any = 1;
+#ifdef RUBY19
+  #ifdef HAVE_IO_URING
+    if (rb_aio_ring){
+      rb_aio_blocking_region(rb_aio_suspend0, &s, rb_aio_uring_ubf, &s);
+    }else
+  #endif
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += AIO_DISPATCH_POLL;
+      if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      s.deadline = &deadline;
+      rb_aio_blocking_region(rb_aio_suspend0, &s, RUBY_UBF_IO, 0);
+    }
+    rb_thread_check_ints();
+#else
+    /* Green threads can't block outside of the interpreter, poll instead */
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = AIO_DISPATCH_POLL / 1000;
+    rb_thread_wait_for(tv);
+#endif
+}
+
+/*
+ *  The dispatcher thread : waits on the pending requests without the GVL, then
+ *  calls back everything that completed in one sweep. Exits once nothing is
+ *  pending and is restarted by the next registration.
+ */
+static VALUE
+rb_aio_dispatch_loop(void *arg)
+{
+    while (rb_aio_dispatch_sweep() > 0) {
+      rb_aio_dispatch_wait();
+    }
+    rb_aio_dispatcher = Qnil;
+    return Qnil;
+}
+
+/*
+ *  Hands an AIO::NOWAIT request with a callback to the dispatcher thread.
+ */
+static void
+rb_aio_dispatch(VALUE cb)
+{
+    if (NIL_P(GetCBStruct(cb)->rcb)) return;
+    if (NIL_P(rb_aio_dispatch_pending)) rb_aio_dispatch_pending = rb_ary_new();
+    rb_ary_push(rb_aio_dispatch_pending, cb);
+    if (NIL_P(rb_aio_dispatcher) || !RTEST(rb_funcall(rb_aio_dispatcher, s_alive_p, 0))){
+      rb_aio_dispatcher = rb_thread_create(rb_aio_dispatch_loop, 0);
+    }else{
+      rb_thread_wakeup(rb_aio_dispatcher);
+    }
+}
+
+/*
+ *  Initiates a *blocking* write
+ */
+static VALUE 
+rb_aio_write(rb_aiocb_t *cb)
+{
+    ssize_t ret;
+    
+    rb_aio_sigevent(&cb->cb, LIO_WAIT);
+    TRAP_BEG;
+    ret = rb_aio_submit(&cb, 1, 1);
+    TRAP_END;
+    if (ret != 0) rb_aio_write_error();
+    rb_aio_suspend(&cb, 1, 1);
+    if ((ret = rb_aio_result(cb)) > 0) {
+     return rb_aio_yield(cb, SIZET2NUM(cb->cb.aio_nbytes));
+    }else{
+      return INT2NUM(errno);
+    }
+}
+
+/*
+ *  Initiates a *blocking* read
+ */
+static VALUE 
+rb_aio_read(rb_aiocb_t *cb)
+{
+    ssize_t ret;    
+    rb_aio_sigevent(&cb->cb, LIO_WAIT);
+    if (rb_aio_fastpath(cb) != AIO_FASTPATH_HIT){
+      TRAP_BEG;
+      ret = rb_aio_submit(&cb, 1, 1);
+      TRAP_END;
+      if (ret != 0) rb_aio_read_error();
+      rb_aio_suspend(&cb, 1, 1);
+    }
+    if ((ret = rb_aio_result(cb)) > 0) {
+      return rb_aio_yield(cb, rb_aio_read_result(cb, ret));
+    }else{
+      return INT2NUM(errno);
+    }
+}
+
+/*
+ *  Error handling for lio_listio
+ */
+static void 
+rb_aio_listio_error()
+{
+    switch(errno){
+       case EAGAIN: 
+            rb_aio_error("[EAGAIN] Resources necessary to queue all the requests are not available at the moment.");
+       case EIO: 
+            rb_aio_error("[EIO] One or more requests failed");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] lio_listio not supported by this implementation.");
+       case EINVAL: 
+            rb_aio_error("[EINVAL] Maximum number of allowed simultaneous requests exceeded.");
+       case EINTR: 
+            rb_aio_error("[EINTR] A signal was delivered while waiting for all I/O requests to complete during a LIO_WAIT operation.");
+    }
+}
+
+static void
+rb_aio_lio_listio0(int mode, VALUE cbs, rb_aiocb_t **list, int ops)
+{
+    int op;
+    for (op=0; op < ops; op++) {
+        rb_aiocb_t *cb = GetCBStruct(RARRAY_PTR(cbs)[op]);
+        setup_aio_target(cb);
+        rb_aio_sigevent(&cb->cb, mode);
+        if (mode == LIO_NOWAIT || cb->req){
+          rb_aio_request(cb)->collected = 0;
+          cb->req->value = Qnil;
+        }
+        if (rb_block_given_p()){
+          cb->rcb = rb_block_proc();
+        } 
+      list[op] = cb;
+    }
+}
+
+/*
+ *  Initiates lio_listio, submitting the whole batch at once.
+ */
+static int 
+rb_aio_lio_listio(int mode, VALUE cbs, rb_aiocb_t **list)
+{
+    int ret;
+    int ops = RARRAY_LEN(cbs);
+    rb_aio_lio_listio0(mode, cbs, list, ops);
+    if (mode == LIO_NOP) return ops;
+
+    TRAP_BEG;
+    ret = rb_aio_submit(list, ops, 0);
+    TRAP_END;
+    if (ret != 0) rb_aio_listio_error();
+    return ops; 
+}
+
+typedef struct{
+    rb_aiocb_t *cbs;
+    int idx;
+} rb_aio_order_t;
+
+static int
+rb_aio_order_cmp(const void *a, const void *b)
+{
+    const rb_aio_order_t *x = (const rb_aio_order_t *)a;
+    const rb_aio_order_t *y = (const rb_aio_order_t *)b;
+    double dx = rb_aio_deadline(x->cbs), dy = rb_aio_deadline(y->cbs);
+    if (x->cbs->priority != y->cbs->priority) return x->cbs->priority - y->cbs->priority;
+    if (dx != dy){
+      if (!dx) return 1;
+      if (!dy) return -1;
+      return dx < dy ? -1 : 1;
+    }
+    return x->idx - y->idx;
+}
+
+/*
+ *  Copies list into ordered by priority class, then earliest deadline first and
+ *  the given order otherwise. Returns list itself if all requests are alike.
+ */
+static rb_aiocb_t **
+rb_aio_order(rb_aiocb_t **list, int ops, rb_aiocb_t **ordered)
+{
+    volatile VALUE scratch;
+    rb_aio_order_t *order;
+    int op;
+    for (op=0; op < ops; op++) {
+      if (list[op]->priority != list[0]->priority || rb_aio_deadline(list[op])) break;
+    }
+    if (op == ops) return list;
+    scratch = rb_str_new(0, ops * sizeof(rb_aio_order_t));
+    order = (rb_aio_order_t *)RSTRING_PTR(scratch);
+    for (op=0; op < ops; op++) {
+      order[op].cbs = list[op];
+      order[op].idx = op;
+    }
+    qsort(order, ops, sizeof(rb_aio_order_t), rb_aio_order_cmp);
+    for (op=0; op < ops; op++) {
+      ordered[op] = order[op].cbs;
+    }
+    return ordered;
+}
+
+/*
+ *  Runs a list of requests to completion, keeping at most AIO.max_inflight of
+ *  them in flight and refilling the window as they complete. Requests go out by
+ *  priority class and deadline, see rb_aio_order.
+ */
+static void
+rb_aio_pipeline(rb_aiocb_t **list, int ops)
+{
+    volatile VALUE scratch = rb_str_new(0, (ops ? ops : 1) * 2 * sizeof(rb_aiocb_t *));
+    rb_aiocb_t **window = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    int op, live, batch, queued, next = 0, inflight = 0;
+    list = rb_aio_order(list, ops, window + (ops ? ops : 1));
+    while (next < ops || inflight > 0) {
+      batch = ops - next;
+      if (batch > rb_aio_max_inflight - inflight) batch = rb_aio_max_inflight - inflight;
+      if (batch > 0){
+        for (op=next, queued=0; op < next + batch; op++) {
+          if (rb_aio_fastpath(list[op]) != AIO_FASTPATH_HIT) window[inflight + queued++] = list[op];
+        }
+        TRAP_BEG;
+        op = rb_aio_submit(window + inflight, queued, 1);
+        TRAP_END;
+        if (op != 0) rb_aio_listio_error();
+        inflight += queued;
+        next += batch;
+      }
+      if (inflight == 0) continue;
+      rb_aio_wait(window, inflight, 1, 1);
+      for (op=0, live=0; op < inflight; op++) {
+        if (window[op]) window[live++] = window[op];
+      }
+      inflight = live;
+    }
+}
+
+/*
+ *  Blocking lio_listio, windowed through rb_aio_pipeline. Each refill is handed
+ *  to the backend right before the GVL is released for the wait. Results are the
+ *  data read or bytes actually written, failed requests an AIO::Error in their
+ *  slot.
+ */
+static VALUE
+rb_aio_lio_listio_blocking(VALUE cbs)
+{
+    int op, ops = RARRAY_LEN(cbs);
+    volatile VALUE scratch = rb_str_new(0, ops * sizeof(rb_aiocb_t *));
+    rb_aiocb_t **list = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    VALUE results;
+    rb_aio_lio_listio0(LIO_WAIT, cbs, list, ops);
+    rb_aio_pipeline(list, ops);
+    results = rb_ary_new2( ops );
+    for (op=0; op < ops; op++) {
+      rb_ary_push( results, rb_aio_yield( list[op], rb_aio_callback_result(list[op]) ) );
+    } 
+    return results;
+}
+
+/*
+ *  AIO::Request and AIO::Batch are handles on AIO::NOWAIT submissions, holding
+ *  their control blocks in @cb and their requests in @requests respectively.
+ */
+static VALUE
+rb_aio_request_new(VALUE cb)
+{
+    VALUE req = rb_obj_alloc(rb_cRequest);
+    rb_ivar_set(req, s_iv_cb, cb);
+    return req;
+}
+
+static VALUE
+rb_aio_batch_new(VALUE cbs)
+{
+    VALUE batch = rb_obj_alloc(rb_cBatch);
+    VALUE requests = rb_ary_new2(RARRAY_LEN(cbs));
+    long i;
+    for (i=0; i < RARRAY_LEN(cbs); i++) {
+      rb_ary_push(requests, rb_aio_request_new(RARRAY_PTR(cbs)[i]));
+    }
+    rb_ivar_set(batch, s_iv_requests, requests);
+    return batch;
+}
+
+/*
+ *  Gathers the control blocks of a list of Requests and Batches into a wait list,
+ *  with the Request each entry belongs to in reqs.
+ */
+static int
+rb_aio_handles(VALUE handles, volatile VALUE *scratch, rb_aiocb_t ***list, VALUE reqs)
+{
+    VALUE handle, requests;
+    long i, j;
+    Check_Type(handles, T_ARRAY);
+    for (i=0; i < RARRAY_LEN(handles); i++) {
+      handle = RARRAY_PTR(handles)[i];
+      if (rb_obj_is_kind_of(handle, rb_cBatch)){
+        requests = rb_ivar_get(handle, s_iv_requests);
+        for (j=0; j < RARRAY_LEN(requests); j++) rb_ary_push(reqs, RARRAY_PTR(requests)[j]);
+      }else if (rb_obj_is_kind_of(handle, rb_cRequest)){
+        rb_ary_push(reqs, handle);
+      }else{
+        rb_raise(rb_eTypeError, "expected AIO::Request or AIO::Batch");
+      }
+    }
+    *scratch = rb_str_new(0, (RARRAY_LEN(reqs) ? RARRAY_LEN(reqs) : 1) * sizeof(rb_aiocb_t *));
+    *list = (rb_aiocb_t **)RSTRING_PTR(*scratch);
+    for (i=0; i < RARRAY_LEN(reqs); i++) {
+      (*list)[i] = GetCBStruct(rb_ivar_get(RARRAY_PTR(reqs)[i], s_iv_cb));
+    }
+    return (int)RARRAY_LEN(reqs);
+}
+
+static VALUE
+request_cb(VALUE req)
+{
+    return rb_ivar_get(req, s_iv_cb);
+}
+
+/*
+ *  call-seq:
+ *     request.ready? -> boolean
+ *  
+ *  Whether the request completed.
+ */
+static VALUE
+request_ready_p(VALUE req)
+{
+    rb_aiocb_t *cbs = GetCBStruct(request_cb(req));
+    return (rb_aio_collected(cbs) || rb_aio_status(cbs) != EINPROGRESS) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     request.wait(timeout = nil) -> boolean
+ *  
+ *  Blocks without the GVL until the request completes or timeout seconds pass,
+ *  returns whether it completed.
+ */
+static VALUE
+request_wait(int argc, VALUE *argv, VALUE req)
+{
+    VALUE timeout;
+    rb_aiocb_t *list[1];
+    rb_scan_args(argc, argv, "01", &timeout);
+    list[0] = GetCBStruct(request_cb(req));
+    if (rb_aio_collected(list[0])) return Qtrue;
+    return rb_aio_timedwait(list, 1, 0, timeout) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     request.value -> string or fixnum
+ *  
+ *  Waits for the request and returns the data read or the bytes written. Raises
+ *  AIO::Error if the request failed.
+ */
+static VALUE
+request_value(VALUE req)
+{
+    rb_aiocb_t *cbs = GetCBStruct(request_cb(req));
+    VALUE value;
+    if (!rb_aio_collected(cbs)) request_wait(0, 0, req);
+    value = rb_aio_collect(cbs);
+    if (rb_obj_is_kind_of(value, rb_eException)) rb_exc_raise(value);
+    return value;
+}
+
+static VALUE
+batch_requests(VALUE batch)
+{
+    return rb_ivar_get(batch, s_iv_requests);
+}
+
+static VALUE
+batch_ready_p(VALUE batch)
+{
+    VALUE requests = batch_requests(batch);
+    long i;
+    for (i=0; i < RARRAY_LEN(requests); i++) {
+      if (!RTEST(request_ready_p(RARRAY_PTR(requests)[i]))) return Qfalse;
+    }
+    return Qtrue;
+}
+
+/*
+ *  call-seq:
+ *     batch.wait(timeout = nil) -> boolean
+ *  
+ *  Blocks without the GVL until every request completes or timeout seconds pass.
+ */
+static VALUE
+batch_wait(int argc, VALUE *argv, VALUE batch)
+{
+    VALUE timeout;
+    volatile VALUE scratch;
+    rb_aiocb_t **list;
+    int ops;
+    rb_scan_args(argc, argv, "01", &timeout);
+    ops = rb_aio_handles(rb_ary_new3(1, batch), &scratch, &list, rb_ary_new());
+    return rb_aio_timedwait(list, ops, 0, timeout) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     batch.value -> array
+ *  
+ *  Waits for the batch and returns each request's value.
+ */
+static VALUE
+batch_value(VALUE batch)
+{
+    VALUE requests = batch_requests(batch);
+    VALUE values = rb_ary_new2(RARRAY_LEN(requests));
+    long i;
+    batch_wait(0, 0, batch);
+    for (i=0; i < RARRAY_LEN(requests); i++) {
+      rb_ary_push(values, request_value(RARRAY_PTR(requests)[i]));
+    }
+    return values;
+}
+
+/*
+ *  call-seq:
+ *     AIO.wait_any(handles, timeout = nil) -> request or nil
+ *  
+ *  Blocks without the GVL until one of the given Requests (or a request of one of
+ *  the given Batches) completes and returns it, nil if timeout seconds pass first.
+ */
+static VALUE
+rb_aio_s_wait_any(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE handles, timeout, reqs = rb_ary_new();
+    volatile VALUE scratch;
+    rb_aiocb_t **list;
+    int op, ops;
+    rb_scan_args(argc, argv, "11", &handles, &timeout);
+    ops = rb_aio_handles(handles, &scratch, &list, reqs);
+    if (ops == 0) return Qnil;
+    for (op=0; op < ops; op++) {
+      if (rb_aio_collected(list[op])) return RARRAY_PTR(reqs)[op];
+    }
+    if (!rb_aio_timedwait(list, ops, 1, timeout)) return Qnil;
+    for (op=0; op < ops; op++) {
+      if (RTEST(request_ready_p(RARRAY_PTR(reqs)[op]))) return RARRAY_PTR(reqs)[op];
+    }
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     AIO.wait_all(handles, timeout = nil) -> boolean
+ *  
+ *  Blocks without the GVL until every given request completes, false if timeout
+ *  seconds pass first.
+ */
+static VALUE
+rb_aio_s_wait_all(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE handles, timeout;
+    volatile VALUE scratch;
+    rb_aiocb_t **list;
+    int ops;
+    rb_scan_args(argc, argv, "11", &handles, &timeout);
+    ops = rb_aio_handles(handles, &scratch, &list, rb_ary_new());
+    return rb_aio_timedwait(list, ops, 0, timeout) ? Qtrue : Qfalse;
+}
+
+/*
+ *  No-op lio_listio
+ */
+static VALUE
+rb_aio_lio_listio_noop(VALUE cbs)
+{
+    volatile VALUE scratch = rb_str_new(0, RARRAY_LEN(cbs) * sizeof(rb_aiocb_t *));
+    rb_aio_lio_listio(LIO_NOP, cbs, (rb_aiocb_t **)RSTRING_PTR(scratch));
+    return Qnil;
+}
+
+/*
+ *  Non-blocking lio_listio. The whole batch is submitted at once.
+ */
+static VALUE
+rb_aio_lio_listio_non_blocking(VALUE cbs)
+{
+    volatile VALUE scratch = rb_str_new(0, RARRAY_LEN(cbs) * sizeof(rb_aiocb_t *));
+    int op;
+    rb_aio_lio_listio(LIO_NOWAIT, cbs, (rb_aiocb_t **)RSTRING_PTR(scratch));
+    for (op=0; op < RARRAY_LEN(cbs); op++) {
+      rb_aio_dispatch(RARRAY_PTR(cbs)[op]);
+    }
+    return rb_aio_batch_new(cbs);
+}
+
+/*
+ *  Helper to ensure files opened via AIO.lio_listio is closed.
+ */
+static VALUE 
+rb_io_closes(VALUE cbs){
+    int io;
+    for (io=0; io < RARRAY_LEN(cbs); io++) {
+      control_block_close(RARRAY_PTR(cbs)[io]);
+    }  
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     AIO.write(cb) -> fixnum
+ *  
+ *  Asynchronously writes to a file.This is an initial *blocking* implementation until
+ *  cross platform notification is supported.
+ */
+static VALUE 
+rb_aio_s_write(VALUE aio, VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    GetOpenFile(cbs->io, fptr);
+    rb_io_check_writable(fptr);    
+    if (rb_block_given_p()){
+      cbs->rcb = rb_block_proc();
+    }
+    setup_aio_target(cbs);
+    return rb_ensure(rb_aio_write, (VALUE)cbs, control_block_close, cb);
+}
+
+/*
+ *  call-seq:
+ *     AIO.read(cb) -> string
+ *     AIO.read(cb, :into => str) -> str
+ *  
+ *  Asynchronously reads a file.This is an initial *blocking* implementation until
+ *  cross platform notification is supported. With :into the data is read straight
+ *  into the given String's storage, which is resized to the control block's
+ *  nbytes, and no intermediate copy is made.
+ */
+static VALUE 
+rb_aio_s_read(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE cb, opts, into;
+    rb_aiocb_t *cbs;
+    rb_scan_args(argc, argv, "11", &cb, &opts);
+    cbs = GetCBStruct(cb);
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      into = rb_hash_aref(opts, ID2SYM(s_into));
+      if (!NIL_P(into)) control_block_into_set(cb, into);
+    }
+    if (rb_block_given_p()){
+      cbs->rcb = rb_block_proc();
+    }
+    setup_aio_target(cbs);
+    return rb_ensure(rb_aio_read, (VALUE)cbs, control_block_close, cb);
+}
+
+/*
+ *  Opens path for reading and returns the File, its descriptor and size.
+ */
+static VALUE
+rb_aio_open_path(VALUE path, int *fd, off_t *size)
+{
+    VALUE io;
+    struct stat stats;
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    Check_Type(path, T_STRING);
+    io = rb_file_open(RSTRING_PTR(path), "r");
+    GetOpenFile(io, fptr);
+#ifdef RUBY19
+    *fd = fptr->fd;
+#else	
+    *fd = fileno(fptr->f);
+#endif
+    if (fstat(*fd, &stats) != 0){
+      rb_io_close(io);
+      rb_sys_fail(RSTRING_PTR(path));
+    }
+    *size = stats.st_size;
+    return io;
+}
+
+/*
+ *  An Array of n fresh read control blocks on fd.
+ */
+static VALUE
+rb_aio_control_blocks(int fd, long n)
+{
+    VALUE cbs = rb_ary_new2(n);
+    long i;
+    for (i=0; i < n; i++) {
+      rb_ary_push(cbs, control_block_alloc(rb_cCB));
+      GetCBStruct(RARRAY_PTR(cbs)[i])->cb.aio_fildes = fd;
+    }
+    return cbs;
+}
+
+/* A pipelined sequential reader (AIO.each_chunk) or split read (AIO.read_parallel) */
+typedef struct{
+    VALUE io;
+    VALUE cbs;
+    long depth;
+    size_t chunk;
+    off_t size;
+    off_t next;
+} rb_aio_stream_t;
+
+/*
+ *  Queues a chunk read at the stream's next offset on the given control block.
+ */
+static void
+rb_aio_stream_submit(rb_aio_stream_t *s, rb_aiocb_t *cb)
+{
+    int ret;
+    cb->cb.aio_offset = s->next;
+    cb->cb.aio_nbytes = (s->size - s->next) < (off_t)s->chunk ? (size_t)(s->size - s->next) : s->chunk;
+    setup_aio_buffer(cb);
+    rb_aio_sigevent(&cb->cb, LIO_WAIT);
+    TRAP_BEG;
+    ret = rb_aio_submit(&cb, 1, 0);
+    TRAP_END;
+    if (ret != 0){
+      rb_aio_read_error();
+      rb_sys_fail("aio_read");
+    }
+    s->next += cb->cb.aio_nbytes;
+}
+
+/*
+ *  Keeps depth chunk reads in flight, yields them in file order and refills the
+ *  ring with the next offset before handing each chunk to the block, so the disk
+ *  works ahead while Ruby processes.
+ */
+static VALUE
+rb_aio_stream_run(VALUE arg)
+{
+    rb_aio_stream_t *s = (rb_aio_stream_t *)arg;
+    rb_aiocb_t *cb;
+    long head = 0, pending = 0;
+    ssize_t ret;
+    VALUE chunk;
+    for (; pending < s->depth && s->next < s->size; pending++) {
+      rb_aio_stream_submit(s, GetCBStruct(RARRAY_PTR(s->cbs)[pending]));
+    }
+    while (pending > 0) {
+      cb = GetCBStruct(RARRAY_PTR(s->cbs)[head]);
+      rb_aio_suspend(&cb, 1, 1);
+      pending--;
+      if ((ret = rb_aio_result(cb)) < 0){
+        rb_aio_read_error();
+        rb_sys_fail("aio_read");
+      }
+      chunk = rb_tainted_str_new((char *)cb->cb.aio_buf, ret);
+      /* The file shrunk underneath us */
+      if ((size_t)ret < cb->cb.aio_nbytes) s->size = s->next;
+      if (s->next < s->size){
+        rb_aio_stream_submit(s, cb);
+        pending++;
+      }
+      head = (head + 1) % s->depth;
+      if (ret > 0) rb_yield(chunk);
+    }
+    return Qnil;
+}
+
+static VALUE
+rb_aio_stream_close(VALUE arg)
+{
+    rb_aio_stream_t *s = (rb_aio_stream_t *)arg;
+    rb_aiocb_t *cb;
+    long i;
+    for (i=0; i < s->depth; i++) {
+      cb = GetCBStruct(RARRAY_PTR(s->cbs)[i]);
+      control_block_quiesce(cb);
+      release_aio_buffer(cb);
+      if (!NIL_P(cb->str)) cb->cb.aio_buf = NULL;
+      cb->str = Qnil;
+    }
+    if (!NIL_P(s->io)) rb_io_close(s->io);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     AIO.each_chunk(path, :chunk_size => 1048576, :depth => 4){|chunk| ... } -> nil
+ *     AIO.each_chunk(path, ...) -> enumerator
+ *  
+ *  Streams a file of any size through the block in chunk_size pieces, in order.
+ *  depth reads are kept in flight at increasing offsets while the block runs, and
+ *  their buffers are leased once and reused, so memory stays bounded by
+ *  depth * chunk_size however large the file.
+ */
+static VALUE
+rb_aio_s_each_chunk(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE path, opts, opt;
+    rb_aio_stream_t s;
+    int fd;
+    RETURN_ENUMERATOR(aio, argc, argv);
+    rb_scan_args(argc, argv, "11", &path, &opts);
+    s.chunk = AIO_STREAM_CHUNK;
+    s.depth = AIO_STREAM_DEPTH;
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_chunk_size)))) s.chunk = NUM2LONG(opt);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_depth)))) s.depth = NUM2LONG(opt);
+    }
+    if ((long)s.chunk <= 0 || s.depth <= 0) rb_raise(rb_eArgError, "chunk_size and depth must be positive");
+    s.io = rb_aio_open_path(path, &fd, &s.size);
+    s.next = 0;
+    s.cbs = rb_aio_control_blocks(fd, s.depth);
+    rb_ensure(rb_aio_stream_run, (VALUE)&s, rb_aio_stream_close, (VALUE)&s);
+    RB_GC_GUARD(s.cbs);
+    RB_GC_GUARD(s.io);
+    return Qnil;
+}
+
+/*
+ *  Submits every segment of the file at once, each reading straight into its
+ *  slice of the result String, and waits for all of them.
+ */
+static VALUE
+rb_aio_parallel_run(VALUE arg)
+{
+    rb_aio_stream_t *s = (rb_aio_stream_t *)arg;
+    volatile VALUE str = rb_tainted_str_new(0, s->size);
+    volatile VALUE scratch = rb_str_new(0, s->depth * sizeof(rb_aiocb_t *));
+    rb_aiocb_t **list = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    rb_aiocb_t *cb;
+    long i;
+    ssize_t ret;
+    size_t len = 0;
+    int err;
+    for (i=0; i < s->depth; i++) {
+      cb = list[i] = GetCBStruct(RARRAY_PTR(s->cbs)[i]);
+      cb->cb.aio_offset = s->next;
+      cb->cb.aio_nbytes = (s->size - s->next) < (off_t)s->chunk ? (size_t)(s->size - s->next) : s->chunk;
+      cb->cb.aio_buf = RSTRING_PTR(str) + s->next;
+      cb->str = str;
+      rb_aio_sigevent(&cb->cb, LIO_WAIT);
+      s->next += cb->cb.aio_nbytes;
+    }
+    TRAP_BEG;
+    err = rb_aio_submit(list, s->depth, 1);
+    TRAP_END;
+    if (err != 0){
+      rb_aio_read_error();
+      rb_sys_fail("aio_read");
+    }
+    rb_aio_suspend(list, s->depth, 1);
+    for (i=0; i < s->depth; i++) {
+      if ((ret = rb_aio_result(list[i])) < 0){
+        rb_aio_read_error();
+        rb_sys_fail("aio_read");
+      }
+      len += ret;
+      /* The file shrunk underneath us */
+      if ((size_t)ret < list[i]->cb.aio_nbytes) break;
+    }
+    rb_str_resize(str, len);
+    return str;
+}
+
+/*
+ *  call-seq:
+ *     AIO.read_parallel(path, :segments => 8) -> string
+ *  
+ *  Reads a whole file as segments page aligned ranges submitted at once, so the
+ *  device sees a queue depth above one, straight into a single String without
+ *  joining copies. segments is capped at AIO.max_inflight.
+ */
+static VALUE
+rb_aio_s_read_parallel(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE path, opts, opt;
+    rb_aio_stream_t s;
+    long segments = AIO_PARALLEL_SEGMENTS;
+    int fd;
+    rb_scan_args(argc, argv, "11", &path, &opts);
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_segments)))) segments = NUM2LONG(opt);
+    }
+    if (segments <= 0) rb_raise(rb_eArgError, "segments must be positive");
+    if (segments > rb_aio_max_inflight) segments = rb_aio_max_inflight;
+    s.io = rb_aio_open_path(path, &fd, &s.size);
+    if (s.size == 0){
+      rb_io_close(s.io);
+      return rb_tainted_str_new2("");
+    }
+    s.chunk = (s.size + segments - 1) / segments;
+    s.chunk = (s.chunk + AIO_PARALLEL_ALIGN - 1) & ~(size_t)(AIO_PARALLEL_ALIGN - 1);
+    s.depth = (s.size + s.chunk - 1) / s.chunk;
+    s.next = 0;
+    s.cbs = rb_aio_control_blocks(fd, s.depth);
+    opt = rb_ensure(rb_aio_parallel_run, (VALUE)&s, rb_aio_stream_close, (VALUE)&s);
+    RB_GC_GUARD(s.cbs);
+    RB_GC_GUARD(s.io);
+    return opt;
+}
+
+/* A requested range, and the merged extent it's read through */
+typedef struct{
+    off_t off;
+    size_t len;
+    long idx;
+    long extent;
+} rb_aio_range_t;
+
+static int
+rb_aio_range_cmp(const void *a, const void *b)
+{
+    off_t x = ((const rb_aio_range_t *)a)->off, y = ((const rb_aio_range_t *)b)->off;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+typedef struct{
+    rb_aio_stream_t s;
+    rb_aio_range_t *ranges;
+    long count;
+} rb_aio_ranges_t;
+
+/*
+ *  Reads every merged extent through the pipeline, then slices the requested
+ *  ranges out of them in the order given.
+ */
+static VALUE
+rb_aio_ranges_run(VALUE arg)
+{
+    rb_aio_ranges_t *r = (rb_aio_ranges_t *)arg;
+    volatile VALUE scratch = rb_str_new(0, r->s.depth * (sizeof(rb_aiocb_t *) + sizeof(ssize_t)));
+    rb_aiocb_t **list = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    ssize_t *res = (ssize_t *)(list + r->s.depth);
+    rb_aiocb_t *cb;
+    rb_aio_range_t *range;
+    VALUE results;
+    ssize_t avail;
+    long i;
+    for (i=0; i < r->s.depth; i++) {
+      list[i] = GetCBStruct(RARRAY_PTR(r->s.cbs)[i]);
+      setup_aio_buffer(list[i]);
+      rb_aio_sigevent(&list[i]->cb, LIO_WAIT);
+    }
+    rb_aio_pipeline(list, r->s.depth);
+    for (i=0; i < r->s.depth; i++) {
+      if ((res[i] = rb_aio_result(list[i])) < 0){
+        rb_aio_read_error();
+        rb_sys_fail("aio_read");
+      }
+    }
+    results = rb_ary_new2(r->count);
+    for (i=0; i < r->count; i++) rb_ary_push(results, Qnil);
+    for (i=0; i < r->count; i++) {
+      range = &r->ranges[i];
+      if (range->extent < 0){
+        rb_ary_store(results, range->idx, rb_tainted_str_new2(""));
+        continue;
+      }
+      cb = list[range->extent];
+      avail = res[range->extent] - (ssize_t)(range->off - cb->cb.aio_offset);
+      if (avail < 0) avail = 0;
+      if ((size_t)avail > range->len) avail = range->len;
+      rb_ary_store(results, range->idx, rb_tainted_str_new((char *)cb->cb.aio_buf + (range->off - cb->cb.aio_offset), avail));
+    }
+    return results;
+}
+
+/*
+ *  call-seq:
+ *     AIO.read_ranges(path, [[offset, length], ...]) -> array
+ *     AIO.read_ranges(cb, [[offset, length], ...]) -> array
+ *  
+ *  Reads many ranges of a single file, by path or through an open control
+ *  block's descriptor. Adjacent and overlapping ranges are merged into larger
+ *  reads, which are submitted together, and one String is returned per requested
+ *  range, in the order given. Ranges past the end of file come back short.
+ */
+static VALUE
+rb_aio_s_read_ranges(VALUE aio, VALUE target, VALUE ranges)
+{
+    rb_aio_ranges_t r;
+    rb_aio_range_t *range;
+    rb_aiocb_t *cb;
+    volatile VALUE scratch;
+    VALUE pair, results;
+    off_t end = 0;
+    int fd;
+    long i, extents = 0;
+    Check_Type(ranges, T_ARRAY);
+    r.count = RARRAY_LEN(ranges);
+    scratch = rb_str_new(0, (r.count ? r.count : 1) * sizeof(rb_aio_range_t));
+    r.ranges = (rb_aio_range_t *)RSTRING_PTR(scratch);
+    for (i=0; i < r.count; i++) {
+      pair = RARRAY_PTR(ranges)[i];
+      Check_Type(pair, T_ARRAY);
+      if (RARRAY_LEN(pair) != 2) rb_raise(rb_eArgError, "ranges are [offset, length] pairs");
+      r.ranges[i].off = NUM2OFFT(RARRAY_PTR(pair)[0]);
+      if (r.ranges[i].off < 0 || NUM2OFFT(RARRAY_PTR(pair)[1]) < 0) rb_aio_error("Invalid file offset or length");
+      r.ranges[i].len = NUM2SIZET(RARRAY_PTR(pair)[1]);
+      r.ranges[i].idx = i;
+    }
+    qsort(r.ranges, r.count, sizeof(rb_aio_range_t), rb_aio_range_cmp);
+    for (i=0; i < r.count; i++) {
+      range = &r.ranges[i];
+      if (range->len == 0){
+        range->extent = -1;
+        continue;
+      }
+      if (extents == 0 || range->off > end) extents++;
+      range->extent = extents - 1;
+      if (range->off + (off_t)range->len > end) end = range->off + range->len;
+    }
+    if (rb_obj_is_kind_of(target, rb_cCB)){
+      r.s.io = Qnil;
+      fd = GetCBStruct(target)->cb.aio_fildes;
+      if (fd <= 0) rb_aio_error("Invalid file descriptor");
+    }else{
+      r.s.io = rb_aio_open_path(target, &fd, &r.s.size);
+    }
+    r.s.depth = extents;
+    r.s.cbs = rb_aio_control_blocks(fd, extents);
+    for (i=0; i < r.count; i++) {
+      range = &r.ranges[i];
+      if (range->extent < 0) continue;
+      cb = GetCBStruct(RARRAY_PTR(r.s.cbs)[range->extent]);
+      if (cb->cb.aio_nbytes == 0) cb->cb.aio_offset = range->off;
+      if (range->off + (off_t)range->len > cb->cb.aio_offset + (off_t)cb->cb.aio_nbytes){
+        cb->cb.aio_nbytes = range->off + range->len - cb->cb.aio_offset;
+      }
+    }
+    results = rb_ensure(rb_aio_ranges_run, (VALUE)&r, rb_aio_stream_close, (VALUE)&r.s);
+    RB_GC_GUARD(r.s.cbs);
+    RB_GC_GUARD(r.s.io);
+    RB_GC_GUARD(scratch);
+    return results;
+}
+
+/* A batch of files to open and size outside of the interpreter lock */
+typedef struct{
+    const char **paths;
+    int *fds;
+    off_t *sizes;
+    int *errs;
+    int n;
+} rb_aio_open_batch_t;
+
+static VALUE
+rb_aio_open_batch0(void *ptr)
+{
+    rb_aio_open_batch_t *b = (rb_aio_open_batch_t *)ptr;
+    struct stat stats;
+    int i;
+    for (i=0; i < b->n; i++) {
+      b->errs[i] = 0;
+      if ((b->fds[i] = open(b->paths[i], O_RDONLY | O_CLOEXEC)) < 0){
+        b->errs[i] = errno;
+      }else if (fstat(b->fds[i], &stats) != 0){
+        b->errs[i] = errno;
+        close(b->fds[i]);
+        b->fds[i] = -1;
+      }else{
+        b->sizes[i] = stats.st_size;
+      }
+    }
+    return Qnil;
+}
+
+/* AIO.read_all state : a window of read slots (or chains), idx is the path read
+   (-1 free) */
+typedef struct{
+    VALUE paths;
+    VALUE results;
+    long count;
+    long next;
+    long done;
+    int limit;
+    rb_aiocb_t *slots;
+#ifdef AIO_CHAINS
+    rb_aio_chain_t *chains;
+#endif
+    long *idx;
+} rb_aio_loader_t;
+
+/*
+ *  Opens and sizes the next files for the free slots in one GVL free batch, and
+ *  queues a read of each straight into its result String.
+ */
+static void
+rb_aio_loader_fill(rb_aio_loader_t *l)
+{
+    volatile VALUE scratch = rb_str_new(0, l->limit * (sizeof(char *) + 2 * sizeof(int) + sizeof(off_t) + sizeof(rb_aiocb_t *) + sizeof(int)));
+    rb_aio_open_batch_t b;
+    rb_aiocb_t **list;
+    int *slot, i, ops = 0, vacant = 0;
+    VALUE path, str;
+    b.sizes = (off_t *)RSTRING_PTR(scratch);
+    b.paths = (const char **)(b.sizes + l->limit);
+    list = (rb_aiocb_t **)(b.paths + l->limit);
+    b.fds = (int *)(list + l->limit);
+    b.errs = b.fds + l->limit;
+    slot = b.errs + l->limit;
+    for (i=0; i < l->limit; i++) {
+      if (l->idx[i] < 0) slot[vacant++] = i;
+    }
+    for (b.n=0; b.n < vacant && l->next + b.n < l->count; b.n++) {
+      path = RARRAY_PTR(l->paths)[l->next + b.n];
+      b.paths[b.n] = StringValueCStr(path);
+    }
+    if (b.n == 0) return;
+#ifdef RUBY19
+    rb_aio_blocking_region(rb_aio_open_batch0, &b, RUBY_UBF_IO, 0);
+#else
+    TRAP_BEG;
+    rb_aio_open_batch0(&b);
+    TRAP_END;
+#endif
+    for (i=0; i < b.n; i++) {
+      if (b.errs[i]) continue;
+      if (b.sizes[i] == 0){
+        close(b.fds[i]);
+        rb_ary_store(l->results, l->next + i, rb_tainted_str_new2(""));
+        l->done++;
+        continue;
+      }
+      l->idx[slot[i]] = l->next + i;
+      str = rb_tainted_str_new(0, b.sizes[i]);
+      rb_ary_store(l->results, l->next + i, str);
+      list[ops] = &l->slots[slot[i]];
+      list[ops]->cb.aio_fildes = b.fds[i];
+      list[ops]->cb.aio_offset = 0;
+      list[ops]->cb.aio_nbytes = b.sizes[i];
+      list[ops]->cb.aio_buf = RSTRING_PTR(str);
+      rb_aio_sigevent(&list[ops]->cb, LIO_WAIT);
+      ops++;
+    }
+    l->next += b.n;
+    if (ops > 0){
+      TRAP_BEG;
+      i = rb_aio_submit(list, ops, 1);
+      TRAP_END;
+      if (i != 0) rb_aio_listio_error();
+    }
+    for (i=0; i < b.n; i++) {
+      if (!b.errs[i]) continue;
+      errno = b.errs[i];
+      rb_sys_fail(b.paths[i]);
+    }
+}
+
+static VALUE
+rb_aio_loader_run(VALUE arg)
+{
+    rb_aio_loader_t *l = (rb_aio_loader_t *)arg;
+    volatile VALUE scratch = rb_str_new(0, l->limit * sizeof(rb_aiocb_t *));
+    rb_aiocb_t **window = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    rb_aiocb_t *cb;
+    ssize_t ret;
+    int i, inflight;
+    while (l->done < l->count) {
+      rb_aio_loader_fill(l);
+      for (i=0, inflight=0; i < l->limit; i++) {
+        if (l->idx[i] >= 0) window[inflight++] = &l->slots[i];
+      }
+      if (inflight == 0) continue;
+      rb_aio_wait(window, inflight, 1, 1);
+      for (i=0; i < l->limit; i++) {
+        cb = &l->slots[i];
+        if (l->idx[i] < 0 || rb_aio_status(cb) == EINPROGRESS) continue;
+        ret = rb_aio_result(cb);
+        close(cb->cb.aio_fildes);
+        if (ret < 0){
+          rb_aio_read_error();
+          rb_sys_fail(RSTRING_PTR(RARRAY_PTR(l->paths)[l->idx[i]]));
+        }
+        rb_str_resize(RARRAY_PTR(l->results)[l->idx[i]], ret);
+        l->idx[i] = -1;
+        l->done++;
+      }
+    }
+    return l->results;
+}
+
+static VALUE
+rb_aio_loader_close(VALUE arg)
+{
+    rb_aio_loader_t *l = (rb_aio_loader_t *)arg;
+    int i;
+    for (i=0; i < l->limit; i++) {
+      rb_aio_class_unlink(&l->slots[i]);
+      if (l->idx[i] < 0) continue;
+      control_block_quiesce(&l->slots[i]);
+      close(l->slots[i].cb.aio_fildes);
+      l->idx[i] = -1;
+    }
+    return Qnil;
+}
+
+#ifdef AIO_CHAINS
+/*
+ *  Registers the fixed file table chains open into, on first use. Kernels before
+ *  5.15 can't open into a fixed slot and hand back a plain descriptor instead,
+ *  which a trial open of / catches - it's closed through a fixed slot only once
+ *  that's known to work, older kernels would take that for descriptor 0. Returns
+ *  whether chains are supported.
+ */
+static int
+rb_aio_uring_chains(rb_aio_uring_t *ring)
+{
+    int fds[AIO_CHAIN_FILES], i;
+    rb_aiocb_t probe, *list[1];
+    struct io_uring_sqe *sqe;
+    if (ring->chains) return ring->chains > 0;
+    ring->chains = -1;
+    for (i=0; i < AIO_CHAIN_FILES; i++) fds[i] = -1;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, AIO_CHAIN_FILES) != 0) return 0;
+    list[0] = &probe;
+    pthread_mutex_lock(&ring->lock);
+    sqe = rb_aio_uring_chain_step(ring, IORING_OP_OPENAT, &probe);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)"/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    sqe->file_index = 1;
+    rb_aio_uring_flush(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+    rb_aio_wait(list, 1, 0, 0);
+    if (probe.res > 0) close(probe.res);
+    if (probe.res != 0) return 0;
+    list[0] = &probe;
+    pthread_mutex_lock(&ring->lock);
+    sqe = rb_aio_uring_chain_step(ring, IORING_OP_CLOSE, &probe);
+    sqe->file_index = 1;
+    rb_aio_uring_flush(ring, 0);
+    pthread_mutex_unlock(&ring->lock);
+    rb_aio_wait(list, 1, 0, 0);
+    if (probe.res == 0) ring->chains = 1;
+    return ring->chains > 0;
+}
+
+/*
+ *  Queues a chain for every slot with a file left to read, assigning the next
+ *  files to free slots, and submits all of them with a single enter. Chains
+ *  queued by this pass are busy 2 until accounted for. Returns how many chains
+ *  didn't fit the submission queue.
+ */
+static int
+rb_aio_chain_fill(rb_aio_loader_t *l)
+{
+    rb_aio_chain_t *c;
+    VALUE path, str;
+    off_t left;
+    int i, queued = 0, starved = 0;
+    double now = rb_aio_clock();
+    for (i=0; i < l->limit; i++) {
+      c = &l->chains[i];
+      if (l->idx[i] < 0 && l->next < l->count){
+        l->idx[i] = l->next++;
+        rb_ary_store(l->results, l->idx[i], rb_tainted_str_new(0, AIO_CHAIN_READ));
+        c->offset = 0;
+        c->size = -1;
+      }
+      if (l->idx[i] < 0 || c->busy) continue;
+      path = RARRAY_PTR(l->paths)[l->idx[i]];
+      str = RARRAY_PTR(l->results)[l->idx[i]];
+      left = RSTRING_LEN(str) - c->offset;
+      pthread_mutex_lock(&rb_aio_ring->lock);
+      if (rb_aio_uring_chain(rb_aio_ring, c, StringValueCStr(path), RSTRING_PTR(str) + c->offset, left > AIO_CHAIN_MAX ? AIO_CHAIN_MAX : left) == 0){
+        c->busy = 2;
+        c->read.op = AIO_OP_READ;
+        c->read.queued = c->read.submitted = now;
+        queued++;
+      }else{
+        starved++;
+      }
+      pthread_mutex_unlock(&rb_aio_ring->lock);
+    }
+    if (queued == 0 && starved == 0) return 0;
+    pthread_mutex_lock(&rb_aio_ring->lock);
+    rb_aio_uring_flush(rb_aio_ring, 0);
+    pthread_mutex_unlock(&rb_aio_ring->lock);
+    for (i=0; i < l->limit; i++) {
+      if (l->idx[i] < 0 || l->chains[i].busy != 2) continue;
+      l->chains[i].busy = 1;
+      rb_aio_stats_submit(&l->chains[i].read);
+    }
+    return starved;
+}
+
+/*
+ *  Picks up a completed chain : the file's done once a read came up short of the
+ *  size statx reported, or empty, otherwise the String grows to that size and the
+ *  next chain reads the rest.
+ */
+static void
+rb_aio_chain_collect(rb_aio_loader_t *l, int i)
+{
+    rb_aio_chain_t *c = &l->chains[i];
+    VALUE str = RARRAY_PTR(l->results)[l->idx[i]];
+    int err = c->open.err ? c->open.err : (c->stat.err ? c->stat.err : c->read.err);
+    c->busy = 0;
+    rb_aio_stats_complete(&c->read, c->read.err ? -1 : c->read.res, c->read.err);
+    if (err){
+      str = RARRAY_PTR(l->paths)[l->idx[i]];
+      l->idx[i] = -1;
+      errno = err;
+      rb_sys_fail(StringValueCStr(str));
+    }
+    if (c->size < 0) c->size = (off_t)c->stx.stx_size;
+    c->offset += c->read.res;
+    if (c->read.res > 0 && c->offset < c->size){
+      if (RSTRING_LEN(str) < c->size) rb_str_resize(str, c->size);
+      return;
+    }
+    rb_str_resize(str, c->offset);
+    l->idx[i] = -1;
+    l->done++;
+}
+
+static VALUE
+rb_aio_chain_run(VALUE arg)
+{
+    rb_aio_loader_t *l = (rb_aio_loader_t *)arg;
+    volatile VALUE scratch = rb_str_new(0, l->limit * sizeof(rb_aiocb_t *));
+    rb_aiocb_t **window = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    int i, inflight, starved, attempt = 0;
+    while (l->done < l->count) {
+      starved = rb_aio_chain_fill(l);
+      for (i=0, inflight=0; i < l->limit; i++) {
+        if (l->idx[i] >= 0 && l->chains[i].busy) window[inflight++] = &l->chains[i].close;
+      }
+      if (inflight == 0){
+        /* Only other threads' requests hold the submission queue */
+        if (starved) rb_aio_backoff(attempt++);
+        continue;
+      }
+      attempt = 0;
+      rb_aio_wait(window, inflight, 1, 1);
+      for (i=0; i < l->limit; i++) {
+        if (l->idx[i] < 0 || !l->chains[i].busy || rb_aio_status(&l->chains[i].close) == EINPROGRESS) continue;
+        rb_aio_chain_collect(l, i);
+      }
+    }
+    return l->results;
+}
+
+/*
+ *  Waits out chains still in flight and hands the fixed file slots back.
+ */
+static VALUE
+rb_aio_chain_close(VALUE arg)
+{
+    rb_aio_loader_t *l = (rb_aio_loader_t *)arg;
+    rb_aiocb_t *list[1];
+    int i;
+    for (i=0; i < l->limit; i++) {
+      if (l->chains[i].busy){
+        list[0] = &l->chains[i].close;
+        rb_aio_wait(list, 1, 0, 0);
+      }
+      rb_aio_ring->files[l->chains[i].file] = 0;
+    }
+    return Qnil;
+}
+
+/*
+ *  AIO.read_all through chains, with as many chains in flight as there are fixed
+ *  file slots free up to l->limit. Returns Qundef if there are none, or chains
+ *  aren't supported.
+ */
+static VALUE
+rb_aio_chain_read_all(rb_aio_loader_t *l)
+{
+    volatile VALUE scratch;
+    int file, files = 0;
+    if (!rb_aio_ring || !rb_aio_uring_chains(rb_aio_ring)) return Qundef;
+    scratch = rb_str_new(0, l->limit * (sizeof(rb_aio_chain_t) + sizeof(long)));
+    MEMZERO(RSTRING_PTR(scratch), char, RSTRING_LEN(scratch));
+    l->chains = (rb_aio_chain_t *)RSTRING_PTR(scratch);
+    l->idx = (long *)(l->chains + l->limit);
+    for (file=0; file < AIO_CHAIN_FILES && files < l->limit; file++) {
+      if (rb_aio_ring->files[file]) continue;
+      rb_aio_ring->files[file] = 1;
+      l->chains[files].file = file;
+      l->idx[files++] = -1;
+    }
+    if (files == 0) return Qundef;
+    l->limit = files;
+    rb_ensure(rb_aio_chain_run, (VALUE)l, rb_aio_chain_close, (VALUE)l);
+    RB_GC_GUARD(scratch);
+    return l->results;
+}
+#endif
+
+/*
+ *  call-seq:
+ *     AIO.read_all(paths, :concurrency => AIO.max_inflight) -> array
+ *  
+ *  Reads a list of whole files and returns their contents in the same order.
+ *  At most concurrency files are open at a time : each batch of opens and stats
+ *  runs without the GVL while earlier reads are in flight, reads go straight
+ *  into the result Strings and files are closed as their read completes. No
+ *  File or AIO::CB objects are created along the way. On io_uring (Linux 5.15+)
+ *  each file is read by a linked open / statx / read / close chain instead, the
+ *  window's chains going out with a single submission and nothing but the read
+ *  passing through Ruby.
+ */
+static VALUE
+rb_aio_s_read_all(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE paths, opts, opt;
+    volatile VALUE scratch;
+    rb_aio_loader_t l;
+    int i;
+    rb_scan_args(argc, argv, "11", &paths, &opts);
+    Check_Type(paths, T_ARRAY);
+    l.limit = rb_aio_max_inflight;
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_concurrency)))) l.limit = NUM2INT(opt);
+    }
+    if (l.limit <= 0) rb_raise(rb_eArgError, "concurrency must be positive");
+    l.paths = rb_ary_dup(paths);
+    l.count = RARRAY_LEN(l.paths);
+    l.results = rb_ary_new2(l.count);
+    l.next = l.done = 0;
+    if (l.limit > l.count) l.limit = l.count ? l.count : 1;
+#ifdef AIO_CHAINS
+    if (rb_aio_chain_read_all(&l) != Qundef){
+      RB_GC_GUARD(l.paths);
+      return l.results;
+    }
+#endif
+    scratch = rb_str_new(0, l.limit * (sizeof(rb_aiocb_t) + sizeof(long)));
+    MEMZERO(RSTRING_PTR(scratch), char, RSTRING_LEN(scratch));
+    l.slots = (rb_aiocb_t *)RSTRING_PTR(scratch);
+    l.idx = (long *)(l.slots + l.limit);
+    for (i=0; i < l.limit; i++) {
+      control_block_reset0(&l.slots[i]);
+      l.idx[i] = -1;
+    }
+    rb_ensure(rb_aio_loader_run, (VALUE)&l, rb_aio_loader_close, (VALUE)&l);
+    RB_GC_GUARD(scratch);
+    RB_GC_GUARD(l.paths);
+    return l.results;
+}
+
+/* Discard buffer AIO.prefetch :track reads land in, shared by all of them */
+static char *rb_aio_prefetch_buf = NULL;
+
+/* A batch of ranges to read ahead outside of the interpreter lock, a length
+   below 0 reaching to the end of the file */
+typedef struct{
+    rb_aio_open_batch_t open;
+    off_t *offsets;
+    off_t *lengths;
+} rb_aio_advise_t;
+
+/*
+ *  Clips a prefetch range to the file's size, false if there's nothing to read.
+ */
+static int
+rb_aio_prefetch_clip(off_t size, off_t offset, off_t *length)
+{
+    if (offset >= size) return 0;
+    if (*length < 0 || *length > size - offset) *length = size - offset;
+    return *length > 0;
+}
+
+/*
+ *  Opens every file of the batch and hands the kernel readahead advice for each
+ *  range : queued to the ring on io_uring, which also closes the file once the
+ *  advice ran, otherwise posix_fadvise, which starts the reads without waiting for
+ *  them.
+ */
+static VALUE
+rb_aio_advise0(void *ptr)
+{
+    rb_aio_advise_t *a = (rb_aio_advise_t *)ptr;
+    off_t length;
+    int i;
+    rb_aio_open_batch0(&a->open);
+    for (i=0; i < a->open.n; i++) {
+      if (a->open.errs[i]) continue;
+      length = a->lengths[i];
+      if (rb_aio_prefetch_clip(a->open.sizes[i], a->offsets[i], &length)){
+#ifdef POSIX_FADV_WILLNEED
+#ifdef HAVE_IO_URING
+        if (rb_aio_ring && rb_aio_uring_fadvise(rb_aio_ring, a->open.fds[i], a->offsets[i], length) == 0) continue;
+#endif
+        posix_fadvise(a->open.fds[i], a->offsets[i], length, POSIX_FADV_WILLNEED);
+#endif
+      }
+      close(a->open.fds[i]);
+    }
+    return Qnil;
+}
+
+/*
+ *  A prefetch target : a path, or a [path, offset, length] Array with offset and
+ *  length optional.
+ */
+static VALUE
+rb_aio_prefetch_target(VALUE target, off_t *offset, off_t *length)
+{
+    VALUE path = target;
+    *offset = 0;
+    *length = -1;
+    if (TYPE(target) == T_ARRAY){
+      if (RARRAY_LEN(target) < 1 || RARRAY_LEN(target) > 3) rb_raise(rb_eArgError, "expected [path, offset, length]");
+      path = RARRAY_PTR(target)[0];
+      if (RARRAY_LEN(target) > 1) *offset = NUM2OFFT(RARRAY_PTR(target)[1]);
+      if (RARRAY_LEN(target) > 2 && !NIL_P(RARRAY_PTR(target)[2])) *length = NUM2OFFT(RARRAY_PTR(target)[2]);
+      if (*offset < 0) rb_aio_error("Invalid file offset");
+    }
+    Check_Type(path, T_STRING);
+    return path;
+}
+
+/*
+ *  Readahead advice for a list of targets, raises for the first file that
+ *  couldn't be opened once all others were advised.
+ */
+static VALUE
+rb_aio_prefetch_advise(VALUE targets)
+{
+    long n = RARRAY_LEN(targets);
+    volatile VALUE scratch = rb_str_new(0, (n ? n : 1) * (sizeof(char *) + 2 * sizeof(int) + 3 * sizeof(off_t)));
+    volatile VALUE paths = rb_ary_new2(n);
+    rb_aio_advise_t a;
+    VALUE path;
+    int i;
+    a.open.sizes = (off_t *)RSTRING_PTR(scratch);
+    a.offsets = a.open.sizes + n;
+    a.lengths = a.offsets + n;
+    a.open.paths = (const char **)(a.lengths + n);
+    a.open.fds = (int *)(a.open.paths + n);
+    a.open.errs = a.open.fds + n;
+    a.open.n = (int)n;
+    for (i=0; i < n; i++) {
+      path = rb_aio_prefetch_target(RARRAY_PTR(targets)[i], &a.offsets[i], &a.lengths[i]);
+      rb_ary_push(paths, path);
+      a.open.paths[i] = StringValueCStr(path);
+    }
+#ifdef RUBY19
+    rb_aio_blocking_region(rb_aio_advise0, &a, RUBY_UBF_IO, 0);
+#else
+    TRAP_BEG;
+    rb_aio_advise0(&a);
+    TRAP_END;
+#endif
+    for (i=0; i < n; i++) {
+      if (!a.open.errs[i]) continue;
+      errno = a.open.errs[i];
+      rb_sys_fail(a.open.paths[i]);
+    }
+    return Qnil;
+}
+
+/* AIO.prefetch :track in progress : the Files opened so far, closed should a
+   target fail before the requests on them went out */
+typedef struct{
+    VALUE targets;
+    VALUE files;
+    VALUE cbs;
+    VALUE rcb;
+    int submitted;
+} rb_aio_prefetch_t;
+
+static void
+rb_aio_prefetch_close(VALUE file)
+{
+    if (!RTEST(rb_funcall(file, rb_intern("closed?"), 0))) rb_io_close(file);
+}
+
+static VALUE
+rb_aio_prefetch_release(VALUE state)
+{
+    int left = FIX2INT(rb_ary_entry(state, 1)) - 1;
+    rb_ary_store(state, 1, INT2FIX(left));
+    if (left == 0) rb_aio_prefetch_close(rb_ary_entry(state, 0));
+    return Qnil;
+}
+
+/*
+ *  Callback of each tracked request, state being [file, requests left, block].
+ *  Hands the bytes read to the block, and closes the file once the last request
+ *  on it retired.
+ */
+static VALUE
+rb_aio_prefetch_retire(RB_BLOCK_CALL_FUNC_ARGLIST(result, state))
+{
+    VALUE rcb = rb_ary_entry(state, 2);
+    if (NIL_P(rcb)) return rb_aio_prefetch_release(state);
+    return rb_ensure(rb_aio_callback0, rb_assoc_new(rcb, result), rb_aio_prefetch_release, state);
+}
+
+/*
+ *  Reads a list of targets into the discard buffer as AIO::NOWAIT requests, in
+ *  pieces of at most AIO_PREFETCH_CHUNK. Each range's requests share one File,
+ *  closed as the last of them retires or right away if the range is empty.
+ */
+static VALUE
+rb_aio_prefetch_track0(VALUE ptr)
+{
+    rb_aio_prefetch_t *p = (rb_aio_prefetch_t *)ptr;
+    long i, n = RARRAY_LEN(p->targets);
+    volatile VALUE scratch;
+    VALUE path, file, cb, state;
+    rb_aiocb_t **list, *cbp;
+    off_t offset, length, chunk;
+    struct stat stats;
+    int fd, op, ret, err;
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    for (i=0; i < n; i++) {
+      path = rb_aio_prefetch_target(RARRAY_PTR(p->targets)[i], &offset, &length);
+      file = rb_file_open(StringValueCStr(path), "r");
+      rb_ary_push(p->files, file);
+      GetOpenFile(file, fptr);
+#ifdef RUBY19
+      fd = fptr->fd;
+#else	
+      fd = fileno(fptr->f);
+#endif
+      if (fstat(fd, &stats) != 0) rb_sys_fail(RSTRING_PTR(path));
+      if (!rb_aio_prefetch_clip(stats.st_size, offset, &length)){
+        rb_aio_prefetch_close(file);
+        continue;
+      }
+      state = rb_ary_new3(3, file, INT2FIX(0), p->rcb);
+      for (; length > 0; offset += chunk, length -= chunk) {
+        chunk = length < AIO_PREFETCH_CHUNK ? length : AIO_PREFETCH_CHUNK;
+        cb = control_block_alloc(rb_cCB);
+        cbp = GetCBStruct(cb);
+        cbp->io = file;
+        cbp->rcb = rb_proc_new(rb_aio_prefetch_retire, state);
+        cbp->cb.aio_fildes = fd;
+        cbp->cb.aio_offset = offset;
+        cbp->cb.aio_nbytes = chunk;
+        cbp->cb.aio_buf = rb_aio_prefetch_buf;
+        rb_aio_sigevent(&cbp->cb, LIO_NOWAIT);
+        rb_ary_push(p->cbs, cb);
+        rb_ary_store(state, 1, INT2FIX(FIX2INT(rb_ary_entry(state, 1)) + 1));
+      }
+    }
+    scratch = rb_str_new(0, (RARRAY_LEN(p->cbs) ? RARRAY_LEN(p->cbs) : 1) * sizeof(rb_aiocb_t *));
+    list = (rb_aiocb_t **)RSTRING_PTR(scratch);
+    for (op=0; op < RARRAY_LEN(p->cbs); op++) {
+      list[op] = GetCBStruct(RARRAY_PTR(p->cbs)[op]);
+    }
+    if (RARRAY_LEN(p->cbs) > 0){
+      TRAP_BEG;
+      ret = rb_aio_submit(list, (int)RARRAY_LEN(p->cbs), 0);
+      TRAP_END;
+      if (ret != 0){
+        /* Some may have gone out before the rest were refused */
+        err = errno;
+        for (op=0; op < RARRAY_LEN(p->cbs); op++) {
+          if (rb_aio_status(list[op]) == EINPROGRESS) control_block_quiesce(list[op]);
+        }
+        errno = err;
+        rb_aio_listio_error();
+      }
+    }
+    p->submitted = 1;
+    for (op=0; op < RARRAY_LEN(p->cbs); op++) {
+      rb_aio_dispatch(RARRAY_PTR(p->cbs)[op]);
+    }
+    return rb_aio_batch_new(p->cbs);
+}
+
+static VALUE
+rb_aio_prefetch_track_close(VALUE ptr)
+{
+    rb_aio_prefetch_t *p = (rb_aio_prefetch_t *)ptr;
+    long i;
+    if (p->submitted) return Qnil;
+    for (i=0; i < RARRAY_LEN(p->files); i++) {
+      rb_aio_prefetch_close(RARRAY_PTR(p->files)[i]);
+    }
+    return Qnil;
+}
+
+static VALUE
+rb_aio_prefetch_track(VALUE targets)
+{
+    rb_aio_prefetch_t p;
+    if (!rb_aio_prefetch_buf){
+      if ((rb_aio_prefetch_buf = mmap(NULL, AIO_PREFETCH_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+        rb_aio_prefetch_buf = NULL;
+        rb_aio_error("Not able to allocate the prefetch buffer");
+      }
+    }
+    p.targets = targets;
+    p.files = rb_ary_new();
+    p.cbs = rb_ary_new();
+    p.rcb = rb_block_given_p() ? rb_block_proc() : Qnil;
+    p.submitted = 0;
+    return rb_ensure(rb_aio_prefetch_track0, (VALUE)&p, rb_aio_prefetch_track_close, (VALUE)&p);
+}
+
+/*
+ *  call-seq:
+ *     AIO.prefetch(targets) -> nil
+ *     AIO.prefetch(targets, :track => true) -> batch
+ *     AIO.prefetch(targets){|bytes| ... } -> batch
+ *  
+ *  Warms the page cache ahead of reads without reading anything into Ruby. Each
+ *  target is a path or a [path, offset, length] range. Returns at once : by
+ *  default the kernel's given readahead advice (posix_fadvise(WILLNEED), queued
+ *  to the ring on io_uring) and nothing reports back. With :track or a block the
+ *  ranges are read as AIO::NOWAIT requests into a discard buffer instead, and an
+ *  AIO::Batch returned. Its requests' values, and the block's argument, are the
+ *  bytes read.
+ */
+static VALUE
+rb_aio_s_prefetch(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE targets, opts;
+    int track = rb_block_given_p();
+    rb_scan_args(argc, argv, "11", &targets, &opts);
+    if (TYPE(targets) == T_STRING) targets = rb_ary_new3(1, targets);
+    Check_Type(targets, T_ARRAY);
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      if (RTEST(rb_hash_aref(opts, ID2SYM(s_track)))) track = 1;
+    }
+    return track ? rb_aio_prefetch_track(targets) : rb_aio_prefetch_advise(targets);
+}
+
+/*
+ *  call-seq:
+ *     AIO.lio_listio(cb1, cb2, ...) -> array
+ *  
+ *  Schedules a batch of read requests for execution by the kernel in order
+ *  to reduce system calls.Blocks until all the requests complete and returns
+ *  an array equal in length to the given files, with the read buffers as string
+ *  elements.Batches of any size are accepted : at most AIO.max_inflight requests
+ *  are in flight at any time and the window is refilled as requests complete.
+ *  Requests that failed get an AIO::Error in their slot instead of a result.
+ *  AIO::NOWAIT batches are submitted as a whole. 
+ *  
+ *  open_nocancel("first.txt\0", 0x0, 0x1B6)	 = 3 0
+ *  fstat(0x3, 0xBFFFEE04, 0x1B6)	 = 0 0
+ *  open_nocancel("second.txt\0", 0x0, 0x1B6)	 = 4 0
+ *  fstat(0x4, 0xBFFFEE04, 0x1B6)	 = 0 0
+ *  open_nocancel("third.txt\0", 0x0, 0x1B6)	 = 5 0
+ *  fstat(0x5, 0xBFFFEE04, 0x1B6)	 = 0 0
+ *  fstat64(0x1, 0xBFFFE234, 0x1B6)	 = 0 0
+ *  ioctl(0x1, 0x4004667A, 0xBFFFE29C)	 = 0 0
+ *  lio_listio(0x2, 0xBFFFEE64, 0x3)	 = 0 0
+ *  close_nocancel(0x4)	 = 0 0
+ *  close_nocancel(0x3)	 = 0 0
+ */
+static VALUE 
+rb_aio_s_lio_listio(VALUE aio, VALUE cbs)
+{
+    VALUE mode_arg, mode;
+    mode_arg = RARRAY_PTR(cbs)[0];
+    mode = (mode_arg == c_aio_wait || mode_arg == c_aio_nowait || mode_arg == c_aio_nop) ? rb_ary_shift(cbs) : c_aio_wait;
+    switch(NUM2INT(mode)){
+        case LIO_WAIT:
+             return rb_ensure(rb_aio_lio_listio_blocking, cbs, rb_io_closes, cbs);   
+        case LIO_NOWAIT:
+             return rb_aio_lio_listio_non_blocking(cbs);
+        case LIO_NOP:
+             return rb_ensure(rb_aio_lio_listio_noop, cbs, rb_io_closes, cbs);
+    }
+    rb_aio_error("Only modes AIO::WAIT, AIO::NOWAIT and AIO::NOP supported");
+}
+
+/*
+ *  Error handling for aio_cancel
+ */
+static void 
+rb_aio_cancel_error()
+{
+    switch(errno){
+       case EBADF: 
+            rb_aio_error("[EBADF] Invalid file descriptor.");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] aio_cancel is not supported by this implementation.");
+    }
+}
+
+static VALUE 
+rb_aio_cancel(int fd, rb_aiocb_t *cb)
+{   
+    int ret;
+    TRAP_BEG;
+    ret = rb_aio_cancel0( fd, cb );
+    TRAP_END;
+    if (ret != 0) rb_aio_cancel_error();
+    switch(ret){
+       case AIO_CANCELED: 
+            return c_aio_canceled;
+       case AIO_NOTCANCELED: 
+            return c_aio_notcanceled;
+       case AIO_ALLDONE: 
+            return c_aio_alldone;
+   }
+   return Qnil;
+}
+
+static VALUE 
+rb_aio_s_cancel(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE fd, cb;
+    rb_scan_args(argc, argv, "02", &fd, &cb);
+    if (NIL_P(fd) || !FIXNUM_P(fd)) rb_aio_error("No file descriptor given");
+    if (NIL_P(cb)) return rb_aio_cancel( NUM2INT(fd), NULL );
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (rb_block_given_p()){
+      cbs->rcb = rb_block_proc();
+    }	
+    return rb_aio_cancel( NUM2INT(fd), cbs );	
+}
+
+/*
+ *  Error handling for aio_return
+ */
+static void 
+rb_aio_return_error()
+{
+    switch(errno){
+       case ENOMEM: 
+            rb_aio_error("[ENOMEM] There were no Kernel control blocks available to service this request.");
+       case EINVAL: 
+            rb_aio_error("[EINVAL] The control block does not refer to an asynchronous operation whose return status has not yet been retrieved.");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] aio_return not supported by this implementation.");
+    }
+}
+
+static VALUE 
+rb_aio_return(rb_aiocb_t *cb)
+{ 
+    ssize_t ret;
+    TRAP_BEG;
+    ret = rb_aio_result( cb );
+    TRAP_END;
+    if (ret != 0) rb_aio_return_error();
+    return SSIZET2NUM(ret);
+}
+
+static VALUE 
+rb_aio_s_return(VALUE aio, VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    if (rb_block_given_p()){
+      cbs->rcb = rb_block_proc();
+    }
+    return rb_aio_return( cbs );	
+}
+
+/*
+ *  Error handling for aio_error
+ */
+static void 
+rb_aio_err_error()
+{
+    switch(errno){
+       case EINVAL: 
+            rb_aio_error("[EINVAL] The control block does not refer to an asynchronous operation whose return status has not yet been retrieved.");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] aio_error not supported by this implementation.");
+    }
+}
+
+static VALUE 
+rb_aio_err(rb_aiocb_t *cb)
+{ 
+    int ret;
+    TRAP_BEG;
+    ret = rb_aio_status(cb);
+    TRAP_END;
+    if (ret != 0) rb_aio_err_error();
+    return INT2FIX(ret);
+}
+
+static VALUE 
+rb_aio_s_error(VALUE aio, VALUE cb)
+{
     rb_aiocb_t *cbs = GetCBStruct(cb);
-    return cbs->cb.aio_buf == NULL ? rb_tainted_str_new2("") : rb_tainted_str_new((char *)cbs->cb.aio_buf, cbs->cb.aio_nbytes);
+    if (rb_block_given_p()){
+      cbs->rcb = rb_block_proc();
+    }
+    return rb_aio_err( cbs );
+}
+
+/*
+ *  Error handling for aio_error
+ */
+static void 
+rb_aio_sync_error()
+{
+    switch(errno){
+       case EINVAL: 
+            rb_aio_error("[EINVAL] A value of op other than AIO::DSYNC or AIO::SYNC was specified.");
+       case EAGAIN: 
+            rb_aio_error("[EAGAIN] The requested asynchronous operation was not queued due to temporary resource limitations.");
+       case ENOSYS: 
+            rb_aio_error("[ENOSYS] aio_error not supported by this implementation.");
+       case EBADF: 
+            rb_aio_error("[EBADF] Invalid file descriptor.");
+    }
+}
+
+static VALUE 
+rb_aio_sync(int op, rb_aiocb_t *cb)
+{ 
+    int ret;
+    if (cb->req){
+      cb->req->collected = 0;
+      cb->req->value = Qnil;
+    }
+    if (!NIL_P(cb->rcb)){
+      cb->fsync = 1;
+      rb_aio_sigevent(&cb->cb, LIO_NOWAIT);
+    }
+    TRAP_BEG;
+    ret = rb_aio_fsync0( op, cb );
+    TRAP_END;
+    if (ret != 0) rb_aio_sync_error();
+    return INT2FIX(ret);
+}
+
+static VALUE 
+rb_aio_s_sync(VALUE aio, VALUE op, VALUE cb)
+{
+    rb_aiocb_t *cbs = GetCBStruct(cb);
+    VALUE ret;
+    if (rb_block_given_p()){
+      cbs->rcb = rb_block_proc();
+    }
+    Check_Type( op, T_FIXNUM );
+#ifdef O_DSYNC
+    if (op != c_aio_sync && op != c_aio_dsync) rb_aio_error("Operation AIO::SYNC or AIO::DSYNC expected");
+#else
+    if (op != c_aio_sync) rb_aio_error("Operation AIO::SYNC expected");
+#endif
+    ret = rb_aio_sync( NUM2INT(op), cbs );
+    if (!NIL_P(cbs->rcb)) rb_aio_dispatch(cb);
+    return ret;
+}
+
+/*
+ *  Group commit : writers append to the filling batch and the first of them to
+ *  find no flush in progress leads it - one vectored write of the whole batch
+ *  followed by one fdatasync - while everyone else sleeps until woken at the end
+ *  of a flush.
+ */
+typedef struct{
+    VALUE io;
+    VALUE wcb;
+    VALUE scb;
+    VALUE batch;
+    VALUE waiters;
+    off_t tail;
+    off_t base;
+    long seq;
+    long durable;
+    long failed;
+    int flushing;
+    int op;
+    long commits;
+    long flushes;
+} rb_aio_journal_t;
+
+#define GetJournalStruct(obj)	(Check_Type(obj, T_DATA), (rb_aio_journal_t*)DATA_PTR(obj))
+
+static void 
+mark_journal(rb_aio_journal_t *j)
+{
+    rb_gc_mark(j->io);
+    rb_gc_mark(j->wcb);
+    rb_gc_mark(j->scb);
+    rb_gc_mark(j->batch);
+    rb_gc_mark(j->waiters);
+}
+
+static void 
+free_journal(rb_aio_journal_t *j)
+{
+    xfree(j);
+}
+
+static VALUE
+journal_alloc(VALUE klass)
+{
+    VALUE obj;
+    rb_aio_journal_t *j;
+    obj = Data_Make_Struct(klass, rb_aio_journal_t, mark_journal, free_journal, j);
+    j->io = j->wcb = j->scb = j->batch = j->waiters = Qnil;
+    j->seq = 1;
+    j->failed = -1;
+#ifdef O_DSYNC
+    j->op = O_DSYNC;
+#else
+    j->op = O_SYNC;
+#endif
+    return obj;
+}
+
+/*
+ *  call-seq:
+ *     AIO::Journal.new(path) -> journal
+ *  
+ *  Opens path for appending, creating it if need be.
+ */
+static VALUE
+journal_initialize(VALUE obj, VALUE path)
+{
+    rb_aio_journal_t *j = GetJournalStruct(obj);
+    rb_aiocb_t *cb;
+    struct stat stats;
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    int fd;
+    Check_Type(path, T_STRING);
+    j->io = rb_file_open(RSTRING_PTR(path), "a");
+    GetOpenFile(j->io, fptr);
+#ifdef RUBY19
+    fd = fptr->fd;
+#else	
+    fd = fileno(fptr->f);
+#endif
+    if (fstat(fd, &stats) != 0) rb_sys_fail(RSTRING_PTR(path));
+    j->tail = j->base = stats.st_size;
+    j->wcb = control_block_alloc(rb_cCB);
+    cb = GetCBStruct(j->wcb);
+    cb->cb.aio_fildes = fd;
+    cb->cb.aio_lio_opcode = LIO_WRITE;
+    j->scb = control_block_alloc(rb_cCB);
+    GetCBStruct(j->scb)->cb.aio_fildes = fd;
+    j->batch = rb_ary_new();
+    j->waiters = rb_ary_new();
+    return obj;
+}
+
+typedef struct{
+    rb_aio_journal_t *j;
+    VALUE batch;
+    long seq;
+    off_t base;
+} rb_aio_flush_t;
+
+/*
+ *  Writes a batch at base, IOV_MAX records per request, then syncs it.
+ */
+static VALUE
+rb_aio_journal_flush0(VALUE arg)
+{
+    rb_aio_flush_t *f = (rb_aio_flush_t *)arg;
+    rb_aio_journal_t *j = f->j;
+    rb_aiocb_t *cb = GetCBStruct(j->wcb);
+    off_t off = f->base;
+    long i, n;
+    ssize_t ret;
+    for (i=0; i < RARRAY_LEN(f->batch); i += n) {
+      n = RARRAY_LEN(f->batch) - i;
+      if (n > IOV_MAX) n = IOV_MAX;
+      control_block_bufs_set(j->wcb, rb_ary_new4(n, RARRAY_PTR(f->batch) + i));
+      cb->cb.aio_offset = off;
+      setup_aio_target(cb);
+      rb_aio_sigevent(&cb->cb, LIO_WAIT);
+      TRAP_BEG;
+      ret = rb_aio_submit(&cb, 1, 1);
+      TRAP_END;
+      if (ret != 0){
+        rb_aio_write_error();
+        rb_sys_fail("journal write");
+      }
+      rb_aio_suspend(&cb, 1, 0);
+      if ((ret = rb_aio_result(cb)) < 0) rb_sys_fail("journal write");
+      if ((size_t)ret != cb->cb.aio_nbytes) rb_aio_error("Short journal write");
+      off += ret;
+    }
+    control_block_bufs_set(j->wcb, Qnil);
+    cb = GetCBStruct(j->scb);
+    rb_aio_sigevent(&cb->cb, LIO_WAIT);
+    TRAP_BEG;
+    ret = rb_aio_fsync0(j->op, cb);
+    TRAP_END;
+    if (ret != 0){
+      rb_aio_sync_error();
+      rb_sys_fail("journal sync");
+    }
+    rb_aio_suspend(&cb, 1, 0);
+    if (rb_aio_result(cb) < 0) rb_sys_fail("journal sync");
+    j->durable = f->seq;
+    j->flushes++;
+    return Qnil;
+}
+
+static VALUE
+rb_aio_journal_flushed(VALUE arg)
+{
+    rb_aio_flush_t *f = (rb_aio_flush_t *)arg;
+    rb_aio_journal_t *j = f->j;
+    VALUE th;
+    long i;
+    j->flushing = 0;
+    if (j->durable < f->seq) j->failed = f->seq;
+    for (i=0; i < RARRAY_LEN(j->waiters); i++) {
+      th = RARRAY_PTR(j->waiters)[i];
+      if (RTEST(rb_funcall(th, s_alive_p, 0))) rb_thread_wakeup(th);
+    }
+    rb_ary_clear(j->waiters);
+    return Qnil;
+}
+
+static void
+rb_aio_journal_flush(rb_aio_journal_t *j)
+{
+    rb_aio_flush_t f;
+    f.j = j;
+    f.batch = j->batch;
+    f.seq = j->seq++;
+    f.base = j->base;
+    j->batch = rb_ary_new();
+    j->base = j->tail;
+    j->flushing = 1;
+    rb_ensure(rb_aio_journal_flush0, (VALUE)&f, rb_aio_journal_flushed, (VALUE)&f);
+    RB_GC_GUARD(f.batch);
+}
+
+static VALUE
+rb_aio_journal_sleep(VALUE arg)
+{
+    return rb_thread_stop();
+}
+
+static VALUE
+rb_aio_journal_unwait(VALUE waiters)
+{
+    return rb_ary_delete(waiters, rb_thread_current());
+}
+
+/*
+ *  Blocks until the batch seq is durable, leading its flush if no other is in
+ *  progress.
+ */
+static void
+rb_aio_journal_commit(rb_aio_journal_t *j, long seq)
+{
+    while (j->durable < seq) {
+      if (j->failed >= seq) rb_aio_error("Journal flush failed");
+      if (!j->flushing){
+        rb_aio_journal_flush(j);
+      }else{
+        rb_ary_push(j->waiters, rb_thread_current());
+        rb_ensure(rb_aio_journal_sleep, Qnil, rb_aio_journal_unwait, j->waiters);
+      }
+    }
+}
+
+/*
+ *  call-seq:
+ *     journal.write(str) -> offset
+ *  
+ *  Appends str and returns once it's durable, with the offset it was written at.
+ *  Writes from other threads arriving during a flush are committed together by
+ *  the next one.
+ */
+static VALUE
+journal_write(VALUE obj, VALUE str)
+{
+    rb_aio_journal_t *j = GetJournalStruct(obj);
+    off_t off;
+    StringValue(str);
+    if (NIL_P(j->io)) rb_aio_error("Journal closed");
+    off = j->tail;
+    j->tail += RSTRING_LEN(str);
+    rb_ary_push(j->batch, rb_str_new_frozen(str));
+    j->commits++;
+    rb_aio_journal_commit(j, j->seq);
+    return OFFT2NUM(off);
+}
+
+/*
+ *  call-seq:
+ *     journal.close -> nil
+ *  
+ *  Waits for pending commits and closes the file.
+ */
+static VALUE
+journal_close(VALUE obj)
+{
+    rb_aio_journal_t *j = GetJournalStruct(obj);
+    if (NIL_P(j->io)) return Qnil;
+    rb_aio_journal_commit(j, RARRAY_LEN(j->batch) ? j->seq : j->seq - 1);
+    rb_io_close(j->io);
+    j->io = Qnil;
+    return Qnil;
+}
+
+static VALUE
+journal_tail(VALUE obj)
+{
+    return OFFT2NUM(GetJournalStruct(obj)->tail);
+}
+
+static VALUE
+journal_commits(VALUE obj)
+{
+    return LONG2NUM(GetJournalStruct(obj)->commits);
+}
+
+static VALUE
+journal_flushes(VALUE obj)
+{
+    return LONG2NUM(GetJournalStruct(obj)->flushes);
+}
+
+/*
+ *  Append only log : records are copied into the filling slot's leased buffer
+ *  and each full buffer goes out as one write, with up to depth of them in
+ *  flight. Slots form a ring, head being the oldest in flight, and written
+ *  advances in ring order as they complete.
+ */
+typedef struct{
+    VALUE io;
+    VALUE slots;
+    VALUE callbacks;
+    off_t tail;
+    off_t written;
+    off_t base;
+    off_t prealloc;
+    off_t chunk;
+    size_t bufsize;
+    size_t used;
+    long depth;
+    long head;
+    long inflight;
+} rb_aio_log_t;
+
+#define GetLogStruct(obj)	(Check_Type(obj, T_DATA), (rb_aio_log_t*)DATA_PTR(obj))
+#define AIO_LOG_SLOT(l, i)	GetCBStruct(RARRAY_PTR((l)->slots)[(i) % (l)->depth])
+
+/* AIO::AppendLog defaults */
+#define AIO_LOG_BUFFER (1024 * 1024)
+#define AIO_LOG_DEPTH 4
+#define AIO_LOG_PREALLOCATE (64 * 1024 * 1024)
+
+static void 
+mark_log(rb_aio_log_t *l)
+{
+    rb_gc_mark(l->io);
+    rb_gc_mark(l->slots);
+    rb_gc_mark(l->callbacks);
+}
+
+static void 
+free_log(rb_aio_log_t *l)
+{
+    xfree(l);
+}
+
+static VALUE
+log_alloc(VALUE klass)
+{
+    VALUE obj;
+    rb_aio_log_t *l;
+    obj = Data_Make_Struct(klass, rb_aio_log_t, mark_log, free_log, l);
+    l->io = l->slots = l->callbacks = Qnil;
+    return obj;
+}
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+typedef struct{
+    int fd;
+    off_t offset;
+    off_t len;
+    int ret;
+} rb_aio_fallocate_t;
+
+static VALUE
+rb_aio_fallocate0(void *ptr)
+{
+    rb_aio_fallocate_t *a = (rb_aio_fallocate_t *)ptr;
+    a->ret = fallocate(a->fd, FALLOC_FL_KEEP_SIZE, a->offset, a->len);
+    return Qnil;
+}
+#endif
+
+/*
+ *  Reserves disk space ahead of the tail without changing the file size, so
+ *  appends don't allocate extents on the hot path. On io_uring the request is
+ *  queued to the ring, otherwise fallocate runs without the GVL.
+ */
+static void
+rb_aio_log_preallocate(rb_aio_log_t *l, off_t upto)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    rb_aio_fallocate_t a;
+    if (l->chunk <= 0 || upto <= l->prealloc) return;
+    upto = ((upto + l->chunk - 1) / l->chunk) * l->chunk;
+    a.fd = AIO_LOG_SLOT(l, 0)->cb.aio_fildes;
+    a.offset = l->prealloc;
+    a.len = upto - l->prealloc;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring && rb_aio_uring_fallocate(rb_aio_ring, a.fd, FALLOC_FL_KEEP_SIZE, a.offset, a.len) == 0){
+      l->prealloc = upto;
+      return;
+    }
+#endif
+#ifdef RUBY19
+    rb_aio_blocking_region(rb_aio_fallocate0, &a, RUBY_UBF_IO, 0);
+#else
+    TRAP_BEG;
+    rb_aio_fallocate0(&a);
+    TRAP_END;
+#endif
+    /* Best effort : filesystems without support just allocate on write */
+    if (a.ret == 0) l->prealloc = upto;
+    else l->chunk = 0;
+#endif
+}
+
+/*
+ *  Runs the callbacks of appends ending at or before upto, passing err as well
+ *  when set. Returns how many ran.
+ */
+static long
+rb_aio_log_callbacks(rb_aio_log_t *l, off_t upto, VALUE err)
+{
+    VALUE pair;
+    long ran = 0;
+    while (RARRAY_LEN(l->callbacks) > 0) {
+      pair = RARRAY_PTR(l->callbacks)[0];
+      if (NUM2OFFT(RARRAY_PTR(pair)[0]) > upto) break;
+      rb_ary_shift(l->callbacks);
+      if (NIL_P(err)){
+        rb_funcall(RARRAY_PTR(pair)[2], rb_intern("call"), 1, RARRAY_PTR(pair)[1]);
+      }else{
+        rb_funcall(RARRAY_PTR(pair)[2], rb_intern("call"), 2, RARRAY_PTR(pair)[1], err);
+      }
+      ran++;
+    }
+    return ran;
+}
+
+/*
+ *  Retires completed writes from the head of the ring, blocking on the head if
+ *  block is set, and runs the callbacks of appends now written. A failed write
+ *  is retired like any other and its error handed to the blocks of the appends
+ *  it carried, or raised if none of them gave one.
+ */
+static void
+rb_aio_log_reap(rb_aio_log_t *l, int block)
+{
+    rb_aiocb_t *cb;
+    ssize_t ret;
+    off_t end;
+    VALUE err;
+    while (l->inflight > 0) {
+      cb = AIO_LOG_SLOT(l, l->head);
+      if (rb_aio_status(cb) == EINPROGRESS){
+        if (!block) break;
+        rb_aio_suspend(&cb, 1, 0);
+        /* Another thread may have retired it meanwhile */
+        continue;
+      }
+      ret = rb_aio_result(cb);
+      end = cb->cb.aio_offset + cb->cb.aio_nbytes;
+      if (ret < 0){
+        err = rb_funcall(rb_eSystemCallError, rb_intern("new"), 2, rb_str_new2("append"), INT2NUM(errno));
+      }else if ((size_t)ret != cb->cb.aio_nbytes){
+        err = rb_exc_new2(eAio, "Short append write");
+      }else{
+        err = Qnil;
+        l->written = end;
+      }
+      l->head = (l->head + 1) % l->depth;
+      l->inflight--;
+      block = 0;
+      if (!NIL_P(err)){
+        rb_aio_log_callbacks(l, l->written, Qnil);
+        if (rb_aio_log_callbacks(l, end, err) == 0) rb_exc_raise(err);
+      }
+    }
+    rb_aio_log_callbacks(l, l->written, Qnil);
+}
+
+/*
+ *  Submits the filling buffer, if it holds anything, at base.
+ */
+static void
+rb_aio_log_flush(rb_aio_log_t *l)
+{
+    rb_aiocb_t *cb;
+    int ret;
+    if (l->used == 0) return;
+    cb = AIO_LOG_SLOT(l, l->head + l->inflight);
+    cb->cb.aio_offset = l->base;
+    cb->cb.aio_nbytes = l->used;
+    rb_aio_sigevent(&cb->cb, LIO_WAIT);
+    rb_aio_log_preallocate(l, l->base + l->used);
+    TRAP_BEG;
+    ret = rb_aio_submit(&cb, 1, 0);
+    TRAP_END;
+    if (ret != 0){
+      rb_aio_write_error();
+      rb_sys_fail("append");
+    }
+    l->inflight++;
+    l->base += l->used;
+    l->used = 0;
+}
+
+/*
+ *  call-seq:
+ *     AIO::AppendLog.new(path, :buffer_size => 1048576, :depth => 4, :preallocate => 67108864) -> log
+ *  
+ *  Opens path for appending, creating it if need be. Appends are coalesced into
+ *  buffer_size writes that end on buffer_size boundaries, with up to depth of them
+ *  in flight. preallocate bytes at a time are reserved ahead of the tail where
+ *  the platform supports it, 0 disables.
+ */
+static VALUE
+log_initialize(int argc, VALUE *argv, VALUE obj)
+{
+    rb_aio_log_t *l = GetLogStruct(obj);
+    VALUE path, opts, opt;
+    struct stat stats;
+#ifdef RUBY19
+    rb_io_t *fptr;
+#else	
+    OpenFile *fptr;
+#endif
+    int fd;
+    long i;
+    rb_scan_args(argc, argv, "11", &path, &opts);
+    Check_Type(path, T_STRING);
+    l->bufsize = AIO_LOG_BUFFER;
+    l->depth = AIO_LOG_DEPTH;
+    l->chunk = AIO_LOG_PREALLOCATE;
+    if (!NIL_P(opts)){
+      Check_Type(opts, T_HASH);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_buffer_size)))) l->bufsize = NUM2LONG(opt);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_depth)))) l->depth = NUM2LONG(opt);
+      if (!NIL_P(opt = rb_hash_aref(opts, ID2SYM(s_preallocate)))) l->chunk = NUM2OFFT(opt);
+    }
+    if ((long)l->bufsize <= 0 || l->depth <= 0) rb_raise(rb_eArgError, "buffer_size and depth must be positive");
+    /* Not O_APPEND : that has the kernel ignore the slots' offsets and append in
+       whatever order the writes run, which with depth in flight needn't be the
+       order they were handed out */
+    l->io = rb_funcall(rb_cFile, rb_intern("open"), 3, path, INT2FIX(O_WRONLY | O_CREAT), INT2FIX(0666));
+    GetOpenFile(l->io, fptr);
+#ifdef RUBY19
+    fd = fptr->fd;
+#else	
+    fd = fileno(fptr->f);
+#endif
+    if (fstat(fd, &stats) != 0) rb_sys_fail(RSTRING_PTR(path));
+    l->tail = l->written = l->base = l->prealloc = stats.st_size;
+    l->slots = rb_aio_control_blocks(fd, l->depth);
+    for (i=0; i < l->depth; i++) {
+      AIO_LOG_SLOT(l, i)->cb.aio_lio_opcode = LIO_WRITE;
+    }
+    l->callbacks = rb_ary_new();
+    return obj;
 }
 
+/*
+ *  call-seq:
+ *     log.append(str) -> offset
+ *     log.append(str){|offset| ... } -> offset
+ *  
+ *  Appends str and returns the offset it will be written at, usually without a
+ *  system call. The block runs once the record has been written (see #written),
+ *  from within a later append, #flush or #wait.
+ *  If the write carrying the record fails, the block is passed the error as
+ *  well and it isn't raised.
+ */
 static VALUE
-control_block_buf_set(VALUE cb, VALUE buf)
+log_append(VALUE obj, VALUE str)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    Check_Type(buf, T_STRING);
-    cbs->cb.aio_nbytes = RSTRING_LEN(buf);
-    setup_aio_buffer(cbs);
-    cbs->cb.aio_buf = RSTRING_PTR(buf);
-    return buf;
+    rb_aio_log_t *l = GetLogStruct(obj);
+    rb_aiocb_t *cb;
+    off_t off;
+    size_t len, room;
+    StringValue(str);
+    if (NIL_P(l->io)) rb_aio_error("Log closed");
+    len = RSTRING_LEN(str);
+    /* Buffers end on bufsize boundaries, the first one may be short */
+    room = l->bufsize - (size_t)(l->base % l->bufsize);
+    if (l->used > 0 && l->used + len > room) rb_aio_log_flush(l);
+    rb_aio_log_reap(l, l->inflight == l->depth);
+    cb = AIO_LOG_SLOT(l, l->head + l->inflight);
+    room = l->bufsize - (size_t)(l->base % l->bufsize);
+    cb->cb.aio_nbytes = len > room ? len : room;
+    setup_aio_buffer(cb);
+    memcpy((char *)cb->cb.aio_buf + l->used, RSTRING_PTR(str), len);
+    off = l->tail;
+    l->tail += len;
+    l->used += len;
+    if (rb_block_given_p()) rb_ary_push(l->callbacks, rb_ary_new3(3, OFFT2NUM(l->tail), OFFT2NUM(off), rb_block_proc()));
+    if (l->used >= room) rb_aio_log_flush(l);
+    return OFFT2NUM(off);
 }
 
+/*
+ *  call-seq:
+ *     log.flush -> log
+ *  
+ *  Starts writing buffered appends without waiting for them.
+ */
 static VALUE
-control_block_nbytes_get(VALUE cb)
+log_flush(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return INT2FIX(cbs->cb.aio_nbytes);
+    rb_aio_log_t *l = GetLogStruct(obj);
+    if (NIL_P(l->io)) rb_aio_error("Log closed");
+    if (l->inflight == l->depth) rb_aio_log_reap(l, 1);
+    rb_aio_log_flush(l);
+    rb_aio_log_reap(l, 0);
+    return obj;
 }
 
+/*
+ *  call-seq:
+ *     log.wait -> offset
+ *  
+ *  Flushes and blocks until every append so far is written, returning #written.
+ */
 static VALUE
-control_block_offset_get(VALUE cb)
+log_wait(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return INT2FIX(cbs->cb.aio_offset);
+    rb_aio_log_t *l = GetLogStruct(obj);
+    if (NIL_P(l->io)) return OFFT2NUM(l->written);
+    log_flush(obj);
+    while (l->inflight > 0) rb_aio_log_reap(l, 1);
+    return OFFT2NUM(l->written);
 }
 
 static VALUE
-control_block_offset_set(VALUE cb, VALUE offset)
+log_close(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    Check_Type(offset, T_FIXNUM);
-    cbs->cb.aio_offset = FIX2INT(offset);
-    return offset;
+    rb_aio_log_t *l = GetLogStruct(obj);
+    long i;
+    if (NIL_P(l->io)) return Qnil;
+    log_wait(obj);
+    for (i=0; i < l->depth; i++) {
+      release_aio_buffer(AIO_LOG_SLOT(l, i));
+    }
+    rb_io_close(l->io);
+    l->io = Qnil;
+    return Qnil;
 }
 
 static VALUE
-control_block_reqprio_get(VALUE cb)
+log_tail(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return INT2FIX(cbs->cb.aio_reqprio);
+    return OFFT2NUM(GetLogStruct(obj)->tail);
 }
 
+/*
+ *  call-seq:
+ *     log.written -> offset
+ *  
+ *  Every append below this offset has been written.
+ */
 static VALUE
-control_block_reqprio_set(VALUE cb, VALUE reqprio)
+log_written(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    Check_Type(reqprio, T_FIXNUM);
-    cbs->cb.aio_reqprio = FIX2INT(reqprio);
-    return reqprio;
+    rb_aio_log_t *l = GetLogStruct(obj);
+    if (!NIL_P(l->io)) rb_aio_log_reap(l, 0);
+    return OFFT2NUM(l->written);
+}
+
+/*
+ *  AIO::Map : a read only, shared mapping of a file. Strings handed out are frozen
+ *  and point into the mapping where the Ruby version can wrap external memory
+ *  (rb_str_new_static), holding on to the map through a hidden reference. It's
+ *  unmapped once neither the map nor any of its Strings are reachable. Mapped
+ *  pages are the file's page cache, shared with every process mapping or reading
+ *  the same file.
+ */
+typedef struct{
+    char *addr;
+    size_t size;
+} rb_aio_map_t;
+
+typedef struct{
+    void *addr;
+    size_t len;
+} rb_aio_madvise_t;
+
+#define GetMapStruct(obj)	(Check_Type(obj, T_DATA), (rb_aio_map_t*)DATA_PTR(obj))
+
+static void 
+free_map(rb_aio_map_t *m)
+{
+    if (m->addr) munmap(m->addr, m->size);
+    xfree(m);
 }
 
 static VALUE
-control_block_lio_opcode_get(VALUE cb)
+map_alloc(VALUE klass)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return INT2FIX(cbs->cb.aio_lio_opcode);
+    rb_aio_map_t *m;
+    return Data_Make_Struct(klass, rb_aio_map_t, 0, free_map, m);
 }
 
+/*
+ *  call-seq:
+ *     AIO::Map.new('dictionary.bin') -> map
+ *  
+ *  Maps path read only. Later changes to the file's size aren't picked up.
+ */
 static VALUE
-control_block_lio_opcode_set(VALUE cb, VALUE opcode)
+map_initialize(VALUE obj, VALUE path)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    Check_Type(opcode, T_FIXNUM);
-    if (opcode != c_aio_read && opcode != c_aio_write) rb_aio_error("Only AIO::READ and AIO::WRITE modes supported");
-    cbs->cb.aio_lio_opcode = NUM2INT(opcode);
-    return opcode;
+    rb_aio_map_t *m = GetMapStruct(obj);
+    struct stat stats;
+    int fd, err;
+    Check_Type(path, T_STRING);
+    if (m->addr) rb_aio_error("Already mapped");
+    if ((fd = open(StringValueCStr(path), O_RDONLY | O_CLOEXEC)) == -1) rb_sys_fail(RSTRING_PTR(path));
+    if (fstat(fd, &stats) != 0) goto failed;
+    if (stats.st_size > 0){
+      m->addr = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (m->addr == MAP_FAILED){
+        m->addr = NULL;
+        goto failed;
+      }
+    }
+    m->size = stats.st_size;
+    close(fd);
+    return obj;
+failed:
+    err = errno;
+    close(fd);
+    errno = err;
+    rb_sys_fail(RSTRING_PTR(path));
+    return Qnil;
 }
 
+/*
+ *  A frozen String over length bytes of the mapping from offset.
+ */
 static VALUE
-control_block_validate(VALUE cb)
+rb_aio_map_str(VALUE obj, rb_aio_map_t *m, size_t offset, size_t length)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (cbs->cb.aio_fildes <= 0) rb_aio_error("Invalid file descriptor");    
-    if (cbs->cb.aio_nbytes <= 0) rb_aio_error("Invalid buffer length");    
-    if (cbs->cb.aio_offset < 0) rb_aio_error("Invalid file offset");    
-    if (cbs->cb.aio_reqprio < 0) rb_aio_error("Invalid request priority");
-    if (cbs->cb.aio_lio_opcode != LIO_READ && cbs->cb.aio_lio_opcode != LIO_WRITE) rb_aio_error("Only AIO::READ and AIO::WRITE modes supported");
-    if (!cbs->cb.aio_buf) rb_aio_error("No AIO buffer allocated");	
-    return cb;    
+    VALUE str;
+#ifdef HAVE_RB_STR_NEW_STATIC
+    if (length == 0) return rb_obj_freeze(rb_str_new(0, 0));
+    str = rb_str_new_static(m->addr + offset, length);
+    rb_ivar_set(str, s_map, obj);
+#else
+    str = rb_tainted_str_new(m->addr + offset, length);
+#endif
+    return rb_obj_freeze(str);
+}
+
+/*
+ *  Clips offset / length to the mapping, false if offset lies beyond its end.
+ */
+static int
+rb_aio_map_range(rb_aio_map_t *m, VALUE offset, VALUE length, size_t *off, size_t *len)
+{
+    off_t o = NIL_P(offset) ? 0 : NUM2OFFT(offset);
+    off_t l = NIL_P(length) ? (off_t)m->size : NUM2OFFT(length);
+    if (o < 0 || l < 0 || (size_t)o > m->size) return 0;
+    *off = o;
+    *len = (size_t)l > m->size - *off ? m->size - *off : (size_t)l;
+    return 1;
 }
 
 static VALUE
-control_block_open_p(VALUE cb)
+map_size(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return NIL_P(cbs->io) ? Qfalse : Qtrue;
+    return SIZET2NUM(GetMapStruct(obj)->size);
 }
 
+/*
+ *  call-seq:
+ *     map.slice(offset, length) -> string or nil
+ *     map[offset, length] -> string or nil
+ *  
+ *  A frozen String over length bytes from offset, without copying them. Clipped
+ *  to the end of the mapping, nil if offset is beyond it.
+ */
 static VALUE
-control_block_closed_p(VALUE cb)
+map_slice(VALUE obj, VALUE offset, VALUE length)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    return NIL_P(cbs->io) ? Qtrue : Qfalse;
+    rb_aio_map_t *m = GetMapStruct(obj);
+    size_t off, len;
+    if (!rb_aio_map_range(m, offset, length, &off, &len)) return Qnil;
+    return rb_aio_map_str(obj, m, off, len);
 }
 
+/*
+ *  call-seq:
+ *     map.to_s -> string
+ *  
+ *  The whole mapping as a frozen String.
+ */
 static VALUE
-control_block_close(VALUE cb)
+map_to_s(VALUE obj)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if NIL_P(cbs->io) return Qfalse;
-    aio_return(&cbs->cb);
-    rb_io_close(cbs->io);
-    cbs->io = Qnil; 
-    cbs->rcb = Qnil;
-    return Qtrue;
+    rb_aio_map_t *m = GetMapStruct(obj);
+    return rb_aio_map_str(obj, m, 0, m->size);
+}
+
+static VALUE
+rb_aio_madvise0(void *ptr)
+{
+    rb_aio_madvise_t *a = (rb_aio_madvise_t *)ptr;
+    madvise(a->addr, a->len, MADV_WILLNEED);
+    return Qnil;
 }
 
 /*
- *  Error handling for aio_write
+ *  call-seq:
+ *     map.prefetch(offset = 0, length = map.size) -> map
+ *  
+ *  Asks the kernel to read a range of the mapping in ahead of use
+ *  (madvise(MADV_WILLNEED)), so page faults on it later are served from memory.
+ *  Returns straight away : on io_uring the advice is queued to the ring, otherwise
+ *  it's given without the GVL.
  */
-static void 
-rb_aio_write_error()
+static VALUE
+map_prefetch(int argc, VALUE *argv, VALUE obj)
 {
-    switch(errno){
-       case EAGAIN: 
-            rb_aio_error("[EAGAIN] The request cannot be queued due to exceeding resource (queue) limitations.");
-       case EBADF: 
-            rb_aio_error("[EBADF] File descriptor is not valid for writing.");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] aio_read not supported by this implementation.");
-       case EINVAL: 
-            rb_aio_error("[EINVAL] Read offset is invalid");
-       case EOVERFLOW: 
-            rb_aio_error("[EOVERFLOW] Control block offset exceeded.");
-       case ECANCELED:
-            rb_aio_error("[ECANCELED] The requested I/O was canceled by an explicit aio_cancel() request.");
-       case EFBIG:
-            rb_aio_error("[EFBIG] Wrong offset.");
-    }
+    rb_aio_map_t *m = GetMapStruct(obj);
+    rb_aio_madvise_t a;
+    VALUE offset, length;
+    size_t off, len, page = getpagesize();
+    rb_scan_args(argc, argv, "02", &offset, &length);
+    if (!rb_aio_map_range(m, offset, length, &off, &len)) rb_raise(rb_eArgError, "offset beyond the end of the mapping");
+    if (len == 0) return obj;
+    a.addr = m->addr + off / page * page;
+    a.len = len + off % page;
+#ifdef HAVE_IO_URING
+    if (rb_aio_ring && rb_aio_uring_madvise(rb_aio_ring, a.addr, a.len, MADV_WILLNEED) == 0) return obj;
+#endif
+#ifdef RUBY19
+    rb_aio_blocking_region(rb_aio_madvise0, &a, RUBY_UBF_IO, 0);
+#else
+    TRAP_BEG;
+    rb_aio_madvise0(&a);
+    TRAP_END;
+#endif
+    return obj;
 }
 
 /*
- *  Error handling for aio_read
+ *  call-seq:
+ *     AIO.map('dictionary.bin') -> map
+ *  
+ *  Maps a file read only, see AIO::Map.
  */
-static void 
-rb_aio_read_error()
+static VALUE
+rb_aio_s_map(VALUE aio, VALUE path)
 {
-    switch(errno){
-       case EAGAIN: 
-            rb_aio_error("[EAGAIN] The request cannot be queued due to exceeding resource (queue) limitations.");
-       case EBADF: 
-            rb_aio_error("[EBADF] File descriptor is not valid for reading.");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] aio_read not supported by this implementation.");
-       case EINVAL: 
-            rb_aio_error("[EINVAL] Read offset is invalid");
-       case EOVERFLOW: 
-            rb_aio_error("[EOVERFLOW] Control block offset exceeded.");
-    }
+    return rb_class_new_instance(1, &path, rb_cMap);
 }
 
 /*
- *  Initiates a *blocking* write
+ *  call-seq:
+ *     AIO.completion_io -> io
+ *  
+ *  An IO that turns readable as AIO::NOWAIT requests complete, for use with
+ *  IO.select or an event loop alongside sockets. Pair with AIO.ack_completions
+ *  and check individual control blocks with AIO.error. Must not be closed.
  */
 static VALUE 
-rb_aio_write(aiocb_t *cb)
+rb_aio_s_completion_io(VALUE aio)
 {
-    int ret;
-    
-    TRAP_BEG;
-    ret = aio_write(cb);
-    TRAP_END;
-    if (ret != 0) rb_aio_write_error();
-    while ( aio_error(cb) == EINPROGRESS );
-    if ((ret = aio_return(cb)) > 0) {
-     return INT2NUM(cb->aio_nbytes);
-    }else{
-      return INT2NUM(errno);
+    VALUE fd;
+    if (NIL_P(rb_aio_completion_io)){
+      fd = INT2FIX(rb_aio_notify_rd);
+      rb_aio_completion_io = rb_class_new_instance(1, &fd, rb_cIO);
     }
+    return rb_aio_completion_io;
 }
 
 /*
- *  Initiates a *blocking* read
+ *  call-seq:
+ *     AIO.ack_completions -> fixnum
+ *  
+ *  Resets AIO.completion_io and returns the number of completions flagged since
+ *  the last call.
  */
 static VALUE 
-rb_aio_read(aiocb_t *cb)
+rb_aio_s_ack_completions(VALUE aio)
 {
-    int ret;    
-    TRAP_BEG;
-    ret = aio_read(cb);
-    TRAP_END;
-    if (ret != 0) rb_aio_read_error();
-    while ( aio_error(cb) == EINPROGRESS );
-    if ((ret = aio_return(cb)) > 0) {
-      return rb_tainted_str_new( (char *)cb->aio_buf, cb->aio_nbytes );
-    }else{
-      return INT2NUM(errno);
-    }
+#ifdef HAVE_SYS_EVENTFD_H
+    eventfd_t count = 0;
+    if (eventfd_read(rb_aio_notify_rd, &count) == -1 && errno != EAGAIN) rb_sys_fail("eventfd_read");
+    return ULONG2NUM((unsigned long)count);
+#else
+    char buf[512];
+    ssize_t n;
+    unsigned long count = 0;
+    while ((n = read(rb_aio_notify_rd, buf, sizeof(buf))) > 0) count += n;
+    if (n == -1 && errno != EAGAIN) rb_sys_fail("read");
+    return ULONG2NUM(count);
+#endif
 }
 
 /*
- *  Error handling for lio_listio
+ *  call-seq:
+ *     AIO.max_inflight -> fixnum
+ *  
+ *  Upper bound of requests AIO.lio_listio keeps in flight. Tuned from completion
+ *  latency while AIO.adaptive is set.
  */
-static void 
-rb_aio_listio_error()
+static VALUE 
+rb_aio_s_max_inflight(VALUE aio)
 {
-    switch(errno){
-       case EAGAIN: 
-            rb_aio_error("[EAGAIN] Resources necessary to queue all the requests are not available at the moment.");
-       case EIO: 
-            rb_aio_error("[EIO] One or more requests failed");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] lio_listio not supported by this implementation.");
-       case EINVAL: 
-            rb_aio_error("[EINVAL] Maximum number of allowed simultaneous requests exceeded.");
-       case EINTR: 
-            rb_aio_error("[EINTR] A signal was delivered while waiting for all I/O requests to complete during a LIO_WAIT operation.");
-    }
+    return INT2FIX(rb_aio_max_inflight);
 }
 
-static void
-rb_aio_lio_listio0(int mode, VALUE *cbs, aiocb_t **list, int ops)
+/*
+ *  call-seq:
+ *     AIO.max_inflight = 256 -> fixnum
+ *  
+ *  Pins the in flight limit, turning AIO.adaptive off.
+ */
+static VALUE 
+rb_aio_s_max_inflight_set(VALUE aio, VALUE limit)
 {
-    int op;
-    bzero((char *)list, sizeof(list));
-    for (op=0; op < ops; op++) {
-        rb_aiocb_t *cb = GetCBStruct(RARRAY_PTR(cbs)[op]);
-        setup_aio_buffer(cb);
-        if (rb_block_given_p()){
-          cb->rcb = rb_block_proc();
-        } 
-      list[op] = &cb->cb;
-    }
+    Check_Type(limit, T_FIXNUM);
+    if (FIX2INT(limit) <= 0) rb_aio_error("In flight limit must be positive");
+    rb_aio_max_inflight = FIX2INT(limit);
+    rb_aio_tuner.adaptive = 0;
+    return limit;
 }
 
 /*
- *  Initiates lio_listio
+ *  call-seq:
+ *     AIO.adaptive = true -> boolean
+ *  
+ *  Tunes AIO.max_inflight from observed completion latency : growing it while
+ *  latency stays flat and backing off when latency climbs or the kernel queue is
+ *  full. On by default.
  */
-static int 
-rb_aio_lio_listio(int mode, VALUE *cbs, aiocb_t **list)
+static VALUE 
+rb_aio_s_adaptive_set(VALUE aio, VALUE adaptive)
 {
-    int ret;
-    int ops = RARRAY_LEN(cbs);
-    rb_aio_lio_listio0(mode, cbs, list, ops);
+    rb_aio_tuner.adaptive = RTEST(adaptive);
+    rb_aio_tuner.latency = 0;
+    rb_aio_tuner.baseline = 0;
+    rb_aio_tuner.samples = 0;
+    if (rb_aio_tuner.adaptive && rb_aio_max_inflight > AIO_MAX_INFLIGHT_CEILING) rb_aio_max_inflight = AIO_MAX_INFLIGHT_CEILING;
+    return adaptive;
+}
 
-    TRAP_BEG;
-    /* &rb_aio_sig_event */
-    ret = lio_listio(mode, list, ops, NULL);
-    TRAP_END;
-    /* Darwin triggers an error to clean it's work q */
-    if (ret != 0 && mode != LIO_NOP) rb_aio_listio_error();
-    return ops; 
+static VALUE 
+rb_aio_s_adaptive_p(VALUE aio)
+{
+    return rb_aio_tuner.adaptive ? Qtrue : Qfalse;
 }
 
 /*
- *  Blocking lio_listio
+ *  call-seq:
+ *     AIO.tuner -> hash
+ *  
+ *  In flight limit tuning state : the current limit, completion latency EWMA and
+ *  baseline in seconds and how often submission backed off on EAGAIN.
  */
-static VALUE
-rb_aio_lio_listio_blocking(VALUE *cbs)
+static VALUE 
+rb_aio_s_tuner(VALUE aio)
 {
-    aiocb_t *list[AIO_MAX_LIST];
-    int op;
-    int ops = rb_aio_lio_listio( LIO_WAIT, cbs, list );
-    VALUE results = rb_ary_new2( ops );
-    for (op=0; op < ops; op++) {
-      if (list[op]->aio_lio_opcode == LIO_READ){ 
-         rb_ary_push( results, rb_tainted_str_new( (char *)list[op]->aio_buf, list[op]->aio_nbytes ) );
-      }else{
-         rb_ary_push( results, INT2FIX(list[op]->aio_nbytes) );
-      }
-    } 
-    return results;
+    VALUE tuner = rb_hash_new();
+    rb_hash_aset(tuner, ID2SYM(rb_intern("adaptive")), rb_aio_s_adaptive_p(aio));
+    rb_hash_aset(tuner, ID2SYM(rb_intern("max_inflight")), INT2FIX(rb_aio_max_inflight));
+    rb_hash_aset(tuner, ID2SYM(rb_intern("latency")), rb_float_new(rb_aio_tuner.latency));
+    rb_hash_aset(tuner, ID2SYM(rb_intern("baseline")), rb_float_new(rb_aio_tuner.baseline));
+    rb_hash_aset(tuner, ID2SYM(rb_intern("backoffs")), ULONG2NUM(rb_aio_tuner.backoffs));
+    rb_hash_aset(tuner, ID2SYM(rb_intern("background_share")), rb_float_new(rb_aio_classes.background_share));
+    rb_hash_aset(tuner, ID2SYM(rb_intern("throttled")), ULONG2NUM(rb_aio_classes.throttled));
+    return tuner;
+}
+
+#define AIO_NS2NUM(ns) rb_float_new((double)(ns) / 1e9)
+
+static VALUE
+rb_aio_histogram_hash(rb_aio_histogram_t *h)
+{
+    VALUE hist = rb_hash_new();
+    VALUE buckets = rb_ary_new();
+    int b;
+    rb_hash_aset(hist, ID2SYM(rb_intern("count")), ULL2NUM(h->count));
+    rb_hash_aset(hist, ID2SYM(rb_intern("min")), AIO_NS2NUM(h->min));
+    rb_hash_aset(hist, ID2SYM(rb_intern("max")), AIO_NS2NUM(h->max));
+    rb_hash_aset(hist, ID2SYM(rb_intern("mean")), AIO_NS2NUM(h->count ? h->sum / h->count : 0));
+    rb_hash_aset(hist, ID2SYM(rb_intern("p50")), AIO_NS2NUM(rb_aio_histogram_percentile(h, 0.5)));
+    rb_hash_aset(hist, ID2SYM(rb_intern("p90")), AIO_NS2NUM(rb_aio_histogram_percentile(h, 0.9)));
+    rb_hash_aset(hist, ID2SYM(rb_intern("p99")), AIO_NS2NUM(rb_aio_histogram_percentile(h, 0.99)));
+    rb_hash_aset(hist, ID2SYM(rb_intern("p999")), AIO_NS2NUM(rb_aio_histogram_percentile(h, 0.999)));
+    for (b=0; b < AIO_HISTOGRAM_BUCKETS; b++) {
+      if (h->buckets[b]) rb_ary_push(buckets, rb_assoc_new(AIO_NS2NUM(rb_aio_histogram_value(b)), ULL2NUM(h->buckets[b])));
+    }
+    rb_hash_aset(hist, ID2SYM(rb_intern("buckets")), buckets);
+    return hist;
 }
 
-/*
- *  No-op lio_listio
- */
 static VALUE
-rb_aio_lio_listio_noop(VALUE *cbs)
+rb_aio_op_stats_hash(rb_aio_op_stats_t *s)
 {
-    aiocb_t *list[AIO_MAX_LIST];
-    rb_aio_lio_listio(LIO_NOP, cbs, list);
-    return Qnil;
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("submitted")), ULL2NUM(s->submitted));
+    rb_hash_aset(stats, ID2SYM(rb_intern("completed")), ULL2NUM(s->completed));
+    rb_hash_aset(stats, ID2SYM(rb_intern("errors")), ULL2NUM(s->errors));
+    rb_hash_aset(stats, ID2SYM(rb_intern("cancelled")), ULL2NUM(s->cancelled));
+    rb_hash_aset(stats, ID2SYM(rb_intern("retries")), ULL2NUM(s->retries));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), ULL2NUM(s->bytes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("latency")), rb_aio_histogram_hash(&s->latency));
+    rb_hash_aset(stats, ID2SYM(rb_intern("queued")), rb_aio_histogram_hash(&s->queued));
+    return stats;
 }
 
 /*
- *  Non-blocking lio_listio
+ *  call-seq:
+ *     AIO.reset_stats -> nil
+ *  
+ *  Zeroes the counters and histograms AIO.stats reports.
  */
-static VALUE
-rb_aio_lio_listio_non_blocking(VALUE *cbs)
+static VALUE 
+rb_aio_s_reset_stats(VALUE aio)
 {
-    aiocb_t *list[AIO_MAX_LIST];
-    rb_aio_lio_listio(LIO_NOWAIT, cbs, list);
+    memset(&rb_aio_stats, 0, sizeof(rb_aio_stats));
+    rb_aio_stats.inflight_max = rb_aio_inflight();
+    rb_aio_stats.since = rb_aio_clock();
     return Qnil;
 }
 
 /*
- *  Helper to ensure files opened via AIO.lio_listio is closed.
+ *  call-seq:
+ *     AIO.stats(reset = false) -> hash
+ *  
+ *  Counters since load or the last reset, per operation (:read, :write, :fsync and
+ *  :cancel) : requests submitted, completed, failed and cancelled, resubmissions
+ *  after EAGAIN and bytes moved. :latency is the time from submission to
+ *  completion, :queued how long requests were held back before the kernel or
+ *  library queue took them. Histograms report count, min, max, mean and
+ *  percentiles in seconds, with the non empty buckets as [upper bound, count]
+ *  pairs. For :cancel, cancelled counts AIO::CANCELED outcomes and latency how
+ *  long cancelling took. :fastpath counts blocking reads served from the page
+ *  cache (hits), in part (partial) or not at all (misses) by the fast path, see
+ *  AIO.fastpath=. :inflight is the number of requests submitted and not yet
+ *  collected, :depth their mean as each request was submitted. Resets the
+ *  counters afterwards if reset is true.
  */
-static void 
-rb_io_closes(VALUE cbs){
-    int io;
-    for (io=0; io < RARRAY_LEN(cbs); io++) {
-      control_block_close(RARRAY_PTR(cbs)[io]);
-    }  
+static VALUE 
+rb_aio_s_stats(int argc, VALUE *argv, VALUE aio)
+{
+    VALUE reset, fastpath, stats = rb_hash_new();
+    unsigned long long submitted = 0;
+    int op;
+    rb_scan_args(argc, argv, "01", &reset);
+    for (op=0; op < AIO_OP_CANCEL; op++) {
+      submitted += rb_aio_stats.ops[op].submitted;
+    }
+    rb_hash_aset(stats, ID2SYM(rb_intern("read")), rb_aio_op_stats_hash(&rb_aio_stats.ops[AIO_OP_READ]));
+    rb_hash_aset(stats, ID2SYM(rb_intern("write")), rb_aio_op_stats_hash(&rb_aio_stats.ops[AIO_OP_WRITE]));
+    rb_hash_aset(stats, ID2SYM(rb_intern("fsync")), rb_aio_op_stats_hash(&rb_aio_stats.ops[AIO_OP_FSYNC]));
+    rb_hash_aset(stats, ID2SYM(rb_intern("cancel")), rb_aio_op_stats_hash(&rb_aio_stats.ops[AIO_OP_CANCEL]));
+    fastpath = rb_hash_new();
+    rb_hash_aset(fastpath, ID2SYM(rb_intern("hits")), ULL2NUM(rb_aio_stats.fastpath.hits));
+    rb_hash_aset(fastpath, ID2SYM(rb_intern("partial")), ULL2NUM(rb_aio_stats.fastpath.partial));
+    rb_hash_aset(fastpath, ID2SYM(rb_intern("misses")), ULL2NUM(rb_aio_stats.fastpath.misses));
+    rb_hash_aset(fastpath, ID2SYM(rb_intern("bytes")), ULL2NUM(rb_aio_stats.fastpath.bytes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("fastpath")), fastpath);
+    rb_hash_aset(stats, ID2SYM(rb_intern("inflight")), INT2FIX(rb_aio_inflight()));
+    rb_hash_aset(stats, ID2SYM(rb_intern("inflight_max")), INT2FIX(rb_aio_stats.inflight_max));
+    rb_hash_aset(stats, ID2SYM(rb_intern("depth")), rb_float_new(submitted ? (double)rb_aio_stats.depth / submitted : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("elapsed")), rb_float_new(rb_aio_clock() - rb_aio_stats.since));
+    if (RTEST(reset)) rb_aio_s_reset_stats(aio);
+    return stats;
 }
 
 /*
  *  call-seq:
- *     AIO.write(cb) -> fixnum
+ *     AIO.fastpath = false -> boolean
  *  
- *  Asynchronously writes to a file.This is an initial *blocking* implementation until
- *  cross platform notification is supported.
+ *  Blocking reads of up to 256KB first try to copy straight out of the page cache
+ *  with a non-blocking preadv2, and only go asynchronous for what isn't cached.
+ *  On by default where preadv2 with RWF_NOWAIT is available.
  */
 static VALUE 
-rb_aio_s_write(VALUE aio, VALUE cb)
+rb_aio_s_fastpath_set(VALUE aio, VALUE fastpath)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-#ifdef RUBY19
-    rb_io_t *fptr;
-#else	
-    OpenFile *fptr;
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+    rb_aio_fastpath_enabled = RTEST(fastpath);
+#else
+    if (RTEST(fastpath)) rb_aio_error("preadv2 with RWF_NOWAIT not supported on this platform");
 #endif
-    GetOpenFile(cbs->io, fptr);
-    rb_io_check_writable(fptr);    
-    if (rb_block_given_p()){
-      cbs->rcb = rb_block_proc();
-    }
-    
-    return rb_ensure(rb_aio_write, (VALUE)&cbs->cb, control_block_close, cb);
+    return fastpath;
+}
+
+static VALUE 
+rb_aio_s_fastpath_p(VALUE aio)
+{
+    return rb_aio_fastpath_enabled ? Qtrue : Qfalse;
 }
 
 /*
  *  call-seq:
- *     AIO.read(cb) -> string
+ *     AIO.background_share = 0.25 -> float
  *  
- *  Asynchronously reads a file.This is an initial *blocking* implementation until
- *  cross platform notification is supported.
+ *  Share of AIO.max_inflight AIO::BACKGROUND requests may take while interactive
+ *  or normal requests are in flight.
  */
 static VALUE 
-rb_aio_s_read(VALUE aio, VALUE cb)
+rb_aio_s_background_share_set(VALUE aio, VALUE share)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (rb_block_given_p()){
-      cbs->rcb = rb_block_proc();
-    }
-    return rb_ensure(rb_aio_read, (VALUE)&cbs->cb, control_block_close, cb);
+    double d = NUM2DBL(share);
+    if (d <= 0 || d > 1) rb_aio_error("Background share must be within (0, 1]");
+    rb_aio_classes.background_share = d;
+    return share;
+}
+
+static VALUE 
+rb_aio_s_background_share(VALUE aio)
+{
+    return rb_float_new(rb_aio_classes.background_share);
 }
 
 /*
  *  call-seq:
- *     AIO.lio_listio(cb1, cb2, ...) -> array
- *  
- *  Schedules a batch of read requests for execution by the kernel in order
- *  to reduce system calls.Blocks until all the requests complete and returns
- *  an array equal in length to the given files, with the read buffers as string
- *  elements.The number of operations is currently limited to 16 due to cross 
- *  platform limitations. 
+ *     AIO.arena -> hash
  *  
- *  open_nocancel("first.txt\0", 0x0, 0x1B6)	 = 3 0
- *  fstat(0x3, 0xBFFFEE04, 0x1B6)	 = 0 0
- *  open_nocancel("second.txt\0", 0x0, 0x1B6)	 = 4 0
- *  fstat(0x4, 0xBFFFEE04, 0x1B6)	 = 0 0
- *  open_nocancel("third.txt\0", 0x0, 0x1B6)	 = 5 0
- *  fstat(0x5, 0xBFFFEE04, 0x1B6)	 = 0 0
- *  fstat64(0x1, 0xBFFFE234, 0x1B6)	 = 0 0
- *  ioctl(0x1, 0x4004667A, 0xBFFFE29C)	 = 0 0
- *  lio_listio(0x2, 0xBFFFEE64, 0x3)	 = 0 0
- *  close_nocancel(0x4)	 = 0 0
- *  close_nocancel(0x3)	 = 0 0
+ *  Buffer arena statistics : bytes allocated from the system, leased to control
+ *  blocks and held idle, as well as free list hits and misses.
  */
 static VALUE 
-rb_aio_s_lio_listio(VALUE aio, VALUE cbs)
+rb_aio_s_arena(VALUE aio)
 {
-    VALUE mode_arg, mode;
-    int ops;
-    ops = RARRAY_LEN(cbs);
-    mode_arg = RARRAY_PTR(cbs)[0];
-    mode = (mode_arg == c_aio_wait || mode_arg == c_aio_nowait || mode_arg == c_aio_nop) ? rb_ary_shift(cbs) : c_aio_wait;
-    if (ops > AIO_MAX_LIST) return c_aio_queue;
-    switch(NUM2INT(mode)){
-        case LIO_WAIT:
-             return rb_ensure(rb_aio_lio_listio_blocking, (VALUE)cbs, rb_io_closes, (VALUE)cbs);   
-        case LIO_NOWAIT:
-             return rb_aio_lio_listio_non_blocking((VALUE)cbs);
-        case LIO_NOP:
-             return rb_ensure(rb_aio_lio_listio_noop, (VALUE)cbs, rb_io_closes, (VALUE)cbs);
-    }
-    rb_aio_error("Only modes AIO::WAIT, AIO::NOWAIT and AIO::NOP supported");
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("allocated")), ULONG2NUM(rb_aio_arena.allocated));
+    rb_hash_aset(stats, ID2SYM(rb_intern("leased")), ULONG2NUM(rb_aio_arena.leased));
+    rb_hash_aset(stats, ID2SYM(rb_intern("idle")), ULONG2NUM(rb_aio_arena.idle));
+    rb_hash_aset(stats, ID2SYM(rb_intern("max_idle")), ULONG2NUM(rb_aio_arena.max_idle));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(rb_aio_arena.hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(rb_aio_arena.misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hugepages")), rb_aio_arena.hugepages ? Qtrue : Qfalse);
+    return stats;
 }
 
 /*
- *  Error handling for aio_cancel
+ *  call-seq:
+ *     AIO.arena_max_idle = 16 * 1024 * 1024 -> integer
+ *  
+ *  Upper bound of idle buffer bytes the arena holds on to. Lowering it frees
+ *  idle buffers beyond the new limit.
  */
-static void 
-rb_aio_cancel_error()
-{
-    switch(errno){
-       case EBADF: 
-            rb_aio_error("[EBADF] Invalid file descriptor.");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] aio_cancel is not supported by this implementation.");
-    }
-}
-
 static VALUE 
-rb_aio_cancel(int fd, void *cb)
-{   
-    int ret;
-    TRAP_BEG;
-    ret = aio_cancel( fd, cb );
-    TRAP_END;
-    if (ret != 0) rb_aio_cancel_error();
-    switch(ret){
-       case AIO_CANCELED: 
-            return c_aio_canceled;
-       case AIO_NOTCANCELED: 
-            return c_aio_notcanceled;
-       case AIO_ALLDONE: 
-            return c_aio_alldone;
-   }
-   return Qnil;
+rb_aio_s_arena_max_idle_set(VALUE aio, VALUE max)
+{
+    rb_aio_arena.max_idle = NUM2ULONG(max);
+    rb_aio_arena_trim(rb_aio_arena.max_idle);
+    return max;
 }
 
+/*
+ *  call-seq:
+ *     AIO.arena_hugepages = true -> boolean
+ *  
+ *  Backs buffers of 2MB and up with hugepages, if the system has any reserved.
+ */
 static VALUE 
-rb_aio_s_cancel(int argc, VALUE *argv, VALUE aio)
+rb_aio_s_arena_hugepages_set(VALUE aio, VALUE huge)
 {
-    VALUE fd, cb;
-    rb_scan_args(argc, argv, "02", &fd, &cb);
-    if (NIL_P(fd) || !FIXNUM_P(fd)) rb_aio_error("No file descriptor given");
-    if (NIL_P(cb)) return rb_aio_cancel( NUM2INT(fd), NULL );
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (rb_block_given_p()){
-      cbs->rcb = rb_block_proc();
-    }	
-    return rb_aio_cancel( NUM2INT(fd), &cbs->cb );	
+    rb_aio_arena.hugepages = RTEST(huge);
+    return huge;
 }
 
+#ifdef AIO_FIBER_SCHEDULER
 /*
- *  Error handling for aio_return
+ *  AIO::Scheduler : Fiber::Scheduler hooks moving disk reads and writes of
+ *  non-blocking fibers onto the AIO engine. A request is submitted with
+ *  AIO::NOWAIT straight into the IO::Buffer's memory and the fiber blocked until
+ *  the dispatcher thread collects it and unblocks the fiber through the scheduler.
+ *  Anything that isn't a regular file (pipes, sockets, ttys) is read or written
+ *  directly, waiting for readiness with the scheduler's io_wait on EAGAIN, as Ruby
+ *  does without an io_read / io_write hook.
  */
-static void 
-rb_aio_return_error()
+typedef struct{
+    VALUE scheduler;
+    VALUE io;
+    VALUE cb;
+    VALUE waiter;
+    int fd;
+    int opcode;
+    char *base;
+    size_t size;
+    size_t length;
+    off_t from;
+    size_t done;
+    int err;
+} rb_aio_fiber_io_t;
+
+/*
+ *  Callback of a fiber's request, runs on the dispatcher thread. waiter is
+ *  [scheduler, fiber, blocked], the fiber is only unblocked if it's blocked on the
+ *  request - it may find the request collected before getting that far.
+ */
+static VALUE
+rb_aio_fiber_wakeup(RB_BLOCK_CALL_FUNC_ARGLIST(result, waiter))
 {
-    switch(errno){
-       case ENOMEM: 
-            rb_aio_error("[ENOMEM] There were no Kernel control blocks available to service this request.");
-       case EINVAL: 
-            rb_aio_error("[EINVAL] The control block does not refer to an asynchronous operation whose return status has not yet been retrieved.");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] aio_return not supported by this implementation.");
+    if (RTEST(rb_ary_entry(waiter, 2))){
+      rb_ary_store(waiter, 2, Qfalse);
+      rb_fiber_scheduler_unblock(rb_ary_entry(waiter, 0), Qnil, rb_ary_entry(waiter, 1));
     }
+    return Qnil;
 }
 
-static VALUE 
-rb_aio_return(aiocb_t *cb)
-{ 
-    int ret;
-    TRAP_BEG;
-    ret = aio_return( cb );
-    TRAP_END;
-    if (ret != 0) rb_aio_return_error();
-    return INT2FIX(ret);
+static VALUE
+rb_aio_fiber_io_run(VALUE arg)
+{
+    rb_aio_fiber_io_t *f = (rb_aio_fiber_io_t *)arg;
+    rb_aiocb_t *cbs = GetCBStruct(f->cb);
+    ssize_t ret;
+    for (;;) {
+      control_block_reset0(cbs);
+      cbs->cb.aio_fildes = f->fd;
+      cbs->cb.aio_lio_opcode = f->opcode;
+      cbs->cb.aio_buf = f->base + f->done;
+      cbs->cb.aio_nbytes = f->size - f->done;
+      cbs->cb.aio_offset = f->from + f->done;
+      cbs->rcb = rb_proc_new(rb_aio_fiber_wakeup, f->waiter);
+      rb_aio_sigevent(&cbs->cb, LIO_NOWAIT);
+      TRAP_BEG;
+      ret = rb_aio_submit(&cbs, 1, 0);
+      TRAP_END;
+      if (ret != 0){
+        f->err = errno;
+        return Qnil;
+      }
+      rb_aio_dispatch(f->cb);
+      while (!rb_aio_collected(cbs)) {
+        rb_ary_store(f->waiter, 2, Qtrue);
+        rb_fiber_scheduler_block(f->scheduler, f->cb, Qnil);
+      }
+      rb_ary_store(f->waiter, 2, Qfalse);
+      if (rb_obj_is_kind_of(cbs->req->value, rb_eException)){
+        f->err = cbs->err;
+        return Qnil;
+      }
+      ret = NUM2SSIZET(cbs->req->value);
+      f->done += ret;
+      if (ret == 0 || f->done >= f->length || f->done >= f->size) return Qnil;
+    }
 }
 
-static VALUE 
-rb_aio_s_return(VALUE aio, VALUE cb)
+static VALUE
+rb_aio_fiber_io_close(VALUE arg)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (rb_block_given_p()){
-      cbs->rcb = rb_block_proc();
-    }
-    return rb_aio_return( &cbs->cb );	
+    rb_aio_fiber_io_t *f = (rb_aio_fiber_io_t *)arg;
+    rb_ary_store(f->waiter, 2, Qfalse);
+    control_block_quiesce(GetCBStruct(f->cb));
+    return Qnil;
 }
 
 /*
- *  Error handling for aio_error
+ *  read / write on pipes, sockets and the like, which don't have positions to
+ *  read or write at.
  */
-static void 
-rb_aio_err_error()
+static VALUE
+rb_aio_fiber_io_stream(rb_aio_fiber_io_t *f)
 {
-    switch(errno){
-       case EINVAL: 
-            rb_aio_error("[EINVAL] The control block does not refer to an asynchronous operation whose return status has not yet been retrieved.");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] aio_error not supported by this implementation.");
+    ssize_t ret;
+    while (f->done < f->size) {
+      if (f->opcode == LIO_READ){
+        ret = read(f->fd, f->base + f->done, f->size - f->done);
+      }else{
+        ret = write(f->fd, f->base + f->done, f->size - f->done);
+      }
+      if (ret > 0){
+        f->done += ret;
+        if (f->done >= f->length) break;
+      }else if (ret == 0){
+        break;
+      }else if (errno == EAGAIN || errno == EWOULDBLOCK){
+        rb_fiber_scheduler_io_wait(f->scheduler, f->io, INT2NUM(f->opcode == LIO_READ ? RUBY_IO_READABLE : RUBY_IO_WRITABLE), Qnil);
+      }else if (errno != EINTR){
+        if (f->done) break;
+        return rb_fiber_scheduler_io_result(-1, errno);
+      }
     }
+    return rb_fiber_scheduler_io_result(f->done, 0);
 }
 
-static VALUE 
-rb_aio_err(aiocb_t *cb)
-{ 
-    int ret;
-    TRAP_BEG;
-    ret = aio_error(cb);
-    TRAP_END;
-    if (ret != 0) rb_aio_err_error();
-    return INT2FIX(ret);
+/*
+ *  Moves up to the rest of buffer past offset (at least length bytes, unless EOF
+ *  is hit first) at file position from, or the current file position which is
+ *  then advanced when from is negative.
+ */
+static VALUE
+rb_aio_fiber_io(VALUE scheduler, VALUE io, VALUE buffer, VALUE length, VALUE from, VALUE offset, int opcode)
+{
+    rb_aio_fiber_io_t f;
+    struct stat st;
+    void *base;
+    size_t size, skip = NUM2SIZET(offset);
+    int advance;
+    if (opcode == LIO_READ){
+      rb_io_buffer_get_bytes_for_writing(buffer, &base, &size);
+    }else{
+      rb_io_buffer_get_bytes_for_reading(buffer, (const void **)&base, &size);
+    }
+    if (skip > size) rb_raise(rb_eArgError, "offset exceeds buffer size");
+    io = rb_io_get_io(io);
+    MEMZERO(&f, rb_aio_fiber_io_t, 1);
+    f.scheduler = scheduler;
+    f.io = io;
+    f.fd = NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+    f.opcode = opcode;
+    f.base = (char *)base + skip;
+    f.size = size - skip;
+    f.length = NUM2SIZET(length);
+    if (fstat(f.fd, &st) != 0) return rb_fiber_scheduler_io_result(-1, errno);
+    if (!S_ISREG(st.st_mode)) return rb_aio_fiber_io_stream(&f);
+    advance = NIL_P(from);
+    if (advance){
+      f.from = (opcode == LIO_WRITE && (fcntl(f.fd, F_GETFL) & O_APPEND)) ? st.st_size : lseek(f.fd, 0, SEEK_CUR);
+      if (f.from < 0) return rb_fiber_scheduler_io_result(-1, errno);
+    }else{
+      f.from = NUM2OFFT(from);
+    }
+    f.cb = rb_class_new_instance(0, 0, rb_cCB);
+    f.waiter = rb_ary_new3(3, scheduler, rb_fiber_current(), Qfalse);
+    rb_ensure(rb_aio_fiber_io_run, (VALUE)&f, rb_aio_fiber_io_close, (VALUE)&f);
+    if (advance && f.done) lseek(f.fd, f.from + f.done, SEEK_SET);
+    RB_GC_GUARD(buffer);
+    if (f.err && !f.done) return rb_fiber_scheduler_io_result(-1, f.err);
+    return rb_fiber_scheduler_io_result(f.done, 0);
 }
 
-static VALUE 
-rb_aio_s_error(VALUE aio, VALUE cb)
+/*
+ *  call-seq:
+ *     scheduler.io_read(io, buffer, length, offset = 0) -> integer
+ *  
+ *  Fiber::Scheduler hook : reads from the current position of io into buffer
+ *  past offset without blocking the thread, only the calling fiber. Ruby 3.1
+ *  passes no offset.
+ */
+static VALUE
+rb_aio_scheduler_io_read(int argc, VALUE *argv, VALUE scheduler)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (rb_block_given_p()){
-      cbs->rcb = rb_block_proc();
-    }
-    return rb_aio_err( &cbs->cb );
+    VALUE io, buffer, length, offset;
+    rb_scan_args(argc, argv, "31", &io, &buffer, &length, &offset);
+    return rb_aio_fiber_io(scheduler, io, buffer, length, Qnil, NIL_P(offset) ? INT2FIX(0) : offset, LIO_READ);
 }
 
 /*
- *  Error handling for aio_error
+ *  call-seq:
+ *     scheduler.io_write(io, buffer, length, offset = 0) -> integer
+ *  
+ *  Fiber::Scheduler hook : writes buffer past offset at the current position of
+ *  io without blocking the thread, only the calling fiber. Ruby 3.1 passes no
+ *  offset.
  */
-static void 
-rb_aio_sync_error()
+static VALUE
+rb_aio_scheduler_io_write(int argc, VALUE *argv, VALUE scheduler)
 {
-    switch(errno){
-       case EINVAL: 
-            rb_aio_error("[EINVAL] A value of op other than AIO::DSYNC or AIO::SYNC was specified.");
-       case EAGAIN: 
-            rb_aio_error("[EAGAIN] The requested asynchronous operation was not queued due to temporary resource limitations.");
-       case ENOSYS: 
-            rb_aio_error("[ENOSYS] aio_error not supported by this implementation.");
-       case EBADF: 
-            rb_aio_error("[EBADF] Invalid file descriptor.");
-    }
+    VALUE io, buffer, length, offset;
+    rb_scan_args(argc, argv, "31", &io, &buffer, &length, &offset);
+    return rb_aio_fiber_io(scheduler, io, buffer, length, Qnil, NIL_P(offset) ? INT2FIX(0) : offset, LIO_WRITE);
 }
 
-static VALUE 
-rb_aio_sync(int op, aiocb_t *cb)
-{ 
-    int ret;
-    TRAP_BEG;
-    ret = aio_fsync( op, cb );
-    TRAP_END;
-    if (ret != 0) rb_aio_sync_error();
-    return INT2FIX(ret);
+/*
+ *  call-seq:
+ *     scheduler.io_pread(io, buffer, from, length, offset) -> integer
+ *  
+ *  Fiber::Scheduler hook for IO#pread.
+ */
+static VALUE
+rb_aio_scheduler_io_pread(VALUE scheduler, VALUE io, VALUE buffer, VALUE from, VALUE length, VALUE offset)
+{
+    return rb_aio_fiber_io(scheduler, io, buffer, length, from, offset, LIO_READ);
 }
 
-static VALUE 
-rb_aio_s_sync(VALUE aio, VALUE op, VALUE cb)
+/*
+ *  call-seq:
+ *     scheduler.io_pwrite(io, buffer, from, length, offset) -> integer
+ *  
+ *  Fiber::Scheduler hook for IO#pwrite.
+ */
+static VALUE
+rb_aio_scheduler_io_pwrite(VALUE scheduler, VALUE io, VALUE buffer, VALUE from, VALUE length, VALUE offset)
 {
-    rb_aiocb_t *cbs = GetCBStruct(cb);
-    if (rb_block_given_p()){
-      cbs->rcb = rb_block_proc();
-    }
-    Check_Type( op, T_FIXNUM );
-    /* XXX handle AIO::DSYNC gracefully as well */
-    if (op != c_aio_sync) rb_aio_error("Operation AIO::SYNC expected");
-    return rb_aio_sync( NUM2INT(op), &cbs->cb );	
+    return rb_aio_fiber_io(scheduler, io, buffer, length, from, offset, LIO_WRITE);
 }
+#endif
 
 void Init_aio()
 {   
+    setup_rb_aio_notification();
+    setup_rb_aio_backend();
+
     s_buf = rb_intern("buf");
     s_to_str = rb_intern("to_str");
     s_to_s = rb_intern("to_s");
+    s_into = rb_intern("into");
+    s_direct = rb_intern("direct");
+    s_map = rb_intern("map");
+    s_track = rb_intern("track");
+    s_chunk_size = rb_intern("chunk_size");
+    s_depth = rb_intern("depth");
+    s_segments = rb_intern("segments");
+    s_concurrency = rb_intern("concurrency");
+    s_alive_p = rb_intern("alive?");
+    s_buffer_size = rb_intern("buffer_size");
+    s_preallocate = rb_intern("preallocate");
+    s_iv_cb = rb_intern("@cb");
+    s_iv_requests = rb_intern("@requests");
    
     mAio = rb_define_module("AIO");
 
@@ -838,12 +6119,23 @@ void Init_aio()
     rb_define_method(rb_cCB, "fildes=", control_block_fildes_set, 1);
     rb_define_method(rb_cCB, "buf", control_block_buf_get, 0);
     rb_define_method(rb_cCB, "buf=", control_block_buf_set, 1);
+    rb_define_method(rb_cCB, "bufs", control_block_bufs_get, 0);
+    rb_define_method(rb_cCB, "bufs=", control_block_bufs_set, 1);
+    rb_define_method(rb_cCB, "into", control_block_into_get, 0);
+    rb_define_method(rb_cCB, "into=", control_block_into_set, 1);
     rb_define_method(rb_cCB, "nbytes", control_block_nbytes_get, 0);
     rb_define_method(rb_cCB, "nbytes=", control_block_nbytes_set, 1);
     rb_define_method(rb_cCB, "offset", control_block_offset_get, 0);
     rb_define_method(rb_cCB, "offset=", control_block_offset_set, 1);
     rb_define_method(rb_cCB, "reqprio", control_block_reqprio_get, 0);
     rb_define_method(rb_cCB, "reqprio=", control_block_reqprio_set, 1);
+    rb_define_method(rb_cCB, "priority", control_block_priority_get, 0);
+    rb_define_method(rb_cCB, "priority=", control_block_priority_set, 1);
+    rb_define_method(rb_cCB, "deadline", control_block_deadline_get, 0);
+    rb_define_method(rb_cCB, "deadline=", control_block_deadline_set, 1);
+    rb_define_method(rb_cCB, "direct?", control_block_direct_p, 0);
+    rb_define_method(rb_cCB, "direct=", control_block_direct_set, 1);
+    rb_define_method(rb_cCB, "alignment", control_block_alignment, 0);
     rb_define_method(rb_cCB, "lio_opcode", control_block_lio_opcode_get, 0);
     rb_define_method(rb_cCB, "lio_opcode=", control_block_lio_opcode_set, 1);
     rb_define_method(rb_cCB, "callback", control_block_callback_get, 0);
@@ -856,13 +6148,65 @@ void Init_aio()
     rb_define_method(rb_cCB, "closed?", control_block_closed_p, 0);
     rb_define_method(rb_cCB, "path", control_block_path, 0);
  
+    rb_cJournal = rb_define_class_under( mAio, "Journal", rb_cObject);
+    rb_define_alloc_func(rb_cJournal, journal_alloc);
+    rb_define_method(rb_cJournal, "initialize", journal_initialize, 1);
+    rb_define_method(rb_cJournal, "write", journal_write, 1);
+    rb_define_method(rb_cJournal, "close", journal_close, 0);
+    rb_define_method(rb_cJournal, "tail", journal_tail, 0);
+    rb_define_method(rb_cJournal, "commits", journal_commits, 0);
+    rb_define_method(rb_cJournal, "flushes", journal_flushes, 0);
+
+    rb_cAppendLog = rb_define_class_under( mAio, "AppendLog", rb_cObject);
+    rb_define_alloc_func(rb_cAppendLog, log_alloc);
+    rb_define_method(rb_cAppendLog, "initialize", log_initialize, -1);
+    rb_define_method(rb_cAppendLog, "append", log_append, 1);
+    rb_define_method(rb_cAppendLog, "flush", log_flush, 0);
+    rb_define_method(rb_cAppendLog, "wait", log_wait, 0);
+    rb_define_method(rb_cAppendLog, "close", log_close, 0);
+    rb_define_method(rb_cAppendLog, "tail", log_tail, 0);
+    rb_define_method(rb_cAppendLog, "written", log_written, 0);
+
+    rb_cMap = rb_define_class_under( mAio, "Map", rb_cObject);
+    rb_define_alloc_func(rb_cMap, map_alloc);
+    rb_define_method(rb_cMap, "initialize", map_initialize, 1);
+    rb_define_method(rb_cMap, "size", map_size, 0);
+    rb_define_method(rb_cMap, "slice", map_slice, 2);
+    rb_define_method(rb_cMap, "[]", map_slice, 2);
+    rb_define_method(rb_cMap, "to_s", map_to_s, 0);
+    rb_define_method(rb_cMap, "prefetch", map_prefetch, -1);
+
+    rb_cRequest = rb_define_class_under( mAio, "Request", rb_cObject);
+    rb_undef_method(CLASS_OF(rb_cRequest), "new");
+    rb_define_method(rb_cRequest, "cb", request_cb, 0);
+    rb_define_method(rb_cRequest, "ready?", request_ready_p, 0);
+    rb_define_method(rb_cRequest, "wait", request_wait, -1);
+    rb_define_method(rb_cRequest, "value", request_value, 0);
+
+    rb_cBatch = rb_define_class_under( mAio, "Batch", rb_cObject);
+    rb_undef_method(CLASS_OF(rb_cBatch), "new");
+    rb_define_method(rb_cBatch, "requests", batch_requests, 0);
+    rb_define_method(rb_cBatch, "ready?", batch_ready_p, 0);
+    rb_define_method(rb_cBatch, "wait", batch_wait, -1);
+    rb_define_method(rb_cBatch, "value", batch_value, 0);
+
+#ifdef AIO_FIBER_SCHEDULER
+    rb_mScheduler = rb_define_module_under( mAio, "Scheduler");
+    rb_define_method(rb_mScheduler, "io_read", rb_aio_scheduler_io_read, -1);
+    rb_define_method(rb_mScheduler, "io_write", rb_aio_scheduler_io_write, -1);
+    rb_define_method(rb_mScheduler, "io_pread", rb_aio_scheduler_io_pread, 5);
+    rb_define_method(rb_mScheduler, "io_pwrite", rb_aio_scheduler_io_pwrite, 5);
+#endif
+
     rb_alias( rb_cCB, s_to_str, s_buf );
     rb_alias( rb_cCB, s_to_s, s_buf );
 
     rb_define_const(mAio, "SYNC", INT2NUM(O_SYNC));
-    /*
-    XXX O_DSYNC not supported by Darwin
-    rb_define_const(mAio, "DSYNC", INT2NUM(O_DSYNC));*/
+    /* O_DSYNC not supported by Darwin */
+#ifdef O_DSYNC
+    rb_define_const(mAio, "DSYNC", INT2NUM(O_DSYNC));
+    c_aio_dsync = INT2NUM(O_DSYNC);
+#endif
     rb_define_const(mAio, "QUEUE", INT2NUM(100));
     rb_define_const(mAio, "INPROGRESS", INT2NUM(EINPROGRESS));
     rb_define_const(mAio, "ALLDONE", INT2NUM(AIO_ALLDONE));
@@ -873,6 +6217,9 @@ void Init_aio()
     rb_define_const(mAio, "NOP", INT2NUM(LIO_NOP));
     rb_define_const(mAio, "READ", INT2NUM(LIO_READ));
     rb_define_const(mAio, "WRITE", INT2NUM(LIO_WRITE));
+    rb_define_const(mAio, "INTERACTIVE", INT2NUM(AIO_INTERACTIVE));
+    rb_define_const(mAio, "NORMAL", INT2NUM(AIO_NORMAL));
+    rb_define_const(mAio, "BACKGROUND", INT2NUM(AIO_BACKGROUND));
 
     c_aio_sync = INT2NUM(O_SYNC);
     c_aio_queue = INT2NUM(100);
@@ -889,12 +6236,47 @@ void Init_aio()
     eAio = rb_define_class_under(mAio, "Error", rb_eStandardError);
 
     rb_define_module_function( mAio, "lio_listio", rb_aio_s_lio_listio, -2 );
-    rb_define_module_function( mAio, "read", rb_aio_s_read, 1 );
+    rb_define_module_function( mAio, "read", rb_aio_s_read, -1 );
     rb_define_module_function( mAio, "write", rb_aio_s_write, 1 );
+    rb_define_module_function( mAio, "each_chunk", rb_aio_s_each_chunk, -1 );
+    rb_define_module_function( mAio, "read_parallel", rb_aio_s_read_parallel, -1 );
+    rb_define_module_function( mAio, "read_ranges", rb_aio_s_read_ranges, 2 );
+    rb_define_module_function( mAio, "read_all", rb_aio_s_read_all, -1 );
+    rb_define_module_function( mAio, "map", rb_aio_s_map, 1 );
+    rb_define_module_function( mAio, "prefetch", rb_aio_s_prefetch, -1 );
+    rb_define_module_function( mAio, "wait_any", rb_aio_s_wait_any, -1 );
+    rb_define_module_function( mAio, "wait_all", rb_aio_s_wait_all, -1 );
     rb_define_module_function( mAio, "cancel", rb_aio_s_cancel, -1 );
     rb_define_module_function( mAio, "return", rb_aio_s_return, 1 );
     rb_define_module_function( mAio, "error", rb_aio_s_error, 1 );
     rb_define_module_function( mAio, "sync", rb_aio_s_sync, 2 );
 
-    setup_rb_aio_signals();
+#ifdef HAVE_IO_URING
+    rb_define_const(mAio, "BACKEND", rb_str_new2(rb_aio_ring ? "io_uring" : "posix"));
+#else
+    rb_define_const(mAio, "BACKEND", rb_str_new2("posix"));
+#endif
+
+    rb_define_module_function( mAio, "max_inflight", rb_aio_s_max_inflight, 0 );
+    rb_define_module_function( mAio, "max_inflight=", rb_aio_s_max_inflight_set, 1 );
+    rb_define_module_function( mAio, "adaptive?", rb_aio_s_adaptive_p, 0 );
+    rb_define_module_function( mAio, "adaptive=", rb_aio_s_adaptive_set, 1 );
+    rb_define_module_function( mAio, "tuner", rb_aio_s_tuner, 0 );
+    rb_define_module_function( mAio, "background_share", rb_aio_s_background_share, 0 );
+    rb_define_module_function( mAio, "background_share=", rb_aio_s_background_share_set, 1 );
+    rb_define_module_function( mAio, "fastpath?", rb_aio_s_fastpath_p, 0 );
+    rb_define_module_function( mAio, "fastpath=", rb_aio_s_fastpath_set, 1 );
+    rb_define_module_function( mAio, "stats", rb_aio_s_stats, -1 );
+    rb_define_module_function( mAio, "reset_stats", rb_aio_s_reset_stats, 0 );
+    rb_define_module_function( mAio, "arena", rb_aio_s_arena, 0 );
+    rb_define_module_function( mAio, "arena_max_idle=", rb_aio_s_arena_max_idle_set, 1 );
+    rb_define_module_function( mAio, "arena_hugepages=", rb_aio_s_arena_hugepages_set, 1 );
+    rb_define_module_function( mAio, "completion_io", rb_aio_s_completion_io, 0 );
+    rb_define_module_function( mAio, "ack_completions", rb_aio_s_ack_completions, 0 );
+
+    rb_aio_stats.since = rb_aio_clock();
+
+    rb_global_variable(&rb_aio_completion_io);
+    rb_global_variable(&rb_aio_dispatch_pending);
+    rb_global_variable(&rb_aio_dispatcher);
 }
\ No newline at end of file
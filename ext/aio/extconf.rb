@@ -9,9 +9,50 @@ dir_config('aio')
 if RUBY_PLATFORM =~ /linux/i
   raise 'cannot find AIO' unless have_library('rt', 'aio_read', 'aio.h')
 end
-add_define 'RUBY19' if have_func('rb_thread_blocking_region') and have_macro('RUBY_UBF_IO', 'ruby.h')
+add_define 'RUBY19' if have_header('ruby/io.h')
+# Waits release the GVL, through rb_thread_blocking_region before Ruby 2.0
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h') or have_func('rb_thread_blocking_region')
 add_define 'RUBY18' if have_var('rb_trap_immediate', ['ruby.h', 'rubysig.h'])
 
+# Results are tainted up to Ruby 3.1
+have_func('rb_tainted_str_new', 'ruby.h')
+
+# Buffer arena memory is reported to the GC where supported
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
+# Completion notification through an eventfd, or a pipe where not available
+have_header('sys/eventfd.h')
+
+# AIO::AppendLog preallocates extents ahead of the tail where supported
+have_func('fallocate', 'fcntl.h')
+
+# Cache hit fast path for blocking reads, preadv2 with RWF_NOWAIT
+have_func('preadv2', 'sys/uio.h')
+
+# AIO::Map Strings point into the mapping where external memory can be wrapped
+have_func('rb_str_new_static', 'ruby.h')
+
+# O_DIRECT alignment as reported by the kernel (Linux 6.1+)
+have_func('statx', 'sys/stat.h')
+
+# USDT probes on the submission / completion paths, for bpftrace and SystemTap
+have_header('sys/sdt.h')
+
+# AIO::Scheduler, Fiber::Scheduler hooks backed by the AIO engine (Ruby 3.1+)
+if have_header('ruby/fiber/scheduler.h') and have_func('rb_io_buffer_get_bytes_for_writing', 'ruby/io/buffer.h')
+  add_define 'AIO_FIBER_SCHEDULER'
+end
+
+# io_uring engine, spoken through raw syscalls - the POSIX AIO backend is used at
+# runtime if the kernel doesn't support it or AIO_BACKEND=posix is set.
+if RUBY_PLATFORM =~ /linux/i && ENV['AIO_BACKEND'] != 'posix'
+  if have_header('linux/io_uring.h') and have_macro('__NR_io_uring_setup', 'sys/syscall.h') and have_library('pthread', 'pthread_create', 'pthread.h')
+    add_define 'HAVE_IO_URING'
+    # AIO.read_all as linked open / statx / read / close chains into fixed file slots
+    have_struct_member('struct io_uring_sqe', 'file_index', 'linux/io_uring.h')
+  end
+end
+
 $defs.push("-pedantic")
 
 create_makefile('aio')
\ No newline at end of file
@@ -1,7 +1,11 @@
 $:.unshift "."
 require File.dirname(__FILE__) + '/helper'
+require 'timeout'
+require 'thread'
 
 class TestAio < Test::Unit::TestCase
+  FASTPATH = AIO.fastpath?
+
 =begin
   def test_listio_read
     cbs = fixtures( *%w(1.txt 2.txt 3.txt 4.txt) ).map{|f| CB(f) }
@@ -22,8 +26,10 @@ class TestAio < Test::Unit::TestCase
 =end
   def test_listio_read_non_blocking
     cbs = fixtures( *%w(1.txt 2.txt 3.txt 4.txt) ).map{|f| CB(f) }
-    assert_equal nil, AIO.lio_listio( *([AIO::NOWAIT].concat(cbs)) )     
-    sleep(1)
+    batch = AIO.lio_listio( *([AIO::NOWAIT].concat(cbs)) )
+    assert_instance_of AIO::Batch, batch
+    assert batch.wait(5)
+    assert batch.ready?
     assert_equal %w(one two three four), cbs.map{|cb| cb.buf }   
     cbs.each{|cb| cb.close }
     cbs.each{|cb| assert cb.closed? }
@@ -66,6 +72,170 @@ class TestAio < Test::Unit::TestCase
     assert_equal 'one', AIO.read( cb )
     assert cb.closed?
   end
+
+  def test_read_into
+    buf = 'xxxxxxxxxx'
+    into = CB('1.txt')
+    assert_equal buf.object_id, AIO.read( into, :into => buf ).object_id
+    assert_equal 'one', buf
+    cb = CB('2.txt')
+    cb.into = true
+    assert_equal 'two', AIO.read( cb )
+  ensure
+    into.close if into
+    cb.close if cb
+  end
+
+  def test_write_bufs
+    cb = WCB('vectored.txt')
+    cb.bufs = %w(head body tail)
+    assert_equal 12, cb.nbytes
+    assert_equal 12, AIO.write( cb )
+    assert_equal 'headbodytail', File.read( scratch('vectored.txt') )
+  end
+
+  def test_read_bufs
+    cb = CB('1.txt')
+    bufs = ['xx', 'xx', 'xx']
+    cb.bufs = bufs
+    assert_equal ['on', 'e', ''], AIO.read( cb )
+    assert_equal ['on', 'e', ''], bufs
+  end
+
+  def test_each_chunk
+    data = (1..5000).map{|i| i.to_s }.join(',')
+    File.open(scratch('stream.txt'), 'w'){|f| f << data }
+    chunks = []
+    AIO.each_chunk( scratch('stream.txt'), :chunk_size => 1000, :depth => 3 ){|c| chunks << c }
+    assert_equal (data.size / 1000.0).ceil, chunks.size
+    assert_equal data, chunks.join
+    assert_equal %w(one), AIO.each_chunk( fixture('1.txt') ).to_a
+  end
+
+  def test_read_parallel
+    data = (1..20000).map{|i| i.to_s }.join(',')
+    File.open(scratch('parallel.txt'), 'w'){|f| f << data }
+    assert_equal data, AIO.read_parallel( scratch('parallel.txt'), :segments => 5 )
+    assert_equal 'one', AIO.read_parallel( fixture('1.txt') )
+  end
+
+  def test_read_ranges
+    data = (0...1000).map{|i| (i % 10).to_s }.join
+    File.open(scratch('ranges.txt'), 'w'){|f| f << data }
+    ranges = [[500, 10], [0, 4], [2, 6], [8, 2], [990, 20], [2000, 5], [100, 0]]
+    expected = ranges.map{|o,l| data[o,l] || '' }
+    assert_equal expected, AIO.read_ranges( scratch('ranges.txt'), ranges )
+    cb = CB('1.txt')
+    assert_equal %w(ne o), AIO.read_ranges( cb, [[1, 2], [0, 1]] )
+    cb.close
+  end
+
+  def test_read_all
+    paths = fixtures(*(1..8).map{|f| "#{f}.txt" })
+    assert_equal paths.map{|p| IO.read(p) }, AIO.read_all( paths, :concurrency => 3 )
+    assert_equal [], AIO.read_all( [] )
+    assert_raises Errno::ENOENT do
+      AIO.read_all( paths + [fixture('missing.txt')] )
+    end
+  end
+
+  def test_read_all_sizes
+    sizes = [0, 1, 16 * 1024, 16 * 1024 + 1, 300 * 1024]
+    paths = sizes.map do |size|
+      path = scratch("read_all_#{size}.bin")
+      File.open(path, 'wb'){|f| f << (0...size).map{|i| (i % 251).chr }.join }
+      path
+    end
+    AIO.reset_stats
+    assert_equal sizes, AIO.read_all( paths ).map{|data| data.size }
+    stats = AIO.stats[:read]
+    assert_equal stats[:submitted], stats[:completed]
+    assert_equal paths.map{|p| File.open(p, 'rb'){|f| f.read } } * 20, AIO.read_all( paths * 20 )
+  ensure
+    paths.each{|p| File.unlink(p) rescue nil } if paths
+  end
+
+  def test_sync_dsync
+    cb = WCB('dsync.txt')
+    assert_equal 0, AIO.sync( AIO::DSYNC, cb )
+    assert_aio_error do
+      AIO.sync( 12, cb )
+    end
+  ensure
+    cb.close if cb
+    File.unlink(scratch('dsync.txt')) rescue nil
+  end
+
+  def test_journal
+    File.open(scratch('journal.log'), 'w'){|f| f << 'head' }
+    journal = AIO::Journal.new( scratch('journal.log') )
+    assert_equal 4, journal.write( 'one' )
+    threads = (1..8).map{|t| Thread.new{ (1..20).map{|i| journal.write( "#{t}:#{i}\n" ) } } }
+    offsets = threads.map{|t| t.value }.flatten
+    assert_equal 161, journal.commits
+    assert journal.flushes <= journal.commits
+    journal.close
+    data = File.read( scratch('journal.log') )
+    assert_equal journal.tail, data.size
+    assert_equal 'headone', data[0,7]
+    assert_equal 160, data[7..-1].split("\n").uniq.size
+    assert_equal offsets.sort, offsets.uniq.sort
+  end
+
+  def test_append_log
+    File.open(scratch('append.log'), 'w'){|f| f << 'head' }
+    log = AIO::AppendLog.new( scratch('append.log'), :buffer_size => 64, :depth => 2, :preallocate => 4096 )
+    done = []
+    offsets = (1..100).map{|i| log.append( "record #{i}\n" ){|off| done << off } }
+    assert_equal 4, offsets.first
+    assert_equal offsets.last + 11, log.append( 'x' * 200 )
+    assert_equal log.tail, log.wait
+    assert_equal offsets, done
+    log.close
+    data = File.read( scratch('append.log') )
+    assert_equal log.tail, data.size
+    assert_equal "head" + (1..100).map{|i| "record #{i}\n" }.join + 'x' * 200, data
+    log = AIO::AppendLog.new( scratch('append.log'), :buffer_size => 16, :depth => 8 )
+    offsets = (1..500).map{|i| log.append( "#{i}," ) }
+    log.wait
+    log.close
+    data = File.read( scratch('append.log') )
+    assert_equal offsets.map{|off| data[off, data.index(',', off) - off] }, (1..500).map{|i| i.to_s }
+  end
+
+  def test_append_log_failed_write
+    log = AIO::AppendLog.new( '/dev/full', :buffer_size => 16, :depth => 2 )
+    errors = []
+    log.append( 'abc' ){|off, err| errors << err }
+    log.append( 'def' ){|off, err| errors << err }
+    log.wait
+    assert_equal 2, errors.size
+    assert errors.all?{|err| Errno::ENOSPC === err }
+    log.append( 'ghi' )
+    assert_raise( Errno::ENOSPC ){ log.wait }
+    assert_equal 0, log.wait
+  ensure
+    log.close if log
+  end
+
+  def test_listio_failed_requests
+    dir = AIO::CB.new( File.dirname(fixture('1.txt')) )
+    results = AIO.lio_listio( CB('1.txt'), dir )
+    assert_equal 'one', results.first
+    assert_instance_of AIO::Error, results.last
+    wcb = WCB('partial.txt')
+    wcb.buf = 'abc'
+    assert_equal [3], AIO.lio_listio( wcb )
+  ensure
+    File.unlink(scratch('partial.txt')) rescue nil
+  end
+
+  def test_listio_into
+    cbs = %w(1.txt 2.txt).map{|f| CB(f) }
+    bufs = cbs.map{|cb| cb.into = '' }
+    assert_equal %w(one two), AIO.lio_listio( *cbs )
+    assert_equal %w(one two), bufs
+  end
 =begin
   def test_cancel_with_cb
     cb = CB('1.txt' )
@@ -115,6 +285,256 @@ class TestAio < Test::Unit::TestCase
     end
   end  
 =end 
+  def test_listio_beyond_max_list
+    File.open(fixture('1.txt')) do |f|
+      cbs = (1..100).map{ cb = AIO::CB.new; cb.fildes = f.fileno; cb.nbytes = 3; cb }
+      assert_equal ['one'] * 100, AIO.lio_listio( *cbs )
+    end
+  end
+
+  def test_max_inflight
+    limit = AIO.max_inflight
+    assert_equal 8, AIO.max_inflight = 8
+    File.open(fixture('2.txt')) do |f|
+      cbs = (1..20).map{ cb = AIO::CB.new; cb.fildes = f.fileno; cb.nbytes = 3; cb }
+      assert_equal ['two'] * 20, AIO.lio_listio( *cbs )
+    end
+    assert_aio_error do
+      AIO.max_inflight = 0
+    end
+  ensure
+    AIO.max_inflight = limit
+    AIO.adaptive = true
+  end
+
+  def test_adaptive_inflight
+    AIO.fastpath = false if AIO.fastpath?
+    AIO.adaptive = true
+    assert AIO.adaptive?
+    File.open(fixture('2.txt')) do |f|
+      cbs = (1..200).map{ cb = AIO::CB.new; cb.fildes = f.fileno; cb.nbytes = 3; cb }
+      assert_equal ['two'] * 200, AIO.lio_listio( *cbs )
+    end
+    tuner = AIO.tuner
+    assert tuner[:adaptive]
+    assert tuner[:latency] > 0
+    assert((4..512).include?( tuner[:max_inflight] ))
+    AIO.max_inflight = 16
+    assert !AIO.adaptive?
+  ensure
+    AIO.max_inflight = 64
+    AIO.adaptive = true
+    AIO.fastpath = FASTPATH
+  end
+
+  def test_fastpath
+    return unless AIO.fastpath?
+    path = fixture('2.txt')
+    IO.read(path)
+    AIO.reset_stats
+    File.open(path) do |f|
+      cbs = (1..4).map{ cb = AIO::CB.new; cb.fildes = f.fileno; cb.nbytes = 3; cb }
+      assert_equal ['two'] * 4, AIO.lio_listio( *cbs )
+    end
+    assert_equal 'two', AIO.read( CB('2.txt') )
+    stats = AIO.stats
+    assert_equal 5, stats[:fastpath][:hits]
+    assert_equal 15, stats[:fastpath][:bytes]
+    assert_equal [5, 15], stats[:read].values_at(:completed, :bytes)
+    AIO.fastpath = false
+    AIO.reset_stats
+    assert_equal 'two', AIO.read( CB('2.txt') )
+    assert_equal 0, AIO.stats[:fastpath][:hits]
+  ensure
+    AIO.fastpath = FASTPATH
+  end
+
+  def test_map
+    map = AIO.map(fixture('3.txt'))
+    assert_instance_of AIO::Map, map
+    assert_equal 5, map.size
+    assert_equal 'three', map.to_s
+    assert map.to_s.frozen?
+    assert_equal 'hre', map[1, 3]
+    assert_equal 'ee', map.slice(3, 10)
+    assert_nil map[6, 1]
+    assert_equal map, map.prefetch
+    assert_equal map, map.prefetch(2, 2)
+    slice = map[0, 2].dup
+    map = nil
+    GC.start
+    assert_equal 'th', slice
+    assert_raise(Errno::ENOENT){ AIO.map(fixture('missing.txt')) }
+  end
+
+  def test_prefetch
+    assert_nil AIO.prefetch(fixture('3.txt'))
+    assert_nil AIO.prefetch(fixtures('1.txt', '2.txt').push([fixture('3.txt'), 1, 2]))
+    batch = AIO.prefetch([fixture('3.txt'), [fixture('2.txt'), 1], [fixture('1.txt'), 5]], :track => true)
+    assert_instance_of AIO::Batch, batch
+    assert_equal [5, 2], batch.value
+    sizes = Queue.new
+    AIO.prefetch(fixture('2.txt')){|bytes| sizes << bytes }.wait(1.0)
+    assert_equal 3, sizes.pop
+    assert_raise(Errno::ENOENT){ AIO.prefetch([fixture('1.txt'), fixture('missing.txt')]) }
+  end
+
+  def test_prefetch_closes_files
+    return unless File.directory?('/proc/self/fd')
+    open_fds = lambda{ Dir.entries('/proc/self/fd').size }
+    fds = open_fds.call
+    AIO.prefetch([fixture('3.txt'), [fixture('1.txt'), 5]], :track => true).value
+    20.times{ break if open_fds.call <= fds; sleep(0.05) }
+    assert_equal fds, open_fds.call
+    assert_raise(Errno::ENOENT){ AIO.prefetch([fixture('1.txt'), fixture('missing.txt')], :track => true) }
+    assert_equal fds, open_fds.call
+  end
+
+  def test_stats
+    AIO.reset_stats
+    cbs = fixtures( *%w(1.txt 2.txt 3.txt) ).map{|f| CB(f) }
+    assert_equal %w(one two three), AIO.lio_listio( *cbs )
+    wcb = WCB('stats.txt')
+    wcb.buf = 'stats'
+    AIO.write( wcb )
+    stats = AIO.stats(true)
+    assert_equal [3, 3, 0, 11], stats[:read].values_at(:submitted, :completed, :errors, :bytes)
+    assert_equal [1, 1, 5], stats[:write].values_at(:submitted, :completed, :bytes)
+    latency = stats[:read][:latency]
+    assert_equal 3, latency[:count]
+    assert latency[:min] <= latency[:p50] && latency[:p50] <= latency[:p999] && latency[:p999] <= latency[:max]
+    assert_equal 3, latency[:buckets].inject(0){|n, (_, c)| n + c }
+    assert_equal 3, stats[:read][:queued][:count]
+    assert stats[:inflight_max] >= 1
+    assert_equal 0, AIO.stats[:read][:submitted]
+  ensure
+    File.unlink(scratch('stats.txt')) rescue nil
+  end
+
+  def test_completion_io
+    AIO.ack_completions
+    cbs = fixtures( *%w(1.txt 2.txt) ).map{|f| CB(f) }
+    AIO.lio_listio( *([AIO::NOWAIT].concat(cbs)) )
+    assert_equal [AIO.completion_io], IO.select([AIO.completion_io], nil, nil, 5).first
+    assert AIO.ack_completions >= 1
+    sleep(0.1) while cbs.any?{|cb| AIO.error(cb) == AIO::INPROGRESS }
+    assert_equal %w(one two), cbs.map{|cb| cb.buf }
+    cbs.each{|cb| cb.close }
+  end
+
+  def test_completion_io_nowait_only
+    AIO.fastpath = false if AIO.fastpath?
+    AIO.ack_completions
+    cbs = fixtures( *%w(1.txt 2.txt) ).map{|f| CB(f) }
+    assert_equal %w(one two), AIO.lio_listio( *cbs )
+    assert_nil IO.select([AIO.completion_io], nil, nil, 0.1)
+    assert_equal 0, AIO.ack_completions
+  ensure
+    cbs.each{|cb| cb.close } if cbs
+    AIO.fastpath = FASTPATH
+  end
+
+  def test_completion_io_with_callbacks
+    AIO.ack_completions
+    results = Queue.new
+    cbs = fixtures( *%w(1.txt 2.txt) ).map{|f| CB(f) }
+    AIO.lio_listio( *([AIO::NOWAIT].concat(cbs)) ){|data| results << data }
+    assert_equal [AIO.completion_io], IO.select([AIO.completion_io], nil, nil, 5).first
+    assert_equal %w(one two), (1..2).map{ Timeout.timeout(5){ results.pop } }.sort
+    cbs.each{|cb| cb.close }
+  end
+
+  def test_nowait_callbacks
+    cbs = fixtures( *%w(1.txt 2.txt 3.txt) ).map{|f| CB(f) }
+    results = Queue.new
+    AIO.lio_listio( *([AIO::NOWAIT].concat(cbs)) ){|data| results << data }
+    assert_equal %w(one three two), (1..3).map{ Timeout.timeout(5){ results.pop } }.sort
+    cbs.each{|cb| cb.close }
+  end
+
+  def test_read_callback
+    result = nil
+    assert_equal 'one', AIO.read( CB('1.txt') ){|data| result = data }
+    assert_equal 'one', result
+  end
+
+  def test_request_handles
+    cbs = fixtures( *%w(1.txt 2.txt 3.txt 4.txt) ).map{|f| CB(f) }
+    batch = AIO.lio_listio( *([AIO::NOWAIT].concat(cbs)) )
+    assert_equal cbs, batch.requests.map{|r| r.cb }
+    assert_instance_of AIO::Request, AIO.wait_any([batch], 5)
+    assert AIO.wait_all([batch], 5)
+    assert_equal %w(one two three four), batch.value
+    assert_equal 'one', batch.requests.first.value
+    assert batch.requests.all?{|r| r.ready? }
+  ensure
+    cbs.each{|cb| cb.close }
+  end
+
+  def test_request_timeout
+    # glibc services reads with pread, which fails outright on a pipe
+    return unless AIO::BACKEND == 'io_uring'
+    r, w = IO.pipe
+    cb = AIO::CB.new
+    cb.fildes = r.fileno
+    cb.nbytes = 4
+    cb.offset = 0
+    batch = AIO.lio_listio( AIO::NOWAIT, cb )
+    request = batch.requests.first
+    assert !request.ready?
+    assert_equal false, request.wait(0.1)
+    assert_equal nil, AIO.wait_any([request], 0.1)
+    assert_equal false, AIO.wait_all([batch], 0.1)
+    w.write 'pipe'
+    assert request.wait(5)
+    assert_equal 'pipe', request.value
+  ensure
+    r.close rescue nil
+    w.close rescue nil
+  end
+
+  def test_priority_classes
+    share = AIO.background_share
+    AIO.background_share = 0.1
+    File.open(fixture('2.txt')) do |f|
+      cbs = (1..100).map do |i|
+        cb = AIO::CB.new; cb.fildes = f.fileno; cb.nbytes = 3
+        cb.priority = [AIO::INTERACTIVE, AIO::NORMAL, AIO::BACKGROUND][i % 3]
+        cb.deadline = 1.0 / i if i % 2 == 0
+        cb
+      end
+      assert_equal ['two'] * 100, AIO.lio_listio( *cbs )
+      assert_equal ['two'] * 100, AIO.lio_listio( AIO::NOWAIT, *cbs ).value
+    end
+    assert_aio_error do
+      AIO.background_share = 2
+    end
+  ensure
+    AIO.background_share = share
+  end
+
+  def test_deadline_cancels_in_flight
+    return unless AIO::BACKEND == 'io_uring'
+    r, w = IO.pipe
+    cb = AIO::CB.new
+    cb.fildes = r.fileno
+    cb.nbytes = 4
+    cb.deadline = 0.05
+    batch = AIO.lio_listio( AIO::NOWAIT, cb )
+    assert batch.wait(5)
+    assert_aio_error do
+      batch.value
+    end
+  ensure
+    r.close rescue nil
+    w.close rescue nil
+  end
+
+  def test_backend
+    assert %w(io_uring posix).include?( AIO::BACKEND )
+    assert_equal 'posix', AIO::BACKEND if ENV['AIO_BACKEND'] == 'posix'
+  end
+
   def test_write
     cb = WCB('1.txt','w+')
     assert cb.open?
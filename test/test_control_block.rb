@@ -81,6 +81,29 @@ class TestControlBlock < Test::Unit::TestCase
     assert_equal '', @cb.to_s    
   end  
 
+  def test_buffer_arena
+    leased = AIO.arena[:leased]
+    @cb.nbytes = 5000
+    assert_equal leased + 8192, AIO.arena[:leased]
+    @cb.buf = 'buffer'
+    assert_equal 'buffer', @cb.buf
+    assert_equal leased + 8192, AIO.arena[:leased]
+    @cb.reset
+    assert_equal leased, AIO.arena[:leased]
+  end
+
+  def test_buffer_arena_reuse
+    @cb.open( fixture( '1.txt' ) )
+    assert_equal 'one', AIO.read( @cb )
+    hits = AIO.arena[:hits]
+    cb = CB('2.txt')
+    assert_equal 'two', AIO.read( cb )
+    assert_equal hits + 1, AIO.arena[:hits]
+  ensure
+    @cb.close
+    cb.close if cb
+  end
+
   def test_nbytes
     assert_equal 0, @cb.nbytes
     assert_equal 4096, @cb.nbytes = 4096
@@ -97,6 +120,11 @@ class TestControlBlock < Test::Unit::TestCase
     end
   end  
   
+  def test_large_offset
+    assert_equal 2 ** 33, @cb.offset = 2 ** 33
+    assert_equal 2 ** 33, @cb.offset
+  end
+
   def test_reqprio
     assert_equal 0, @cb.reqprio
     assert_equal 10, @cb.reqprio = 10
@@ -105,6 +133,45 @@ class TestControlBlock < Test::Unit::TestCase
     end
   end  
 
+  def test_priority
+    assert_equal AIO::NORMAL, @cb.priority
+    assert_equal AIO::BACKGROUND, @cb.priority = AIO::BACKGROUND
+    assert_aio_error do
+      @cb.priority = 12
+    end
+  end
+
+  def test_deadline
+    assert_nil @cb.deadline
+    assert_equal 0.5, @cb.deadline = 0.5
+    assert_equal 0.5, @cb.deadline
+    assert_nil @cb.deadline = nil
+    assert_aio_error do
+      @cb.deadline = -1
+    end
+  end
+
+  def test_direct
+    cb = AIO::CB.new(fixture('1.txt'), 'r', :direct => true)
+    assert cb.direct?
+    assert cb.alignment > 0
+    assert_equal cb.alignment, cb.nbytes
+    assert_equal cb, cb.validate
+    cb.offset = 1
+    assert_aio_error{ cb.validate }
+    cb.offset = 0
+    cb.nbytes = cb.alignment + 1
+    assert_aio_error{ cb.validate }
+    cb.nbytes = cb.alignment
+    assert_equal %w(one), AIO.lio_listio( cb )
+    cb = AIO::CB.new(fixture('1.txt'), 'r', :direct => true)
+    assert_equal false, cb.direct = false
+    assert !cb.direct?
+    assert_nil cb.alignment
+  ensure
+    cb.close if cb
+  end
+
   def test_lio_opcode
     assert_equal AIO::READ, @cb.lio_opcode
     assert_equal AIO::WRITE, @cb.lio_opcode = AIO::WRITE
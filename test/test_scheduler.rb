@@ -0,0 +1,148 @@
+$:.unshift "."
+require File.dirname(__FILE__) + '/helper'
+require 'thread'
+
+if defined?(AIO::Scheduler)
+Warning[:experimental] = false if defined?(Warning) && Warning.respond_to?(:[]=)
+
+# A minimal select(2) based Fiber::Scheduler, just enough to drive AIO::Scheduler
+class TestScheduler
+  include AIO::Scheduler
+
+  attr_reader :blocked
+
+  def initialize
+    @readable, @writable, @waiting = {}, {}, {}
+    @ready = []
+    @blocked = 0
+    @lock = Mutex.new
+    @urgent = IO.pipe
+  end
+
+  def run
+    while @readable.any? || @writable.any? || @waiting.any? || @blocked > 0 || @ready.any?
+      readable, writable = IO.select(@readable.keys + [@urgent.first], @writable.keys, [], next_timeout)
+      readable.to_a.each{|io| io == @urgent.first ? io.read_nonblock(1024, exception: false) : @readable.delete(io).resume }
+      writable.to_a.each{|io| @writable.delete(io).resume }
+      @waiting.select{|f, t| t <= now }.each{|f, t| @waiting.delete(f); f.resume if f.alive? }
+      ready, @ready = @lock.synchronize{ [@ready, []] }
+      ready.each{|f| f.resume if f.alive? }
+    end
+  end
+
+  def io_wait(io, events, timeout)
+    @readable[io] = Fiber.current if events & IO::READABLE != 0
+    @writable[io] = Fiber.current if events & IO::WRITABLE != 0
+    Fiber.yield
+    events
+  end
+
+  def kernel_sleep(duration = nil)
+    @waiting[Fiber.current] = now + (duration || 0)
+    Fiber.yield
+  end
+
+  def block(blocker, timeout = nil)
+    @blocked += 1
+    Fiber.yield
+  ensure
+    @blocked -= 1
+  end
+
+  def unblock(blocker, fiber)
+    @lock.synchronize do
+      @ready << fiber
+      @urgent.last.write('.') unless @urgent.last.closed?
+    end
+  end
+
+  def fiber(&block)
+    Fiber.new(blocking: false, &block).tap(&:resume)
+  end
+
+  def close
+    run
+    @lock.synchronize{ @urgent.each(&:close) }
+  end
+
+  private
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def next_timeout
+    @waiting.values.map{|t| [t - now, 0].max }.min || (@blocked > 0 ? 0.1 : nil)
+  end
+end
+
+class TestAioScheduler < Test::Unit::TestCase
+  def schedule(&block)
+    thread = Thread.new do
+      scheduler = TestScheduler.new
+      Fiber.set_scheduler(scheduler)
+      Fiber.schedule(&block)
+    end
+    thread.join
+  end
+
+  def test_file_read
+    data = nil
+    schedule{ data = File.read(fixture('1.txt')) }
+    assert_equal 'one', data
+  end
+
+  def test_concurrent_reads
+    paths = fixtures(*(1..8).map{|f| "#{f}.txt" })
+    data = {}
+    schedule do
+      paths.each{|p| Fiber.schedule{ data[p] = File.open(p){|f| f.read } } }
+    end
+    assert_equal paths.map{|p| IO.read(p) }, paths.map{|p| data[p] }
+  end
+
+  def test_write
+    path = scratch('scheduler.txt')
+    schedule do
+      File.open(path, 'w'){|f| f.sync = true; f.write('hello'); f.write(' world') }
+    end
+    assert_equal 'hello world', IO.read(path)
+  ensure
+    File.unlink(path) rescue nil
+  end
+
+  # IO#pread / IO#pwrite don't reach the hooks with the GVL held on every Ruby
+  # version, so they're driven directly.
+  def test_pread_pwrite
+    path = scratch('scheduler.txt')
+    File.open(path, 'w'){|f| f.write('xxxxx') }
+    written, read, data = nil
+    schedule do
+      File.open(path, 'r+') do |f|
+        written = Fiber.scheduler.io_pwrite(f, IO::Buffer.for('ab'), 2, 2, 0)
+        buffer = IO::Buffer.new(3)
+        read = Fiber.scheduler.io_pread(f, buffer, 1, 3, 0)
+        data = buffer.get_string
+      end
+    end
+    assert_equal [2, 3], [written, read]
+    assert_equal 'xab', data
+    assert_equal 'xxabx', IO.read(path)
+  ensure
+    File.unlink(path) rescue nil
+  end
+
+  def test_pipe
+    data = nil
+    r, w = IO.pipe
+    schedule do
+      Fiber.schedule{ data = r.read(4) }
+      Fiber.schedule{ w.write('pipe') }
+    end
+    assert_equal 'pipe', data
+  ensure
+    r.close rescue nil
+    w.close rescue nil
+  end
+end
+
+end